@@ -1,13 +1,35 @@
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <new>
 #include <seqan/file.h>
 #include <seqan/bam_io.h>
 #include <set>
 #include <map>
 #include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <seqan/align.h>
 #include <seqan/sequence.h>
 #include <seqan/seq_io.h>
 #include <seqan/store.h>
+#include "bgzf_writer.h"
+#include "bgzf_reader.h"
+#include "bam_raw_record.h"
+#include "fetch_plan.h"
+#include "read_name_table.h"
+#include "coverage_window.h"
+#include "coverage_estimate.h"
+#include "quality_binning.h"
+#include "bam_tags.h"
+#include "read_names.h"
+#include "read_window.h"
+#include "stage_stats.h"
+#include "checkpoint.h"
 
 using namespace std;
 using namespace seqan;
@@ -19,117 +41,343 @@ struct MateEditInfo {
     bool matePrinted = false;
 } ;
 
+typedef ReadNameTable<Pair<MateEditInfo> > TMateEditTable;
+typedef ReadNameTable<BamRawRecord> TAdapterTable;
+
+//Position after which the mate table entry of the record's pair is not needed anymore: both reads have been read and
+//printed once the stream is a fragment length past the later of the two. The read length is added for reads that
+//moved when their ends were trimmed.
+template <typename TRecord>
+__int64 mateExpiry(TRecord const& record, int maxFragLen)
+{
+    return (__int64)std::max(record.beginPos, record.pNext) + maxFragLen + std::max(maxFragLen, (int)readLength(record));
+}
+
+//Counters are 64 bit, a deep whole genome run clips more bases than fit into an int.
 struct DeletionStats {
-    int nSoftClippedBp = 0;
-    int nQualityClippedBp = 0;
-    int nAdapterClippedBp = 0;
-    int nMatchRemovedReads = 0;
-    int nAdapterReads = 0;
-    unsigned nTotalReads = 0;
-    unsigned nCoverageFiltered = 0;
+    __uint64 nSoftClippedBp = 0;
+    __uint64 nQualityClippedBp = 0;
+    __uint64 nAdapterClippedBp = 0;
+    __uint64 nMatchRemovedReads = 0;
+    __uint64 nAdapterReads = 0;
+    __uint64 nTotalReads = 0;
+    __uint64 nCoverageFiltered = 0;
+    size_t maxMateEntries = 0;
+    size_t maxAdapterEntries = 0;
+    size_t maxWindowReads = 0;
+    size_t nAllocations = 0;
+    size_t nPrefetchedRanges = 0;
+    size_t nRangesRead = 0;
+    size_t nCachedRanges = 0;
+    double stallSeconds = 0.0;
+
+    DeletionStats& operator+=(DeletionStats const & other)
+    {
+        nSoftClippedBp += other.nSoftClippedBp;
+        nQualityClippedBp += other.nQualityClippedBp;
+        nAdapterClippedBp += other.nAdapterClippedBp;
+        nMatchRemovedReads += other.nMatchRemovedReads;
+        nAdapterReads += other.nAdapterReads;
+        nTotalReads += other.nTotalReads;
+        nCoverageFiltered += other.nCoverageFiltered;
+        maxMateEntries = std::max(maxMateEntries, other.maxMateEntries);
+        maxAdapterEntries = std::max(maxAdapterEntries, other.maxAdapterEntries);
+        maxWindowReads = std::max(maxWindowReads, other.maxWindowReads);
+        nAllocations += other.nAllocations;
+        nPrefetchedRanges += other.nPrefetchedRanges;
+        nRangesRead += other.nRangesRead;
+        nCachedRanges += other.nCachedRanges;
+        stallSeconds += other.stallSeconds;
+        return *this;
+    }
+
+    //Subtracts the counters; the largest sizes are left as they are.
+    DeletionStats& operator-=(DeletionStats const & other)
+    {
+        nSoftClippedBp -= other.nSoftClippedBp;
+        nQualityClippedBp -= other.nQualityClippedBp;
+        nAdapterClippedBp -= other.nAdapterClippedBp;
+        nMatchRemovedReads -= other.nMatchRemovedReads;
+        nAdapterReads -= other.nAdapterReads;
+        nTotalReads -= other.nTotalReads;
+        nCoverageFiltered -= other.nCoverageFiltered;
+        nAllocations -= other.nAllocations;
+        nPrefetchedRanges -= other.nPrefetchedRanges;
+        nRangesRead -= other.nRangesRead;
+        nCachedRanges -= other.nCachedRanges;
+        stallSeconds -= other.stallSeconds;
+        return *this;
+    }
+} ;
+
+//The counters a checkpoint keeps, with the largest sizes. The input counters start again in a resumed run.
+std::vector<__uint64> checkpointCounters(DeletionStats const & stats)
+{
+    return {stats.nSoftClippedBp, stats.nQualityClippedBp, stats.nAdapterClippedBp, stats.nMatchRemovedReads, stats.nAdapterReads,
+            stats.nTotalReads, stats.nCoverageFiltered, stats.maxMateEntries, stats.maxAdapterEntries, stats.maxWindowReads};
+}
+
+bool restoreCounters(DeletionStats& stats, std::vector<__uint64> const & counters)
+{
+    if (counters.size() != 10)
+        return false;
+    stats.nSoftClippedBp = counters[0];
+    stats.nQualityClippedBp = counters[1];
+    stats.nAdapterClippedBp = counters[2];
+    stats.nMatchRemovedReads = counters[3];
+    stats.nAdapterReads = counters[4];
+    stats.nTotalReads = counters[5];
+    stats.nCoverageFiltered = counters[6];
+    stats.maxMateEntries = counters[7];
+    stats.maxAdapterEntries = counters[8];
+    stats.maxWindowReads = counters[9];
+    return true;
+}
+
+//Every worker thread counts into its own copy, the copies are added to the main thread's at the end.
+thread_local DeletionStats delStats;
+
+//Stages are timed with --stats-json. Like delStats every thread times into its own copy.
+bool stageTiming = false;
+thread_local StageStats stageStats;
+
+//Where a StageTimer of the stage counts, or null if stages are not timed.
+StageTotals * timedStage(Stage stage)
+{
+    return stageTiming ? &stageStats.stages[stage] : NULL;
+}
+
+//Adds the prefetch and stall counters of an input file to the stats, and the blocks it inflated to the stages. The
+//wall time of decompression is the time the filter waited for blocks.
+void addReadStats(DeletionStats& stats, StageStats& stages, BgzfReader const & reader)
+{
+    stats.nPrefetchedRanges += reader.nPrefetched;
+    stats.nRangesRead += reader.nRanges;
+    stats.nCachedRanges += reader.nCached;
+    stats.stallSeconds += reader.stallNanos * 1e-9;
+    stages.stages[STAGE_DECOMPRESS].wallNanos += reader.stallNanos;
+    stages.stages[STAGE_DECOMPRESS].cpuNanos += reader.inflateCpuNanos;
+    stages.stages[STAGE_DECOMPRESS].items += reader.nInflated;
+}
+
+//Allocations made with operator new on this thread, which includes all SeqAn strings and standard containers. The
+//tables, pools and record buffers are reused, so once they have grown to the data filtering should allocate nothing.
+//Only counted in builds with -DBAMSHRINK_COUNT_ALLOCATIONS (bench/filter_bench), which replace the global operator new;
+//bamShrink itself allocates as usual and the count stays 0.
+thread_local size_t allocationCount = 0;
+
+#ifdef BAMSHRINK_COUNT_ALLOCATIONS
+const bool countAllocations = true;
+
+void * operator new(size_t size)
+{
+    ++allocationCount;
+    void * p = malloc(size > 0 ? size : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+//The pointers freed here come from the malloc() above.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void * p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void * p, size_t) noexcept
+{
+    free(p);
+}
+#pragma GCC diagnostic pop
+#else
+const bool countAllocations = false;
+#endif
+
+//Counters and stage times of one interval or contig for the JSON report.
+struct ItemReport {
+    string name;
+    bool filtered = false;
+    DeletionStats stats;
+    StageStats stages;
 } ;
 
-DeletionStats delStats;
+//Reports of all intervals or contigs when stages are timed, each filled in by the thread that filters it.
+std::vector<ItemReport> itemReports;
+
+//Runs filterItem() and keeps what this thread counted and timed meanwhile as the report of the item.
+template <typename TFilterItem>
+int reportItem(unsigned item, BamReader& bamFileIn, TFilterItem filterItem)
+{
+    if (!stageTiming)
+        return filterItem();
+    DeletionStats statsBefore = delStats;
+    StageStats stagesBefore = stageStats;
+    addReadStats(statsBefore, stagesBefore, bamFileIn.bgzf);
+    statsBefore.nAllocations = allocationCount;
+    int returnValue = filterItem();
+    ItemReport& report = itemReports[item];
+    report.stats = delStats;
+    report.stages = stageStats;
+    addReadStats(report.stats, report.stages, bamFileIn.bgzf);
+    report.stats.nAllocations = allocationCount;
+    report.stats -= statsBefore;
+    report.stages -= stagesBefore;
+    report.filtered = true;
+    return returnValue;
+}
 
-void removeBeginReads(map<unsigned, String<BamAlignmentRecord> >& beginPosToReads, map<CharString, Pair<MateEditInfo> >& mateEditMap, unsigned readyPos, unsigned start, unsigned end)
+string jsonString(string const & text)
 {
-    bool sameOrientation;
-    map<unsigned, String<BamAlignmentRecord> >::const_iterator it = beginPosToReads.begin();
-    while (it->first<=readyPos && it->first < start && it!=beginPosToReads.end())
+    string quoted = "\"";
+    for (unsigned i=0; i<text.size(); ++i)
     {
-        String<BamAlignmentRecord> & readsToCheck = beginPosToReads[it->first];
-        String<BamAlignmentRecord> readsToKeep;
-        for (unsigned i=0; i<length(readsToCheck); ++i)
-        {
-        	BamAlignmentRecord & record = readsToCheck[i];
-            sameOrientation = hasFlagRC(record) == hasFlagNextRC(record);
-            if (hasFlagNextUnmapped(record) || hasFlagUnmapped(record))
-                continue;
-            MateEditInfo editInfo;
-            if (sameOrientation)
-                continue;
-            else
-            {
-                if (!hasFlagRC(record))
-                    editInfo = mateEditMap[record.qName].i2;
-                else
-                    editInfo = mateEditMap[record.qName].i1;
-            }
-            int fragLen, pNextAlnLen;
-            if (record.tLen>0)
-            {
-                fragLen = editInfo.fragLenChange - record.beginPos;
-                pNextAlnLen = fragLen - (record.pNext-record.beginPos);
-            }
-            else
-                pNextAlnLen = getAlignmentLengthInRef(record);
-            if ((record.pNext + pNextAlnLen < start && record.beginPos + getAlignmentLengthInRef(record) < start) || editInfo.mateRemoved || (record.pNext > end && record.beginPos > end))
-            {
-                mateEditMap[record.qName].i2.mateRemoved = true;
-                mateEditMap[record.qName].i1.mateRemoved = true;
-                continue;
-            }
-            else
-                appendValue(readsToKeep, record);
-        }
-        beginPosToReads[it->first] = readsToKeep;
-        ++it;
+        if (text[i] == '"' || text[i] == '\\')
+            quoted += '\\';
+        if ((unsigned char)text[i] < 0x20)
+            quoted += ' ';
+        else
+            quoted += text[i];
     }
+    return quoted + "\"";
 }
 
-void removeUnPairReads(map<unsigned, String<BamAlignmentRecord> >& beginPosToReads, map<CharString, Pair<MateEditInfo> >& mateEditMap)
+void writeStagesJson(std::ostream& out, StageStats const & stages)
 {
-    bool sameOrientation;
-    map<unsigned, String<BamAlignmentRecord> >::const_iterator itEnd = beginPosToReads.end();
-    for (map<unsigned, String<BamAlignmentRecord> >::const_iterator it = beginPosToReads.begin(); it != itEnd; ++it)
+    out << "{";
+    for (unsigned s=0; s<STAGE_COUNT; ++s)
     {
-        String<BamAlignmentRecord> & readsToCheck = beginPosToReads[it->first];
-        String<BamAlignmentRecord> readsToKeep;
-        for (unsigned i=0; i<length(readsToCheck); ++i)
-        {
-            BamAlignmentRecord & record = readsToCheck[i];
-            if (hasFlagNextUnmapped(record) || hasFlagUnmapped(record))
-                continue;
-            sameOrientation = hasFlagRC(record) == hasFlagNextRC(record);
-            MateEditInfo editInfo;
-            if (sameOrientation)
-                continue;
-            else
-            {
-                if (!hasFlagRC(record))
-                    editInfo = mateEditMap[record.qName].i2;
-                else
-                    editInfo = mateEditMap[record.qName].i1;
-            }
-            if (editInfo.matePrinted)
-                appendValue(readsToKeep, record);
-        }
-        beginPosToReads[it->first] = readsToKeep;
+        StageTotals const & stage = stages.stages[s];
+        out << (s == 0 ? "" : ", ") << jsonString(STAGE_NAMES[s]) << ": {\"wall_s\": " << stage.wallNanos*1e-9 << ", \"cpu_s\": " << stage.cpuNanos*1e-9 << ", \"items\": " << stage.items << "}";
     }
-    return;
+    out << "}";
+}
+
+void writeCountsJson(std::ostream& out, DeletionStats const & stats)
+{
+    out << "\"reads\": " << stats.nTotalReads << ", \"coverage_filtered_reads\": " << stats.nCoverageFiltered << ", \"match_removed_reads\": " << stats.nMatchRemovedReads << ", \"adapter_reads\": " << stats.nAdapterReads;
+    out << ", \"soft_clipped_bp\": " << stats.nSoftClippedBp << ", \"quality_clipped_bp\": " << stats.nQualityClippedBp << ", \"adapter_clipped_bp\": " << stats.nAdapterClippedBp;
+    if (countAllocations)
+        out << ", \"allocations\": " << stats.nAllocations;
+    out << ", \"chunk_ranges_read\": " << stats.nRangesRead << ", \"chunk_ranges_cached\": " << stats.nCachedRanges << ", \"chunk_ranges_prefetched\": " << stats.nPrefetchedRanges;
 }
 
-void removeTags(BamAlignmentRecord& record, bool keepMapQual)
+//Writes the totals, and the reports of the items that were filtered, as JSON. Stages nest: quality_filter includes
+//adapter_removal, window_flush includes tag_filter and write, and parse includes waiting for input blocks.
+bool writeStatsJson(CharString const & path, DeletionStats const & stats, StageStats const & stages, double wallSeconds, double cpuSeconds)
 {
-    BamTagsDict tagsDict(record.tags);
-    unsigned numOfTags = length(tagsDict);
-    String<CharString> keysToErase;
-    for (unsigned i=0; i<numOfTags; ++i)
+    std::ofstream out(toCString(path));
+    if (!out)
+        return false;
+    out << "{\n  \"total\": {\"wall_s\": " << wallSeconds << ", \"cpu_s\": " << cpuSeconds << ", ";
+    writeCountsJson(out, stats);
+    out << ", \"peak_mate_entries\": " << stats.maxMateEntries << ", \"peak_adapter_entries\": " << stats.maxAdapterEntries << ", \"peak_window_reads\": " << stats.maxWindowReads;
+    out << ",\n    \"stages\": ";
+    writeStagesJson(out, stages);
+    out << "},\n  \"items\": [";
+    bool first = true;
+    for (unsigned i=0; i<itemReports.size(); ++i)
+    {
+        if (!itemReports[i].filtered)
+            continue;
+        out << (first ? "\n" : ",\n") << "    {\"name\": " << jsonString(itemReports[i].name) << ", ";
+        writeCountsJson(out, itemReports[i].stats);
+        out << ",\n     \"stages\": ";
+        writeStagesJson(out, itemReports[i].stages);
+        out << "}";
+        first = false;
+    }
+    out << "\n  ]\n}\n";
+    return (bool)out;
+}
+
+//Holds the reads a worker has made ready for output, BAM encoded, so the main thread can write them in order. Once a
+//buffer grows past MAX_BUFFER_BYTES it is moved to a temporary file (spillPath) that is unlinked as soon as it is created.
+struct RecordBuffer {
+    static const unsigned MAX_BUFFER_BYTES = 64 * 1024 * 1024;
+
+    CharString data;
+    CharString spillPath;
+    FILE * spillFile = NULL;
+    BamFileIn::TDependentContext * context = NULL;
+
+    RecordBuffer() {}
+    RecordBuffer(RecordBuffer const &) = delete;
+    ~RecordBuffer()
     {
-        CharString key = getTagKey(tagsDict, i);
-        if (!(key == "RG" || (key == "MQ" && keepMapQual)))
-            appendValue(keysToErase, key);
+        if (spillFile != NULL)
+            fclose(spillFile);
     }
-    for (unsigned i=0; i<length(keysToErase); ++i)
-        eraseTag(tagsDict, keysToErase[i]);
-    return;
+} ;
+
+//Drops reads in front of the interval whose mates are not in it.
+void removeBeginReads(ReadWindow& readWindow, TMateEditTable& mateEditMap, unsigned readyPos, unsigned start, unsigned end)
+{
+    if (start == 0)
+        return;
+    dropReads(readWindow, std::min(readyPos, start-1), [&](BamRawRecord& record)
+    {
+        bool sameOrientation = hasFlagRC(record) == hasFlagNextRC(record);
+        if (hasFlagNextUnmapped(record) || hasFlagUnmapped(record))
+            return false;
+        MateEditInfo editInfo;
+        if (sameOrientation)
+            return false;
+        Pair<MateEditInfo>& mateEdit = entryValue(mateEditMap, insertName(mateEditMap, record.qName));
+        if (!hasFlagRC(record))
+            editInfo = mateEdit.i2;
+        else
+            editInfo = mateEdit.i1;
+        int fragLen, pNextAlnLen;
+        if (record.tLen>0)
+        {
+            fragLen = editInfo.fragLenChange - record.beginPos;
+            pNextAlnLen = fragLen - (record.pNext-record.beginPos);
+        }
+        else
+            pNextAlnLen = getAlignmentLengthInRef(record);
+        if (((unsigned)(record.pNext + pNextAlnLen) < start && record.beginPos + getAlignmentLengthInRef(record) < start) || editInfo.mateRemoved || ((unsigned)record.pNext > end && (unsigned)record.beginPos > end))
+        {
+            mateEdit.i2.mateRemoved = true;
+            mateEdit.i1.mateRemoved = true;
+            return false;
+        }
+        return true;
+    });
+}
+
+//Drops the paired reads that are left at the end of an interval, except those whose mate has been written.
+void removeUnPairReads(ReadWindow& readWindow, TMateEditTable& mateEditMap)
+{
+    dropReads(readWindow, READ_WINDOW_NONE, [&](BamRawRecord& record)
+    {
+        if (hasFlagNextUnmapped(record) || hasFlagUnmapped(record))
+            return false;
+        bool sameOrientation = hasFlagRC(record) == hasFlagNextRC(record);
+        MateEditInfo editInfo;
+        if (sameOrientation)
+            return false;
+        unsigned mate = findName(mateEditMap, record.qName);
+        if (mate != READ_NAME_NONE)
+        {
+            if (!hasFlagRC(record))
+                editInfo = entryValue(mateEditMap, mate).i2;
+            else
+                editInfo = entryValue(mateEditMap, mate).i1;
+        }
+        return editInfo.matePrinted;
+    });
 }
 
-void makeUnpaired(BamAlignmentRecord& record, bool keepMapQual)
+//Set from the options before any reads are filtered, read-only afterwards.
+TagFilter tagFilter;
+
+void makeUnpaired(BamAlignmentRecordCore& record, bool keepMapQual)
 {
     record.tLen = 0;
-    record.pNext = record.INVALID_POS;
-    record.rNextId = record.INVALID_REFID;
+    record.pNext = BamAlignmentRecord::INVALID_POS;
+    record.rNextId = BamAlignmentRecord::INVALID_REFID;
     //unset: FlagNextUnmapped, FlagAllProper,FlagMultiple, FlagNextRC:
     record.flag &= ~BAM_FLAG_NEXT_UNMAPPED;
     record.flag &= ~BAM_FLAG_ALL_PROPER;
@@ -137,183 +385,171 @@ void makeUnpaired(BamAlignmentRecord& record, bool keepMapQual)
     record.flag &= ~BAM_FLAG_NEXT_RC;
 }
 
-void printReadyReads(map<CharString, Pair<MateEditInfo> >& mateEditMap, map<unsigned, String<BamAlignmentRecord> >& beginPosToReads, unsigned readyPos, BamFileOut& bamFileOut, map<CharString, unsigned>& readNameToNum, unsigned& currIdx, bool keepMapQual, Pair<unsigned> start_end)
+void writeReadyRecord(BamWriter& bamFileOut, BamRawRecord& record, ReadNamer& namer)
 {
-    bool sameOrientation;
-    map<unsigned, String<BamAlignmentRecord> >::const_iterator it = beginPosToReads.begin();
-    while (it->first<=readyPos && it!=beginPosToReads.end())
-    {
-        String<BamAlignmentRecord> & readsToWrite = beginPosToReads[it->first];
-        for (unsigned i=0; i<length(readsToWrite); ++i)
-        {
-        	BamAlignmentRecord & record = readsToWrite[i];
-            MateEditInfo editInfo;
-            sameOrientation = hasFlagRC(record) == hasFlagNextRC(record);
-            if (hasFlagMultiple(record) && !sameOrientation)
-            {
-                if (!hasFlagRC(record))
-                {
-                    editInfo = mateEditMap[record.qName].i2;
-                    if (editInfo.matePrinted)
-                        mateEditMap.erase(record.qName);
-                    else
-                        mateEditMap[record.qName].i1.matePrinted = true;
-                }
-                else
-                {
-                    editInfo = mateEditMap[record.qName].i1;
-                    if (editInfo.matePrinted)
-                        mateEditMap.erase(record.qName);
-                    else
-                        mateEditMap[record.qName].i2.matePrinted = true;
-                }
-                if (!editInfo.matePrinted && record.beginPos > record.pNext)
-                    continue;
-                if (editInfo.mateRemoved)
-                {
-                    makeUnpaired(record, keepMapQual);
-                    mateEditMap.erase(record.qName);
-                    if (hasFlagUnmapped(record))
-                        continue;
-                }
-                else
-                {
-                    record.pNext += editInfo.beginPosShift;
-                    if (!hasFlagNextUnmapped(record) && !hasFlagUnmapped(record))
-                    {
-                        if (record.tLen>0)
-                            record.tLen = editInfo.fragLenChange - record.beginPos;
-                        else
-                            record.tLen = -1 * (record.beginPos + getAlignmentLengthInRef(record) - editInfo.fragLenChange);
-                    }
-                    else
-                        record.tLen = 0;
-                }
-            }
-            else
-            {
-                mateEditMap.erase(record.qName);
-                makeUnpaired(record, keepMapQual);
-            }
-            if (readNameToNum.count(record.qName) == 0)
-            {
-                if (hasFlagMultiple(record))
-                    readNameToNum[record.qName] = currIdx;
-                stringstream ss;
-                ss << currIdx;
-                CharString str = ss.str();
-                record.qName = str;
-                ++currIdx;
-            }
-            else
-            {
-                stringstream ss;
-                ss << readNameToNum[record.qName];
-                CharString str = ss.str();
-                record.qName = str;
-                readNameToNum.erase(record.qName);
-            }
-            removeTags(record, keepMapQual);
-            writeRecord(bamFileOut, record);
-        }
-        beginPosToReads.erase(it->first);
-        it = beginPosToReads.begin();
-    }
-    return;
+    StageTimer timer(timedStage(STAGE_WRITE));
+    renameRead(record.qName, hasFlagMultiple(record), namer);
+    writeRecord(bamFileOut, record);
 }
 
-unsigned countMatchingBases(String<CigarElement<> >& cigarString)
+void spillRecordBuffer(RecordBuffer& buffer)
 {
-    unsigned numOfMatches = 0;
-    for (unsigned i=0; i<length(cigarString); ++i)
+    if (buffer.spillFile == NULL)
     {
-        CharString cigarOperation = cigarString[i].operation;
-        string cigarOperationStr = toCString(cigarOperation);
-        if (cigarOperationStr.compare("M")==0)
-            numOfMatches += cigarString[i].count;
+        buffer.spillFile = fopen(toCString(buffer.spillPath), "w+b");
+        if (buffer.spillFile == NULL)
+            throw IOError("Could not create temporary file.");
+        remove(toCString(buffer.spillPath));
     }
-    return numOfMatches;
+    if (fwrite(begin(buffer.data, Standard()), 1, length(buffer.data), buffer.spillFile) != length(buffer.data))
+        throw IOError("Could not write to temporary file.");
+    clear(buffer.data);
 }
 
-bool cigarAndSeqMatch(BamAlignmentRecord& record)
+//Global names depend on the order reads are written in, so they are left to whoever writes the buffer.
+void writeReadyRecord(RecordBuffer& buffer, BamRawRecord& record, ReadNamer& namer)
 {
-    String<CigarElement<> >& cigarString = record.cigar;
-    unsigned counter = 0;
-    for (unsigned i=0; i<length(cigarString); ++i)
-    {
-        CharString cigarOperation = cigarString[i].operation;
-        string cigarOperationStr = toCString(cigarOperation);
-        if (cigarOperationStr.compare("D")!=0)
-            counter += cigarString[i].count;
-    }
-    if (length(record.seq)!=counter)
-        return false;
-    return true;
+    StageTimer timer(timedStage(STAGE_WRITE));
+    if (namer.naming == READ_NAMES_LOCAL)
+        renameRead(record.qName, hasFlagMultiple(record), namer);
+    appendRawRecord(buffer.data, record);
+    if (length(buffer.data) >= RecordBuffer::MAX_BUFFER_BYTES)
+        spillRecordBuffer(buffer);
+}
+
+//Renames and writes the buffered reads in the order they were added, then empties the buffer.
+void writeBufferedRecord(BamWriter& bamFileOut, BamRawRecord& record, char const * raw, ReadNamer& namer)
+{
+    StageTimer timer(timedStage(STAGE_WRITE));
+    parseRawRecord(record, raw);
+    if (namer.naming == READ_NAMES_GLOBAL)
+        renameRead(record.qName, hasFlagMultiple(record), namer);
+    writeRecord(bamFileOut, record);
 }
 
-void resetCigarStringEnd(BamAlignmentRecord& record, unsigned nRemoved, String<CigarElement<> >& removed)
+void writeRecordBuffer(BamWriter& bamFileOut, RecordBuffer& buffer, ReadNamer& namer)
 {
-    String<CigarElement<> >& cigarString = record.cigar;
-    CharString cigarOperation = cigarString[length(cigarString)-1].operation;
-    string cigarOperationStr = toCString(cigarOperation);
-    if (cigarOperationStr.compare("D")==0)
+    CharString raw;
+    BamRawRecord record;
+    __int32 recordLen = 0;
+    if (buffer.spillFile != NULL)
     {
-        appendValue(removed, cigarString[length(cigarString)-1]);
-        erase(cigarString, length(cigarString)-1);
+        rewind(buffer.spillFile);
+        while (fread(&recordLen, 4, 1, buffer.spillFile) == 1)
+        {
+            resize(raw, 4 + recordLen);
+            memcpy(begin(raw, Standard()), &recordLen, 4);
+            if (fread(begin(raw, Standard()) + 4, 1, recordLen, buffer.spillFile) != (size_t)recordLen)
+                throw IOError("Could not read from temporary file.");
+            writeBufferedRecord(bamFileOut, record, begin(raw, Standard()), namer);
+        }
+        fclose(buffer.spillFile);
+        buffer.spillFile = NULL;
     }
-    if (cigarString[length(cigarString)-1].count > nRemoved)
+    for (unsigned pos = 0; pos < length(buffer.data); pos += 4 + recordLen)
     {
-        CigarElement<> t = cigarString[length(cigarString)-1];
-        t.count = nRemoved;
-        appendValue(removed, t);
-        cigarString[length(cigarString)-1].count -= nRemoved;
-        return;
+        memcpy(&recordLen, begin(buffer.data, Standard()) + pos, 4);
+        writeBufferedRecord(bamFileOut, record, begin(buffer.data, Standard()) + pos, namer);
     }
-    else
+    clear(buffer.data);
+    shrinkToFit(buffer.data);
+}
+
+template <typename TTarget>
+void printReadyReads(TMateEditTable& mateEditMap, ReadWindow& readWindow, unsigned readyPos, TTarget& target, ReadNamer& namer, bool keepMapQual, Pair<unsigned> start_end)
+{
+    StageTimer timer(timedStage(STAGE_FLUSH));
+    flushReads(readWindow, readyPos, [&](BamRawRecord& record)
     {
-        if (cigarString[length(cigarString)-1].count == nRemoved)
+        MateEditInfo editInfo;
+        bool sameOrientation = hasFlagRC(record) == hasFlagNextRC(record);
+        if (hasFlagMultiple(record) && !sameOrientation)
         {
-            appendValue(removed, cigarString[length(cigarString)-1]);
-            erase(cigarString, length(cigarString)-1);
-            cigarOperation = cigarString[length(cigarString)-1].operation;
-            cigarOperationStr = toCString(cigarOperation);
-            if (cigarOperationStr.compare("D")==0)
+            unsigned mate = insertName(mateEditMap, record.qName);
+            Pair<MateEditInfo>& mateEdit = entryValue(mateEditMap, mate);
+            if (!hasFlagRC(record))
+            {
+                editInfo = mateEdit.i2;
+                if (!editInfo.matePrinted)
+                    mateEdit.i1.matePrinted = true;
+            }
+            else
             {
-                appendValue(removed, cigarString[length(cigarString)-1]);
-                erase(cigarString, length(cigarString)-1);
+                editInfo = mateEdit.i1;
+                if (!editInfo.matePrinted)
+                    mateEdit.i2.matePrinted = true;
+            }
+            //Once both reads of the pair are written its entry is not needed anymore.
+            if (editInfo.matePrinted)
+                eraseHandle(mateEditMap, mate);
+            if (!editInfo.matePrinted && record.beginPos > record.pNext)
+                return;
+            if (editInfo.mateRemoved)
+            {
+                makeUnpaired(record, keepMapQual);
+                if (!editInfo.matePrinted)
+                    eraseHandle(mateEditMap, mate);
+                if (hasFlagUnmapped(record))
+                    return;
+            }
+            else
+            {
+                record.pNext += editInfo.beginPosShift;
+                if (!hasFlagNextUnmapped(record) && !hasFlagUnmapped(record))
+                {
+                    if (record.tLen>0)
+                        record.tLen = editInfo.fragLenChange - record.beginPos;
+                    else
+                        record.tLen = -1 * (record.beginPos + getAlignmentLengthInRef(record) - editInfo.fragLenChange);
+                }
+                else
+                    record.tLen = 0;
             }
-            return;
         }
         else
         {
-            unsigned nLeft = nRemoved - cigarString[length(cigarString)-1].count;
-            appendValue(removed, cigarString[length(cigarString)-1]);
-            erase(cigarString, length(cigarString)-1);
-            resetCigarStringEnd(record, nLeft, removed);
+            eraseName(mateEditMap, record.qName);
+            makeUnpaired(record, keepMapQual);
         }
-    }
+        {
+            StageTimer tagTimer(timedStage(STAGE_TAGS));
+            filterTags(record, tagFilter);
+        }
+        writeReadyRecord(target, record, namer);
+    });
+}
+
+unsigned countMatchingBases(BamRawRecord const& record)
+{
+    return cigarLength(cigarBegin(record), record._n_cigar, BAM_CIGAR_ALIGNED);
+}
+
+bool cigarAndSeqMatch(BamRawRecord const& record)
+{
+    return readLength(record) == cigarQueryLength(cigarBegin(record), record._n_cigar);
 }
 
-bool qualityClipEnd(BamAlignmentRecord& record, int windowSize, map<CharString, Pair<MateEditInfo> >& mateEditMap)
+bool qualityClipEnd(BamRawRecord& record, int windowSize, Pair<MateEditInfo>& mateEdit)
 {
     bool sameOrientation = hasFlagRC(record) == hasFlagNextRC(record);
+    char const* qual = qualBegin(record);
+    int len = readLength(record);
     int qualSum = 0;
-    for (unsigned i = length(record.qual)-1; i>=length(record.qual)-windowSize; --i)
-        qualSum += (record.qual[i]-33);
+    for (int i = len-1; i>=len-windowSize; --i)
+        qualSum += qual[i];
     int averageQual = round((double)qualSum/(double)windowSize);
     if (averageQual>=25)
         return true;
     int index = 0;
-    while (averageQual<25 && index < length(record.qual))
+    while (averageQual<25 && index < len)
     {
         ++index;
-        qualSum -= (record.qual[length(record.qual)-index]-33);
-        qualSum += (record.qual[length(record.qual)-windowSize-index]-33);
+        qualSum -= qual[len-index];
+        qualSum += qual[len-windowSize-index];
         averageQual = round((double)qualSum/(double)windowSize);
     }
     delStats.nQualityClippedBp += index;
-    erase(record.seq, length(record.seq)-index, length(record.seq));
-    erase(record.qual,length(record.qual)-index, length(record.qual));
+    trimBases(record, 0, index);
     if (hasFlagRC(record) && !sameOrientation)
     {
         if (record.tLen > 0)
@@ -321,14 +557,13 @@ bool qualityClipEnd(BamAlignmentRecord& record, int windowSize, map<CharString,
         else
             record.tLen += index;
     }
-    String<CigarElement<> > removedCigar;
-    resetCigarStringEnd(record, index, removedCigar);
-    if (length(record.seq)>=50)
+    clipCigarBack(record, index);
+    if (readLength(record)>=50)
     {
         if (!sameOrientation)
         {
             if (hasFlagRC(record))
-                mateEditMap[record.qName].i2.fragLenChange = record.beginPos + getAlignmentLengthInRef(record);
+                mateEdit.i2.fragLenChange = record.beginPos + getAlignmentLengthInRef(record);
         }
         return true;
     }
@@ -337,87 +572,36 @@ bool qualityClipEnd(BamAlignmentRecord& record, int windowSize, map<CharString,
         if (!sameOrientation)
         {
             if (hasFlagRC(record))
-                mateEditMap[record.qName].i2.mateRemoved = true;
+                mateEdit.i2.mateRemoved = true;
             else
-                mateEditMap[record.qName].i1.mateRemoved = true;
+                mateEdit.i1.mateRemoved = true;
         }
         return false;
     }
 }
 
-void resetCigarStringBegin(BamAlignmentRecord& record, unsigned nRemoved, String<CigarElement<> >& removed)
-{
-    String<CigarElement<> >& cigarString = record.cigar;
-    CharString cigarOperation = cigarString[0].operation;
-    string cigarOperationStr = toCString(cigarOperation);
-    if (cigarOperationStr.compare("D")==0)
-    {
-        appendValue(removed, cigarString[0]);
-        erase(cigarString, 0);
-    }
-    if (cigarString[0].count > nRemoved)
-    {
-        CigarElement<> t = cigarString[0];
-        t.count = nRemoved;
-        appendValue(removed, t);
-        cigarString[0].count -= nRemoved;
-        return;
-    }
-    else
-    {
-        if (cigarString[0].count == nRemoved)
-        {
-            appendValue(removed, cigarString[0]);
-            erase(cigarString, 0);
-            cigarOperation = cigarString[0].operation;
-            cigarOperationStr = toCString(cigarOperation);
-            if (cigarOperationStr.compare("D")==0)
-            {
-                appendValue(removed, cigarString[0]);
-                erase(cigarString, 0);
-            }
-            return;
-        }
-        else
-        {
-            unsigned nLeft = nRemoved - cigarString[0].count;
-            appendValue(removed, cigarString[0]);
-            erase(cigarString, 0);
-            resetCigarStringBegin(record, nLeft, removed);
-        }
-    }
-}
-
-bool qualityClipBegin(BamAlignmentRecord& record, int windowSize, map<CharString, Pair<MateEditInfo> >& mateEditMap)
+bool qualityClipBegin(BamRawRecord& record, int windowSize, Pair<MateEditInfo>& mateEdit)
 {
     bool sameOrientation = hasFlagRC(record) == hasFlagNextRC(record);
+    char const* qual = qualBegin(record);
     int qualSum = 0;
-    for (unsigned i = 0; i<windowSize; ++i)
-        qualSum += (record.qual[i]-33);
+    for (int i = 0; i<windowSize; ++i)
+        qualSum += qual[i];
     int averageQual = round((double)qualSum/(double)windowSize);
     if (averageQual>=25)
         return true;
     unsigned index = 0;
-    while (averageQual<25 && index+windowSize < length(record.qual))
+    while (averageQual<25 && index+windowSize < readLength(record))
     {
-        qualSum -= (record.qual[index]-33);
-        qualSum += (record.qual[index+windowSize]-33);
+        qualSum -= qual[index];
+        qualSum += qual[index+windowSize];
         averageQual = round((double)qualSum/(double)windowSize);
         ++index;
     }
     delStats.nQualityClippedBp += index;
-    erase(record.seq, 0, index);
-    erase(record.qual, 0, index);
-    CharString cigarOperation = record.cigar[0].operation;
-    string cigarOperationStr = toCString(cigarOperation);
-    if (cigarOperationStr.compare("I")==0)
-    {
-        int shift = index - record.cigar[0].count;
-        if (shift > 0)
-            record.beginPos += shift;
-    }
-    else
-        record.beginPos += index;
+    trimBases(record, index, 0);
+    //Clipped insertions do not move the start on the reference, a deletion after the clipped bases does.
+    record.beginPos += clipCigarFront(record, index).ref;
     if (!hasFlagRC(record) && !sameOrientation)
     {
         if (record.tLen > 0)
@@ -425,20 +609,18 @@ bool qualityClipBegin(BamAlignmentRecord& record, int windowSize, map<CharString
         else
             record.tLen += index;
     }
-    String<CigarElement<> > removedCigar;
-    resetCigarStringBegin(record, index, removedCigar);
-    if (length(record.seq)>=50)
+    if (readLength(record)>=50)
     {
         if (!sameOrientation)
         {
             if (hasFlagRC(record))
             {
-                mateEditMap[record.qName].i2.beginPosShift += index;
+                mateEdit.i2.beginPosShift += index;
             }
             else
             {
-                mateEditMap[record.qName].i1.beginPosShift += index;
-                mateEditMap[record.qName].i1.fragLenChange = record.beginPos;
+                mateEdit.i1.beginPosShift += index;
+                mateEdit.i1.fragLenChange = record.beginPos;
             }
         }
         return true;
@@ -448,267 +630,237 @@ bool qualityClipBegin(BamAlignmentRecord& record, int windowSize, map<CharString
         if (!sameOrientation)
         {
             if (hasFlagRC(record))
-                mateEditMap[record.qName].i2.mateRemoved = true;
+                mateEdit.i2.mateRemoved = true;
             else
-                mateEditMap[record.qName].i1.mateRemoved = true;
+                mateEdit.i1.mateRemoved = true;
         }
         return false;
     }
 }
 
-bool removeSoftClipped(BamAlignmentRecord& record, map<CharString, Pair<MateEditInfo> >& mateEditMap, unsigned minMatchingBases)
+bool removeSoftClipped(BamRawRecord& record, Pair<MateEditInfo>& mateEdit, unsigned minMatchingBases)
 {
     bool sameOrientation = hasFlagRC(record) == hasFlagNextRC(record);
-    String<CigarElement<> > cigarString = record.cigar;
-    CharString readName = record.qName;
-    CharString cigarOperation = cigarString[0].operation;
-    string cigarOperationStr = toCString(cigarOperation);
-    if (cigarOperationStr.compare("S")==0)
+    unsigned front = 0, back = 0;
+    if (record._n_cigar > 0 && cigarOp(cigarAt(record, 0)) == BAM_CIGAR_S)
     {
-        delStats.nSoftClippedBp += cigarString[0].count;
-        erase(record.seq, 0, cigarString[0].count);
-        erase(record.qual, 0, cigarString[0].count);
-        erase(record.cigar, 0);
+        front = cigarOpLength(cigarAt(record, 0));
+        eraseCigarAt(record, 0);
     }
-    cigarOperation = cigarString[length(cigarString)-1].operation;
-    cigarOperationStr = toCString(cigarOperation);
-    if (cigarOperationStr.compare("S")==0)
+    if (record._n_cigar > 0 && cigarOp(cigarAt(record, record._n_cigar-1)) == BAM_CIGAR_S)
     {
-        delStats.nSoftClippedBp += cigarString[length(cigarString)-1].count;
-        for (unsigned i = 0; i<cigarString[length(cigarString)-1].count; ++i)
-        {
-            eraseBack(record.seq);
-            eraseBack(record.qual);
-        }
-        eraseBack(record.cigar);
+        back = cigarOpLength(cigarAt(record, record._n_cigar-1));
+        eraseCigarAt(record, record._n_cigar-1);
     }
-    if (length(record.seq)>=minMatchingBases)
+    delStats.nSoftClippedBp += front + back;
+    trimBases(record, front, back);
+    if (readLength(record)>=minMatchingBases)
         return true;
     else
     {
         if (!sameOrientation)
         {
             if (hasFlagRC(record))
-                mateEditMap[readName].i2.mateRemoved = true;
+                mateEdit.i2.mateRemoved = true;
             else
-                mateEditMap[readName].i1.mateRemoved = true;
+                mateEdit.i1.mateRemoved = true;
         }
         return false;
     }
 }
 
-bool removeNsAtEnds(BamAlignmentRecord& record, map<CharString, Pair<MateEditInfo> >& mateEditMap, unsigned minMatchingBases)
+//Most reads have no N at either end and are left as they are. At least one base is kept at each end.
+bool removeNsAtEnds(BamRawRecord& record, Pair<MateEditInfo>& mateEdit, unsigned minMatchingBases)
 {
-    CharString firstBaseC = record.seq[0];
-    string firstBase = toCString(firstBaseC);
-    CharString lastBaseC = record.seq[length(record.seq)-1];
-    string lastBase = toCString(lastBaseC);
-    int nOfNs = 0;
-    if (firstBase.compare("N")==0)
+    unsigned len = readLength(record);
+    if (len == 0 || (baseAt(record, 0) != BAM_BASE_N && baseAt(record, len-1) != BAM_BASE_N))
+        return len >= minMatchingBases;
+    bool lastIsN = baseAt(record, len-1) == BAM_BASE_N;
+    if (baseAt(record, 0) == BAM_BASE_N)
     {
-        ++nOfNs;
-        int idx =1;
-        CharString base2checkC = record.seq[idx];
-        string base2check = toCString(base2checkC);
-        while (base2check.compare("N")==0 && idx < length(record.seq)-1)
-        {
+        unsigned nOfNs = 1;
+        while (nOfNs < len-1 && baseAt(record, nOfNs) == BAM_BASE_N)
             ++nOfNs;
-            ++idx;
-            base2checkC = record.seq[idx];
-            base2check = toCString(base2checkC);
-        }
         //Remove ns from beginning of sequence and qual fields:
-        erase(record.seq, 0, nOfNs);
-        erase(record.qual, 0, nOfNs);
+        trimBases(record, nOfNs, 0);
         if (!hasFlagUnmapped(record)) //Only have to fix CIGAR, beginPos and fragLen if the read is mapped.
         {
-            String<CigarElement<> > removedCigar;
-            resetCigarStringBegin(record, nOfNs, removedCigar);
-            int shift = 0;
-            for (unsigned i=0; i<length(removedCigar);++i)
-            {
-                CharString cigarOperation = removedCigar[i].operation;
-                string cigarOperationStr = toCString(cigarOperation);
-                if (cigarOperationStr.compare("M")==0 || cigarOperationStr.compare("D")==0)
-                    shift += removedCigar[i].count;
-            }
+            int shift = clipCigarFront(record, nOfNs).ref;
             record.beginPos += shift;
             if (!hasFlagRC(record))
             {
-                mateEditMap[record.qName].i1.beginPosShift += shift;
-                mateEditMap[record.qName].i1.fragLenChange = record.beginPos;
+                mateEdit.i1.beginPosShift += shift;
+                mateEdit.i1.fragLenChange = record.beginPos;
             }
             else
-                mateEditMap[record.qName].i2.beginPosShift += shift;
-            //cout << "Removed: " << nOfNs << " Ns from beginning of " << record.qName << endl;
+                mateEdit.i2.beginPosShift += shift;
         }
     }
-    if (length(record.seq) < minMatchingBases)
+    if (readLength(record) < minMatchingBases)
         return false;
-    nOfNs = 0;
-    if (lastBase.compare("N")==0)
+    if (lastIsN)
     {
-        ++nOfNs;
-        int idx =length(record.seq)-2;
-        CharString base2checkC = record.seq[idx];
-        string base2check = toCString(base2checkC);
-        while (base2check.compare("N")==0 && idx > 0)
-        {
+        len = readLength(record);
+        unsigned nOfNs = 1;
+        while (nOfNs < len-1 && baseAt(record, len-1-nOfNs) == BAM_BASE_N)
             ++nOfNs;
-            --idx;
-            base2checkC = record.seq[idx];
-            base2check = toCString(base2checkC);
-        }
         //Remove ns from end of sequence and qual fields:
-        erase(record.seq, length(record.seq)-nOfNs, length(record.seq));
-        erase(record.qual,length(record.qual)-nOfNs, length(record.qual));
+        trimBases(record, 0, nOfNs);
         if (!hasFlagUnmapped(record)) //Only have to fix CIGAR, beginPos and fragLen if the read is mapped.
         {
-            String<CigarElement<> > removedCigar;
-            resetCigarStringEnd(record, nOfNs, removedCigar);
+            clipCigarBack(record, nOfNs);
             if (hasFlagRC(record))
-                mateEditMap[record.qName].i2.fragLenChange = record.beginPos + getAlignmentLengthInRef(record);
-            //cout << "Removed: " << nOfNs << " Ns from end of " << record.qName << endl;
+                mateEdit.i2.fragLenChange = record.beginPos + getAlignmentLengthInRef(record);
         }
     }
-    if (length(record.seq) < minMatchingBases)
+    if (readLength(record) < minMatchingBases)
         return false;
     return true;
 }
 
-bool qualityFilterLevel2(BamAlignmentRecord& record, map<CharString, Pair<MateEditInfo> >& mateEditMap, unsigned minMatchingBases)
+bool qualityFilterLevel2(BamRawRecord& record, Pair<MateEditInfo>& mateEdit, unsigned minMatchingBases)
 {
-    /*if (!removeSoftClipped(record, mateEditMap))
+    /*if (!removeSoftClipped(record, mateEdit))
         return false;
-    if (!qualityClipBegin(record, 5, mateEditMap))
+    if (!qualityClipBegin(record, 5, mateEdit))
         return false;
-    if (!qualityClipEnd(record, 5, mateEditMap))
+    if (!qualityClipEnd(record, 5, mateEdit))
         return false;*/
-    if (!removeNsAtEnds(record, mateEditMap, minMatchingBases))
+    if (!removeNsAtEnds(record, mateEdit, minMatchingBases))
     {
         ++delStats.nMatchRemovedReads;
-        mateEditMap[record.qName].i2.mateRemoved = true;
-        mateEditMap[record.qName].i1.mateRemoved = true;
+        mateEdit.i2.mateRemoved = true;
+        mateEdit.i1.mateRemoved = true;
         return false;
     }
     if (!hasFlagUnmapped(record))
     {
         if (!cigarAndSeqMatch(record))
             cout << "THE CIGAR STRING AND READ-LENGTH DON'T MATCH: " << record.qName << endl;
-        unsigned matchingBases = countMatchingBases(record.cigar);
+        unsigned matchingBases = countMatchingBases(record);
         if (matchingBases < minMatchingBases)
         {
             ++delStats.nMatchRemovedReads;
-            mateEditMap[record.qName].i2.mateRemoved = true;
-            mateEditMap[record.qName].i1.mateRemoved = true;
+            mateEdit.i2.mateRemoved = true;
+            mateEdit.i1.mateRemoved = true;
             return false;
         }
     }
     return true;
 }
 
-Pair<int> findNum2Clip(BamAlignmentRecord& recordReverse, int forwardStartPos)
-{
-    int num2clip = 0, num2shift = 0;
-    unsigned cigarIndex = 0, reverseStartPos = recordReverse.beginPos, n;
-    CharString cigarOperation = recordReverse.cigar[cigarIndex].operation;
-    string cigarOperationStr = toCString(cigarOperation);
-    if (cigarOperationStr.compare("S")==0)
-    {
-        num2clip = recordReverse.cigar[cigarIndex].count;
-        ++cigarIndex;
-    }
-    for (unsigned i=cigarIndex; i<length(recordReverse.cigar); ++i)
-    {
-        cigarOperation = recordReverse.cigar[cigarIndex].operation;
-        cigarOperationStr = toCString(cigarOperation);
-        n=1;
-        while (reverseStartPos < forwardStartPos && n <= recordReverse.cigar[cigarIndex].count)
-        {
-            if (cigarOperationStr.compare("D")!=0)
-                ++num2clip;
-            if (cigarOperationStr.compare("I")!=0)
-                ++reverseStartPos;
-            ++n;
-        }
-        if (reverseStartPos == forwardStartPos)
-            break;
-        if (reverseStartPos>forwardStartPos)
-            cout << recordReverse.qName << " Reverse startpos has become bigger than forward, reverse beginPos: " << reverseStartPos << " forward beginPos is: " << forwardStartPos << endl;
-        ++cigarIndex;
-    }
-    if (cigarOperationStr.compare("D")==0)
-    {
-        num2shift = recordReverse.cigar[cigarIndex].count - n + 1;
-        if (num2shift > 0)
-            cout << "Will shift reverse read because it starts with a deletion: " << recordReverse.qName << endl;
-    }
-    return Pair<int>(num2clip,num2shift);
-}
-
-bool removeAdapters(BamAlignmentRecord& recordForward, BamAlignmentRecord& recordReverse, map<CharString, Pair<MateEditInfo> >& mateEditMap, unsigned minMatchingBases)
+bool removeAdapters(BamRawRecord& recordForward, BamRawRecord& recordReverse, Pair<MateEditInfo>& mateEdit, unsigned minMatchingBases)
 {
+    StageTimer timer(timedStage(STAGE_ADAPTERS));
     //Check for soft clipped bases at beginning of forward record.
-    CharString cigarOperation = recordForward.cigar[0].operation;
-    string cigarOperationStr = toCString(cigarOperation);
-    if (cigarOperationStr.compare("S")==0)
+    if (recordForward._n_cigar > 0 && cigarOp(cigarAt(recordForward, 0)) == BAM_CIGAR_S)
     {
-        if (recordForward.beginPos - recordForward.cigar[0].count <= recordReverse.beginPos)
+        if (recordForward.beginPos - cigarOpLength(cigarAt(recordForward, 0)) <= (unsigned)recordReverse.beginPos)
         {
             return true;
         }
     }
-    if (!removeSoftClipped(recordForward, mateEditMap, minMatchingBases) || !removeSoftClipped(recordReverse, mateEditMap, minMatchingBases))
+    if (!removeSoftClipped(recordForward, mateEdit, minMatchingBases) || !removeSoftClipped(recordReverse, mateEdit, minMatchingBases))
         return false;
     delStats.nAdapterReads += 2;
     int startPosDiff = recordForward.beginPos - recordReverse.beginPos;
     if (startPosDiff<0)
         return true;
-    Pair<int> clipAndShift = findNum2Clip(recordReverse, recordForward.beginPos);
-    int index = clipAndShift.i1;
-    int shift = clipAndShift.i2;
-    //erase from reverse read bases 0 to index
-    erase(recordReverse.seq, 0, index);
-    erase(recordReverse.qual, 0, index);
-    String<CigarElement<> > removedCigar;
-    resetCigarStringBegin(recordReverse, index, removedCigar);
-    //erase from forward read bases from length(reverse.seq) to end
+    //Clip the reverse read to start where the forward read starts, the clipped bases are adapter.
+    CigarClip clip = clipCigarToRefPos(recordReverse, recordForward.beginPos);
+    unsigned index = clip.query;
+    trimBases(recordReverse, index, 0);
     delStats.nAdapterClippedBp += index;
-    int forwardClip = index;
-    if (length(recordForward.seq)>length(recordReverse.seq) && index>0)
+    //erase from forward read bases from length(reverse.seq) to end
+    if (readLength(recordForward)>readLength(recordReverse) && index>0)
     {
-        forwardClip = length(recordForward.seq) - length(recordReverse.seq);
-        erase(recordForward.seq, length(recordReverse.seq), length(recordForward.seq));
-        erase(recordForward.qual, length(recordReverse.qual), length(recordForward.qual));
+        unsigned forwardClip = readLength(recordForward) - readLength(recordReverse);
+        trimBases(recordForward, 0, forwardClip);
         delStats.nAdapterClippedBp += forwardClip;
-        String<CigarElement<> > removedCigar;
-        resetCigarStringEnd(recordForward, forwardClip, removedCigar);
-    }
-    // if (forwardClip != index)
-    // {
-    //     cout << "Did not clip the same number of bases from both reads! " << recordReverse.qName << endl;
-    //     cout << "Clipped " << index << "bp from beginning of reverse read and " << forwardClip << " from the end of the forward read." << endl;
-    // }
-    recordReverse.beginPos = recordForward.beginPos;
-    if (shift > 0)
-        recordReverse.beginPos += shift;
+        clipCigarBack(recordForward, forwardClip);
+    }
+    recordReverse.beginPos += clip.ref;
+    if (recordReverse.beginPos > recordForward.beginPos)
+        cout << "Will shift reverse read because it starts with a deletion: " << recordReverse.qName << endl;
     recordForward.pNext = recordReverse.beginPos;
-    mateEditMap[recordReverse.qName].i2.fragLenChange = recordReverse.beginPos + getAlignmentLengthInRef(recordReverse);
-    mateEditMap[recordForward.qName].i1.fragLenChange = recordForward.beginPos;
+    mateEdit.i2.fragLenChange = recordReverse.beginPos + getAlignmentLengthInRef(recordReverse);
+    mateEdit.i1.fragLenChange = recordForward.beginPos;
     if (!cigarAndSeqMatch(recordForward))
         cout << "The cigar string and sequence length don't match for the forward read!!" << endl;
     if (!cigarAndSeqMatch(recordReverse))
         cout << "The cigar string and sequence length don't match for the reverse read!!" << endl;
-    if (length(recordForward.seq)>=minMatchingBases)
+    if (readLength(recordForward)>=minMatchingBases)
         return true;
     else
         return false;
 }
 
-bool qualityFilter(BamAlignmentRecord& record, map<CharString, Pair<MateEditInfo> >& mateEditMap, int maxFragmentLength, map<CharString, BamAlignmentRecord>& adapterMap, unsigned minMatchingBases, bool keepMapQual, map<unsigned, String<BamAlignmentRecord> >& beginPosToReads)
+//Set from the options before any reads are filtered, read-only afterwards.
+QualityBinning qualityBinning;
+
+//By default the qualities are binarized: 40 if the phred score is at least 25, 0 otherwise. As when decoding with
+//SeqAn, a first value of 222 means the qualities are missing.
+void binQualities(BamRawRecord& record)
+{
+    char * qual = qualBegin(record);
+    if (qualityBinning.mode == QUALITY_KEEP)
+        return;
+    if (qualityBinning.mode == QUALITY_DROP || (readLength(record) > 0 && (unsigned char)qual[0] == 222))
+    {
+        memset(qual, '\xff', readLength(record));
+        return;
+    }
+    binQualities(qual, readLength(record), qualityBinning, false);
+}
+
+//Filters the reverse read of an adapter pair and moves it into the window if it is kept.
+void queueAdapterMate(BamRawRecord& reverseRecord, Pair<MateEditInfo>& mateEdit, unsigned minMatchingBases, ReadWindow& readWindow)
+{
+    if (qualityFilterLevel2(reverseRecord, mateEdit, minMatchingBases))
+    {
+        binQualities(reverseRecord);
+        moveRead(readWindow, reverseRecord);
+    }
+    else
+        mateEdit.i2.mateRemoved = true;
+}
+
+//Handles a read whose mate overlaps it so much that they run into adapter sequence. The pair is clipped and the reverse
+//read is queued for writing here; returns whether record should be kept. The stored mate is worked on in place and
+//moved on, so its buffers stay with the adapter table.
+bool filterAdapterPair(BamRawRecord& record, bool sameOrientation, Pair<MateEditInfo>& mateEdit, TAdapterTable& adapterMap, unsigned adapterMate, unsigned minMatchingBases, ReadWindow& readWindow)
+{
+    BamRawRecord& storedRecord = entryValue(adapterMap, adapterMate);
+    if (!sameOrientation)
+    {
+        if (hasFlagRC(record))
+            swap(record, storedRecord);
+        bool clipped = removeAdapters(record, storedRecord, mateEdit, minMatchingBases);
+        if (clipped)
+            queueAdapterMate(storedRecord, mateEdit, minMatchingBases, readWindow);
+        eraseHandle(adapterMap, adapterMate);
+        if (!clipped)
+            return false;
+    }
+    else
+    {
+        //The entry stays for the mate, which sees the same name again, so a copy is queued.
+        BamRawRecord reverseRecord = storedRecord;
+        queueAdapterMate(reverseRecord, mateEdit, minMatchingBases, readWindow);
+    }
+    if (!qualityFilterLevel2(record, mateEdit, minMatchingBases))
+        return false;
+    return true;
+}
+
+bool qualityFilter(BamRawRecord& record, TMateEditTable& mateEditMap, int maxFragmentLength, TAdapterTable& adapterMap, unsigned minMatchingBases, bool keepMapQual, ReadWindow& readWindow)
 {
-    MateEditInfo editInfo;
-    BamAlignmentRecord reverseRecord;
+    StageTimer timer(timedStage(STAGE_QUALITY_FILTER));
+    //The entry of this read pair is looked up once and used by all the filters below.
+    unsigned mate = insertName(mateEditMap, record.qName);
+    Pair<MateEditInfo>& mateEdit = entryValue(mateEditMap, mate);
+    __int64 expiry = mateExpiry(record, maxFragmentLength);
+    setExpiry(mateEditMap, mate, expiry);
     bool sameOrientation = hasFlagRC(record) == hasFlagNextRC(record);
     if (hasFlagNextUnmapped(record) && sameOrientation)
     {
@@ -729,130 +881,124 @@ bool qualityFilter(BamAlignmentRecord& record, map<CharString, Pair<MateEditInfo
         sameOrientation = false;
     }
     if (hasFlagRC(record))
-    {
-        if (mateEditMap.count(record.qName)==0)
-            mateEditMap[record.qName].i2 = editInfo;
-        mateEditMap[record.qName].i2.fragLenChange = record.beginPos + getAlignmentLengthInRef(record);
-    }
+        mateEdit.i2.fragLenChange = record.beginPos + getAlignmentLengthInRef(record);
     else
-    {
-        if (mateEditMap.count(record.qName)==0)
-            mateEditMap[record.qName].i1 = editInfo;
-        mateEditMap[record.qName].i1.fragLenChange = record.beginPos;
-    }
+        mateEdit.i1.fragLenChange = record.beginPos;
     if (sameOrientation)
     {
         makeUnpaired(record, keepMapQual);
-        mateEditMap[record.qName].i2.mateRemoved = true;
-        mateEditMap[record.qName].i1.mateRemoved = true;
+        mateEdit.i2.mateRemoved = true;
+        mateEdit.i1.mateRemoved = true;
     }
     //if (hasFlagDuplicate(record) || hasFlagUnmapped(record))
     if (hasFlagDuplicate(record))
     {
         if (hasFlagRC(record))
-            mateEditMap[record.qName].i2.mateRemoved = true;
+            mateEdit.i2.mateRemoved = true;
         else
-            mateEditMap[record.qName].i1.mateRemoved = true;
+            mateEdit.i1.mateRemoved = true;
         return false;
     }
     //if (hasFlagNextUnmapped(record) || abs(record.tLen) > maxFragmentLength || record.rID != record.rNextId)
     if (abs(record.tLen) > maxFragmentLength || record.rID != record.rNextId)
     {
         makeUnpaired(record, keepMapQual);
-        mateEditMap[record.qName].i2.mateRemoved = true;
-        mateEditMap[record.qName].i1.mateRemoved = true;
+        mateEdit.i2.mateRemoved = true;
+        mateEdit.i1.mateRemoved = true;
     }
-    if (abs(record.tLen)<length(record.seq) && record.rID == record.rNextId && adapterMap.count(record.qName)==0 && !hasFlagNextUnmapped(record) && !hasFlagUnmapped(record))
+    unsigned adapterMate = READ_NAME_NONE;
+    if (abs(record.tLen)<readLength(record) && record.rID == record.rNextId)
+        adapterMate = findName(adapterMap, record.qName);
+    if (abs(record.tLen)<readLength(record) && record.rID == record.rNextId && adapterMate == READ_NAME_NONE && !hasFlagNextUnmapped(record) && !hasFlagUnmapped(record))
     {
-            adapterMap[record.qName] = record;
+            //Moved rather than swapped, so record keeps its position for the flush at the end of an interval.
+            unsigned adapterRead = insertName(adapterMap, record.qName);
+            moveRecord(entryValue(adapterMap, adapterRead), record);
+            setExpiry(adapterMap, adapterRead, expiry);
             return false;
     }
-    if (abs(record.tLen)<length(record.seq) && record.rID == record.rNextId && adapterMap.count(record.qName)!=0)
-    {
-        if (!sameOrientation)
-        {
-            if (!hasFlagRC(record))
-                reverseRecord = adapterMap[record.qName];
-            else
-            {
-                reverseRecord = record;
-                record = adapterMap[record.qName];
-            }
-            adapterMap.erase(record.qName);
-            if (!removeAdapters(record,reverseRecord, mateEditMap, minMatchingBases))
-                return false;
-        }
-        else
-            reverseRecord = adapterMap[record.qName];
-        if (qualityFilterLevel2(reverseRecord, mateEditMap, minMatchingBases))
-        {
-            CharString binary_qual = "";
-            for (unsigned x=0; x<length(reverseRecord.qual); ++x)
-            {
-                if (reverseRecord.qual[x]-33 >= 25)
-                    append(binary_qual,"I");
-                else
-                    append(binary_qual,"!");
-            }
-            reverseRecord.qual = binary_qual;
-            appendValue(beginPosToReads[reverseRecord.beginPos], reverseRecord);
-        }
-        else
-            mateEditMap[record.qName].i2.mateRemoved = true;
-    }
-    if (!qualityFilterLevel2(record, mateEditMap, minMatchingBases))
+    if (abs(record.tLen)<readLength(record) && record.rID == record.rNextId && adapterMate != READ_NAME_NONE)
+        return filterAdapterPair(record, sameOrientation, mateEdit, adapterMap, adapterMate, minMatchingBases, readWindow);
+    if (!qualityFilterLevel2(record, mateEdit, minMatchingBases))
         return false;
     return true;
 }
 
-void removeHardClipped(BamAlignmentRecord& record)
+void removeHardClipped(BamRawRecord& record)
 {
+    StageTimer timer(timedStage(STAGE_HARD_CLIP));
     //cout << "Working on record: " << record.qName << endl;
     if (hasFlagUnmapped(record))
         return;
-    CharString cigarOperation = record.cigar[0].operation;
-    string cigarOperationStr = toCString(cigarOperation);
-    if (cigarOperationStr.compare("H")==0)
-        erase(record.cigar, 0);
-    cigarOperation = record.cigar[length(record.cigar)-1].operation;
-    cigarOperationStr = toCString(cigarOperation);
-    if (cigarOperationStr.compare("H")==0)
-        erase(record.cigar, length(record.cigar)-1);
+    if (record._n_cigar > 0 && cigarOp(cigarAt(record, 0)) == BAM_CIGAR_H)
+        eraseCigarAt(record, 0);
+    if (record._n_cigar > 0 && cigarOp(cigarAt(record, record._n_cigar-1)) == BAM_CIGAR_H)
+        eraseCigarAt(record, record._n_cigar-1);
 }
 
-int qualityFilterSlice(Triple<CharString, int, int >& chr_start_end, CharString baiPathIn, BamFileIn& bamFileIn, BamFileOut& bamFileOut, map<CharString, Pair<MateEditInfo> >& mateEditMap, bool keepMapQual, int maxFragLen, map<unsigned, String<BamAlignmentRecord> >& beginPosToReads, map<CharString, BamAlignmentRecord>& adapterMap, unsigned minMatchingBases, double avgCovByReadLen, map<CharString, unsigned>& readNameToNum, unsigned& currIdx)
+bool timedAddRead(CoverageWindow& coverage, unsigned pos)
 {
-    double maxQueSum = avgCovByReadLen*(double)50.0*(double)3.0;
-    unsigned currBeginPos = 0;
-    deque<unsigned> myQue;
-    BamIndex<Bai> baiIndex;
-    if (!open(baiIndex, toCString(baiPathIn)))
+    StageTimer timer(timedStage(STAGE_COVERAGE));
+    return addRead(coverage, pos);
+}
+
+//Plans reading the records of an interval and of the fragment length around it.
+void planInterval(FetchPlan& plan, BamIndex<Bai> const & baiIndex, int rID, Triple<CharString, int, int > const & chr_start_end, int maxFragLen)
+{
+    planFetch(plan, baiIndex, rID, std::max((int)0,(int)chr_start_end.i2-maxFragLen), chr_start_end.i3+maxFragLen+1);
+}
+
+//Prefetches the chunks of the intervals from first to first+depth-1 that are not prefetched yet. prefetched is the
+//interval up to which this was done before.
+void prefetchIntervals(BamReader& bamFileIn, BamIndex<Bai> const & baiIndex, String<Triple<CharString, int, int > >& intervalString, int maxFragLen, unsigned& prefetched, unsigned first, unsigned depth)
+{
+    FetchPlan plan;
+    for (prefetched = std::max(prefetched, first); prefetched < first+depth && prefetched < length(intervalString); ++prefetched)
     {
-        std::cerr << "ERROR: Could not read BAI index file " << baiPathIn << "\n";
-        return 1;
+        int rID = 0;
+        if (!getIdByName(rID, contigNamesCache(context(bamFileIn)), intervalString[prefetched].i1))
+            continue;
+        planInterval(plan, baiIndex, rID, intervalString[prefetched], maxFragLen);
+        prefetch(bamFileIn, plan);
     }
+}
+
+template <typename TTarget>
+int qualityFilterSlice(Triple<CharString, int, int >& chr_start_end, BamIndex<Bai> const & baiIndex, BamReader& bamFileIn, TTarget& target, TMateEditTable& mateEditMap, bool keepMapQual, int maxFragLen, ReadWindow& readWindow, TAdapterTable& adapterMap, unsigned minMatchingBases, CoverageWindow coverage, double localCoverageScale, ReadNamer& namer)
+{
+    clear(coverage);
     int rID = 0;
     if (!getIdByName(rID, contigNamesCache(context(bamFileIn)), chr_start_end.i1))
     {
         std::cerr << "ERROR: Reference sequence named " << chr_start_end.i1 << " not known.\n";
         return 1;
     }
-    bool hasAlignments = false;
-    if (!jumpToRegion(bamFileIn, hasAlignments, rID, std::max((int)0,(int)chr_start_end.i2-maxFragLen), chr_start_end.i3+maxFragLen, baiIndex))
+    //With a local coverage scale the limit follows the reads per base in the interval itself, unless it has none.
+    if (localCoverageScale > 0.0)
+    {
+        double readsPerBase = regionReadsPerBase(bamFileIn, baiIndex, rID, chr_start_end.i2, chr_start_end.i3+1);
+        if (readsPerBase > 0.0)
+            coverage.maxSum = readsPerBase*localCoverageScale;
+    }
+    if ((unsigned)rID >= length(baiIndex._binIndices))
     {
         std::cerr << "ERROR: Could not jump to " << chr_start_end.i2 << ":" << chr_start_end.i3 << "\n";
         return 1;
     }
-    if (!hasAlignments)
+    FetchPlan plan;
+    planInterval(plan, baiIndex, rID, chr_start_end, maxFragLen);
+    if (empty(plan))
     {
         cout << "No alignments found in the interval: " << std::max((int)0,(int)chr_start_end.i2-maxFragLen) << " to " << chr_start_end.i3+maxFragLen << "\n";
         return 0;
     }
-    BamAlignmentRecord record;
-    CharString binary_qual;
-    while (!atEnd(bamFileIn) )
+    BamRawRecord record;
+    while (nextPlannedRecord(bamFileIn, plan))
     {
-        readRecord(record, bamFileIn);
+        {
+            StageTimer timer(timedStage(STAGE_PARSE));
+            readRecord(record, bamFileIn);
+        }
         //cout << "Processing read: " << record.qName << " at:" << record.beginPos << endl;
         if (record.rID == -1 || record.rID > rID || record.beginPos > chr_start_end.i3+maxFragLen)
             break;
@@ -861,68 +1007,267 @@ int qualityFilterSlice(Triple<CharString, int, int >& chr_start_end, CharString
         removeHardClipped(record);
         ++delStats.nTotalReads;
 
-        if (record.beginPos != currBeginPos)
-        {
-            if (record.beginPos-currBeginPos > 1)
-            {
-                for (unsigned i=1; i<record.beginPos-currBeginPos; ++i)
-                {
-                    myQue.push_front(0);
-                    while (myQue.size()>50)
-                        myQue.pop_back();
-                }
-            }
-            myQue.push_front(1);
-            while (myQue.size()>50)
-                myQue.pop_back();
-            currBeginPos = record.beginPos;
-        }
-        else
-            ++myQue.front();
-        if (std::accumulate(myQue.begin(),myQue.end(),0) > maxQueSum)
+        if (!timedAddRead(coverage, record.beginPos))
         {
             ++delStats.nCoverageFiltered;
-            --myQue.front();
+            unsigned mate = insertName(mateEditMap, record.qName);
+            setExpiry(mateEditMap, mate, mateExpiry(record, maxFragLen));
             if (hasFlagRC(record))
-                mateEditMap[record.qName].i2.mateRemoved = true;
+                entryValue(mateEditMap, mate).i2.mateRemoved = true;
             else
-                mateEditMap[record.qName].i1.mateRemoved = true;
+                entryValue(mateEditMap, mate).i1.mateRemoved = true;
             continue;
         }
-        if (qualityFilter(record, mateEditMap, maxFragLen, adapterMap, minMatchingBases, keepMapQual, beginPosToReads))
+        if (qualityFilter(record, mateEditMap, maxFragLen, adapterMap, minMatchingBases, keepMapQual, readWindow))
         {
-            binary_qual = "";
-            for (unsigned x=0; x<length(record.qual); ++x)
-            {
-                if (record.qual[x]-33 >= 25)
-                    append(binary_qual,"I");
-                else
-                    append(binary_qual,"!");
-            }
-            record.qual = binary_qual;
-            appendValue(beginPosToReads[record.beginPos], record);
+            binQualities(record);
+            moveRead(readWindow, record);
             if (record.beginPos-maxFragLen >=0)
             {
                 //If I am printing reads infront of the interval I need to remove ones that don't have a mate in the interval first.
-                if (beginPosToReads.begin()->first < chr_start_end.i2)
-                    removeBeginReads(beginPosToReads, mateEditMap, record.beginPos-maxFragLen, chr_start_end.i2, chr_start_end.i3);
-                printReadyReads(mateEditMap, beginPosToReads, record.beginPos-maxFragLen, bamFileOut, readNameToNum, currIdx, keepMapQual, Pair<unsigned>(chr_start_end.i2, chr_start_end.i3));
+                if (firstPos(readWindow) < (unsigned)chr_start_end.i2)
+                    removeBeginReads(readWindow, mateEditMap, record.beginPos-maxFragLen, chr_start_end.i2, chr_start_end.i3);
+                printReadyReads(mateEditMap, readWindow, record.beginPos-maxFragLen, target, namer, keepMapQual, Pair<unsigned>(chr_start_end.i2, chr_start_end.i3));
+                //Merged intervals are more than two fragment lengths apart, so the stream of a group only moves forward
+                //and pairs that are done can be dropped as in a contig.
+                evictExpired(mateEditMap, record.beginPos);
+                evictExpired(adapterMap, record.beginPos);
             }
         }
         else
-            --myQue.front();
+            removeRead(coverage);
+    }
+    printReadyReads(mateEditMap, readWindow, chr_start_end.i3, target, namer, keepMapQual, Pair<unsigned>(chr_start_end.i2, chr_start_end.i3));
+    removeUnPairReads(readWindow, mateEditMap);
+    printReadyReads(mateEditMap, readWindow, record.beginPos, target, namer, keepMapQual, Pair<unsigned>(chr_start_end.i2, chr_start_end.i3));
+    delStats.maxMateEntries = std::max(delStats.maxMateEntries, mateEditMap.maxSize);
+    delStats.maxAdapterEntries = std::max(delStats.maxAdapterEntries, adapterMap.maxSize);
+    delStats.maxWindowReads = std::max(delStats.maxWindowReads, readWindow.maxSize);
+    for (unsigned pos = firstPos(readWindow); !empty(readWindow) && pos - firstPos(readWindow) <= lastPos(readWindow) - firstPos(readWindow); ++pos)
+    {
+        if (readsAt(readWindow, pos)>0)
+            cout << "There are " << readsAt(readWindow, pos) << " reads left at: " << pos << endl;
+    }
+    return 0;
+}
+
+bool readNextRecord(BamRawRecord& record, BamReader& bamFileIn)
+{
+    if (atEnd(bamFileIn))
+        return false;
+    StageTimer timer(timedStage(STAGE_PARSE));
+    bamFileIn.recordOffset = tell(bamFileIn.bgzf);
+    readRecord(record, bamFileIn);
+    return true;
+}
+
+//Checkpoints of a whole genome run, taken by the thread that writes the output. Set up in main().
+struct Checkpointing {
+    bool enabled = false;
+    __uint64 intervalNanos = 0;
+    __uint64 lastNanos = 0;
+    CharString path;
+    FILE * namesFile = NULL;
+    Checkpoint saved;
+} ;
+
+Checkpointing checkpointing;
+
+bool checkpointDue()
+{
+    return checkpointing.enabled && wallClockNanos() - checkpointing.lastNanos >= checkpointing.intervalNanos;
+}
+
+//Writes the checkpoint to go on with item nextItem, at inputOffset if the input is read in one pass. The output and the
+//names are on disk before the checkpoint is replaced, so a checkpoint never refers to more than they hold.
+bool saveCheckpoint(unsigned nextItem, __uint64 inputOffset, BamWriter& bamFileOut, ReadNamer const & namer, DeletionStats const & stats)
+{
+    Checkpoint& checkpoint = checkpointing.saved;
+    checkpoint.nextItem = nextItem;
+    checkpoint.inputOffset = inputOffset;
+    checkpoint.nextName = namer.next;
+    checkpoint.counters = checkpointCounters(stats);
+    if (!flush(bamFileOut.bgzf) || !appendCheckpointNames(checkpoint, checkpointing.namesFile, namer))
+        return false;
+    checkpoint.outputOffset = bamFileOut.bgzf.bytesWritten;
+    if (!writeCheckpoint(checkpoint, toCString(checkpointing.path)))
+        return false;
+    checkpointing.lastNanos = wallClockNanos();
+    return true;
+}
+
+//Takes a checkpoint once the contigs before nextItem are written, if the time between checkpoints has passed.
+bool checkpointContig(unsigned nextItem, __uint64 inputOffset, BamWriter& bamFileOut, ReadNamer const & namer, DeletionStats const & stats)
+{
+    if (!checkpointDue())
+        return true;
+    checkpointing.saved.contigState.clear();
+    return saveCheckpoint(nextItem, inputOffset, bamFileOut, namer, stats);
+}
+
+template <typename TValue>
+void packTable(std::string& state, ReadNameTable<TValue> const & table)
+{
+    putState(state, (__uint64)length(table));
+    visitEntries(table, [&](typename ReadNameTable<TValue>::Entry const & entry, char const * name)
+    {
+        putStateBytes(state, name, entry.nameLength);
+        putState(state, entry.expiry);
+        putState(state, entry.value);
+    });
+}
+
+template <typename TValue>
+bool unpackTable(ReadNameTable<TValue>& table, std::string const & state, size_t& pos)
+{
+    __uint64 size = 0;
+    if (!takeState(size, state, pos))
+        return false;
+    CharString name;
+    for (__uint64 i = 0; i < size; ++i)
+    {
+        __int64 expiry = 0;
+        if (!takeState(name, state, pos) || !takeState(expiry, state, pos))
+            return false;
+        unsigned handle = insertName(table, name);
+        if (!takeState(entryValue(table, handle), state, pos))
+            return false;
+        if (expiry != READ_NAME_NO_EXPIRY)
+            setExpiry(table, handle, expiry);
+    }
+    return true;
+}
+
+//Packs what the filter holds of a contig between two of its records: the counts of the coverage window, the reads in
+//the read window in the order they are written, and the mate and adapter tables with the expiry of their entries.
+void packContigState(std::string& state, CoverageWindow const & coverage, ReadWindow& readWindow, TMateEditTable const & mateEditMap, TAdapterTable const & adapterMap)
+{
+    state.clear();
+    putState(state, coverage.pos);
+    putState(state, coverage.sum);
+    unsigned nCounts = 0;
+    for (unsigned k = 0; k < coverage.counts.size() && k <= coverage.pos; ++k)
+        nCounts += countAt(coverage, coverage.pos - k) != 0;
+    putState(state, nCounts);
+    for (unsigned k = 0; k < coverage.counts.size() && k <= coverage.pos; ++k)
+        if (countAt(coverage, coverage.pos - k) != 0)
+        {
+            putState(state, k);
+            putState(state, countAt(coverage, coverage.pos - k));
+        }
+    putState(state, (__uint64)length(readWindow));
+    visitReads(readWindow, [&](ReadWindow::Entry const & entry)
+    {
+        putState(state, entry.dropped);
+        putState(state, entry.record);
+    });
+    packTable(state, mateEditMap);
+    packTable(state, adapterMap);
+}
+
+//Restores the state packed by packContigState() into a new coverage window and the empty read window and tables.
+bool unpackContigState(CoverageWindow& coverage, ReadWindow& readWindow, TMateEditTable& mateEditMap, TAdapterTable& adapterMap, std::string const & state)
+{
+    size_t pos = 0;
+    unsigned nCounts = 0;
+    if (!takeState(coverage.pos, state, pos) || !takeState(coverage.sum, state, pos) || !takeState(nCounts, state, pos))
+        return false;
+    for (unsigned i = 0; i < nCounts; ++i)
+    {
+        unsigned k = 0;
+        if (!takeState(k, state, pos) || k >= coverage.counts.size() || !takeState(_slot(coverage, coverage.pos - k), state, pos))
+            return false;
+    }
+    __uint64 nReads = 0;
+    if (!takeState(nReads, state, pos))
+        return false;
+    BamRawRecord record;
+    for (__uint64 i = 0; i < nReads; ++i)
+    {
+        bool dropped = false;
+        if (!takeState(dropped, state, pos) || !takeState(record, state, pos))
+            return false;
+        moveRead(readWindow, record).dropped = dropped;
     }
-    printReadyReads(mateEditMap, beginPosToReads, chr_start_end.i3, bamFileOut, readNameToNum, currIdx, keepMapQual, Pair<unsigned>(chr_start_end.i2, chr_start_end.i3));
-    removeUnPairReads(beginPosToReads, mateEditMap);
-    printReadyReads(mateEditMap, beginPosToReads, record.beginPos, bamFileOut, readNameToNum, currIdx, keepMapQual, Pair<unsigned>(chr_start_end.i2, chr_start_end.i3));
-    if (beginPosToReads.size()>0)
+    return unpackTable(mateEditMap, state, pos) && unpackTable(adapterMap, state, pos) && pos == state.size();
+}
+
+//Takes a checkpoint inside a contig before record is filtered, if the time between checkpoints has passed. The largest
+//sizes of the window and tables so far go into the counters, as they do at the end of the contig.
+bool checkpointInContig(BamWriter& bamFileOut, BamReader& bamFileIn, BamRawRecord const & record, CoverageWindow const & coverage, ReadWindow& readWindow,
+                        TMateEditTable const & mateEditMap, TAdapterTable const & adapterMap, ReadNamer const & namer)
+{
+    if (!checkpointDue())
+        return true;
+    DeletionStats stats = delStats;
+    stats.maxWindowReads = std::max(stats.maxWindowReads, readWindow.maxSize);
+    stats.maxMateEntries = std::max(stats.maxMateEntries, mateEditMap.maxSize);
+    stats.maxAdapterEntries = std::max(stats.maxAdapterEntries, adapterMap.maxSize);
+    packContigState(checkpointing.saved.contigState, coverage, readWindow, mateEditMap, adapterMap);
+    return saveCheckpoint(record.rID, bamFileIn.recordOffset, bamFileOut, namer, stats);
+}
+
+//Workers filter contigs into record buffers, the thread that writes them takes the checkpoints between contigs.
+bool checkpointInContig(RecordBuffer&, BamReader&, BamRawRecord const &, CoverageWindow const &, ReadWindow&, TMateEditTable const &, TAdapterTable const &, ReadNamer const &)
+{
+    return true;
+}
+
+//Filters the reads of one contig with its own coverage window. On entry record holds the first read of the contig, or
+//the next read of a contig resumed from a checkpoint with the windows and tables restored; on return it holds the first
+//read of the next contig, or hasRecord is false if the file has been read to the end. Checkpoints are looked at every
+//4096 reads.
+template <typename TTarget>
+int qualityFilterContig(BamReader& bamFileIn, BamRawRecord& record, bool& hasRecord, TTarget& target, TMateEditTable& mateEditMap, bool keepMapQual, int maxFragLen, ReadWindow& readWindow, TAdapterTable& adapterMap, unsigned minMatchingBases, CoverageWindow coverage, ReadNamer& namer)
+{
+    int rID = record.rID;
+    for (; hasRecord && record.rID == rID; hasRecord = readNextRecord(record, bamFileIn))
     {
-        for (map<unsigned, String<BamAlignmentRecord> >::const_iterator it = beginPosToReads.begin(); it != beginPosToReads.end(); ++it)
+        if (checkpointing.enabled && delStats.nTotalReads % 4096 == 0 &&
+            !checkpointInContig(target, bamFileIn, record, coverage, readWindow, mateEditMap, adapterMap, namer))
+        {
+            std::cerr << "ERROR: Could not write the checkpoint " << checkpointing.path << std::endl;
+            return 1;
+        }
+        ++delStats.nTotalReads;
+        removeHardClipped(record);
+        if (!timedAddRead(coverage, record.beginPos))
+        {
+            ++delStats.nCoverageFiltered;
+            unsigned mate = insertName(mateEditMap, record.qName);
+            setExpiry(mateEditMap, mate, mateExpiry(record, maxFragLen));
+            if (hasFlagRC(record))
+                entryValue(mateEditMap, mate).i2.mateRemoved = true;
+            else
+                entryValue(mateEditMap, mate).i1.mateRemoved = true;
+            continue;
+        }
+        if (qualityFilter(record, mateEditMap, maxFragLen, adapterMap, minMatchingBases, keepMapQual, readWindow))
         {
-            if (length(beginPosToReads[it->first])>0)
-                cout << "There are " << length(beginPosToReads[it->first]) << " reads left at: " << it->first << endl;
+            binQualities(record);
+            moveRead(readWindow, record);
+            if (record.beginPos-maxFragLen >=0)
+            {
+                printReadyReads(mateEditMap, readWindow, record.beginPos-maxFragLen, target, namer, keepMapQual, Pair<unsigned>(0,260000000));
+                //The stream only moves forward here, so pairs that are done can be dropped.
+                evictExpired(mateEditMap, record.beginPos);
+                evictExpired(adapterMap, record.beginPos);
+            }
         }
+        else
+            removeRead(coverage);
     }
+    if (!empty(readWindow))
+        printReadyReads(mateEditMap, readWindow, lastPos(readWindow), target, namer, keepMapQual, Pair<unsigned>(0,260000000));
+    if (!empty(readWindow))
+        cout << length(readWindow) << " reads were not printed, something is wrong. " << endl;
+    delStats.maxWindowReads = std::max(delStats.maxWindowReads, readWindow.maxSize);
+    clear(readWindow);
+    //Mates on other contigs have been made unpaired, so no entry is looked at again.
+    delStats.maxMateEntries = std::max(delStats.maxMateEntries, mateEditMap.maxSize);
+    delStats.maxAdapterEntries = std::max(delStats.maxAdapterEntries, adapterMap.maxSize);
+    clear(mateEditMap);
+    clear(adapterMap);
     return 0;
 }
 
@@ -976,150 +1321,1252 @@ String<Triple<CharString, int, int > > readIntervals(CharString& intervalFile, i
     return intervalString;
 }
 
-int main(int argc, char const ** argv)
+struct ShrinkOptions {
+    CharString bamPathIn;
+    CharString bamPathOut;
+    int maxFragLen = 0;
+    bool keepMapQual = false;
+    int minMatchingBases = 0;
+    double avgCovByReadLen = 0.0;
+    //avgCovByReadLen given as auto, to be read from the BAI.
+    bool estimateCoverage = false;
+    //Measure every interval or contig against its own reads per base.
+    bool localCoverage = false;
+    std::vector<double> contigReadsPerBase;
+    CharString qualityBinning = "binary";
+    //RG, and MQ with keepMapQuality, unless given with --keep-tags.
+    CharString keepTags;
+    bool keepTagsGiven = false;
+    ReadNaming readNaming = READ_NAMES_GLOBAL;
+    CharString namePrefix;
+    unsigned coverageWindowSize = 50;
+    double coverageMultiplier = 3.0;
+    CharString baiPathIn;
+    CharString intervalFile;
+    unsigned numThreads = 1;
+    unsigned compressionThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    int compressionLevel = Z_BEST_SPEED;
+    BamIndexFormat indexFormat = BAM_INDEX_NONE;
+    unsigned decompressionThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    //Number of intervals ahead of the current one whose chunks are prefetched.
+    unsigned prefetchDepth = 4;
+    bool prefetchThread = false;
+    //Where to write the counters and stage times as JSON; stages are only timed if set.
+    CharString statsJson;
+    //Seconds between checkpoints of a whole genome run, and whether to resume from the last one.
+    bool checkpoint = false;
+    unsigned checkpointSeconds = 0;
+    bool resume = false;
+    //Shard (from 0) of nShards whose contigs are filtered, all contigs if nShards is 0.
+    unsigned shard = 0;
+    unsigned nShards = 0;
+} ;
+
+//Coverage limit of the window per read per base.
+double coverageLimitScale(ShrinkOptions const & options)
 {
-    if (argc != 7 && argc != 9)
-    {
-        cerr << "USAGE: " << argv[0] << " IN.bam OUT.bam maxFragmentLength keepMapQuality(Y/N) minNumMatches avgCovByReadLen.sh [baiFile intervalFile]\n";
-        return 1;
-    }
-    cout<< "File to filter: " << argv[1] << endl;
-    double avgCovByReadLen = lexicalCast<double>(argv[6]);
-    CharString bamPathIn = argv[1], baiPathIn, intervalFile;
-    int maxFragLen = lexicalCast<unsigned>(argv[3]), minMatchingBases = lexicalCast<unsigned>(argv[5]);
-    bool keepMapQual = false, readBamSlice = false;
-    string keepMapQualStr = argv[4];
-    String<Triple<CharString, int, int > > intervalString;
-    if (keepMapQualStr.compare("Y")==0)
-        keepMapQual = true;
-    if (argc == 9)
+    return (double)options.coverageWindowSize*options.coverageMultiplier;
+}
+
+//Reads are coverage filtered where more than multiplier times the average number of reads start in the window. With
+//--local-coverage the average of the contig rID is used.
+CoverageWindow coverageWindow(ShrinkOptions const & options, int rID = -1)
+{
+    double avgCovByReadLen = options.avgCovByReadLen;
+    if (options.localCoverage && rID >= 0 && (unsigned)rID < options.contigReadsPerBase.size())
+        avgCovByReadLen = options.contigReadsPerBase[rID];
+    return CoverageWindow(options.coverageWindowSize, avgCovByReadLen*coverageLimitScale(options));
+}
+
+//Interval mode counts the reads of each interval in a pre-scan with --local-coverage.
+double localCoverageScale(ShrinkOptions const & options)
+{
+    return options.localCoverage ? coverageLimitScale(options) : 0.0;
+}
+
+//Parses the options starting with -- and hands back the other arguments in args.
+bool parseFlags(ShrinkOptions& options, int argc, char const ** argv, String<CharString>& args)
+{
+    for (int i=1; i<argc; ++i)
     {
-        baiPathIn = argv[7];
-        intervalFile = argv[8];
-        intervalString = readIntervals(intervalFile, maxFragLen);
-        // cout << "Listing intervals: " << endl;
-        // for (unsigned i=0; i<length(intervalString); ++i)
-        //     cout << intervalString[i].i2 << "-" << intervalString[i].i3 << endl;
-        if (length(intervalString)==0)
+        string arg = argv[i];
+        if (arg.compare("--threads")==0)
         {
-            std::cerr << "The interval file contained no intervals!" << endl;
-            return 1;
+            if (i+1 == argc || !lexicalCast(options.numThreads, argv[i+1]) || options.numThreads == 0)
+                return false;
+            ++i;
         }
-        readBamSlice = true;
+        else if (arg.compare("--compression-threads")==0)
+        {
+            if (i+1 == argc || !lexicalCast(options.compressionThreads, argv[i+1]))
+                return false;
+            ++i;
+        }
+        else if (arg.compare("--decompression-threads")==0)
+        {
+            if (i+1 == argc || !lexicalCast(options.decompressionThreads, argv[i+1]))
+                return false;
+            ++i;
+        }
+        else if (arg.compare("--prefetch")==0)
+        {
+            if (i+1 == argc || !lexicalCast(options.prefetchDepth, argv[i+1]))
+                return false;
+            ++i;
+        }
+        else if (arg.compare("--prefetch-thread")==0)
+            options.prefetchThread = true;
+        else if (arg.compare("--stats-json")==0)
+        {
+            if (i+1 == argc)
+                return false;
+            options.statsJson = argv[i+1];
+            ++i;
+        }
+        else if (arg.compare("--checkpoint")==0)
+        {
+            if (i+1 == argc || !lexicalCast(options.checkpointSeconds, argv[i+1]))
+                return false;
+            options.checkpoint = true;
+            ++i;
+        }
+        else if (arg.compare("--resume")==0)
+            options.resume = true;
+        else if (arg.compare("--shard")==0)
+        {
+            //Shards are given as i/N with i from 1 to N.
+            char end = 0;
+            if (i+1 == argc || sscanf(argv[i+1], "%u/%u%c", &options.shard, &options.nShards, &end) != 2 || options.shard == 0 || options.shard > options.nShards)
+                return false;
+            --options.shard;
+            ++i;
+        }
+        else if (arg.compare("--quality-bins")==0)
+        {
+            QualityBinning binning;
+            if (i+1 == argc || !parseQualityBinning(binning, argv[i+1]))
+                return false;
+            options.qualityBinning = argv[i+1];
+            ++i;
+        }
+        else if (arg.compare("--keep-tags")==0)
+        {
+            TagFilter filter;
+            if (i+1 == argc || !parseTagFilter(filter, argv[i+1]))
+                return false;
+            options.keepTags = argv[i+1];
+            options.keepTagsGiven = true;
+            ++i;
+        }
+        else if (arg.compare("--read-names")==0)
+        {
+            if (i+1 == argc || (string(argv[i+1]) != "global" && string(argv[i+1]) != "local"))
+                return false;
+            options.readNaming = string(argv[i+1]) == "local" ? READ_NAMES_LOCAL : READ_NAMES_GLOBAL;
+            ++i;
+        }
+        else if (arg.compare("--name-prefix")==0)
+        {
+            if (i+1 == argc)
+                return false;
+            options.namePrefix = argv[i+1];
+            ++i;
+        }
+        else if (arg.compare("--coverage-window")==0)
+        {
+            if (i+1 == argc || !lexicalCast(options.coverageWindowSize, argv[i+1]) || options.coverageWindowSize == 0)
+                return false;
+            ++i;
+        }
+        else if (arg.compare("--coverage-multiplier")==0)
+        {
+            if (i+1 == argc || !lexicalCast(options.coverageMultiplier, argv[i+1]))
+                return false;
+            ++i;
+        }
+        else if (arg.compare("--write-index")==0)
+        {
+            if (i+1 == argc || (string(argv[i+1]) != "bai" && string(argv[i+1]) != "csi"))
+                return false;
+            options.indexFormat = string(argv[i+1]) == "csi" ? BAM_INDEX_CSI : BAM_INDEX_BAI;
+            ++i;
+        }
+        else if (arg.compare("--local-coverage")==0)
+            options.localCoverage = true;
+        else if (arg.compare("--uncompressed")==0)
+            options.compressionLevel = 0;
+        else if (arg.compare("--compression-level")==0)
+        {
+            if (i+1 == argc || !lexicalCast(options.compressionLevel, argv[i+1]) || options.compressionLevel < 0 || options.compressionLevel > 9)
+                return false;
+            ++i;
+        }
+        else
+            appendValue(args, argv[i]);
     }
-    BamFileIn bamFileIn;
-    if (!open(bamFileIn, toCString(bamPathIn)))
+    return true;
+}
+
+bool parseOptions(ShrinkOptions& options, int argc, char const ** argv)
+{
+    String<CharString> args;
+    if (!parseFlags(options, argc, argv, args) || (length(args) != 6 && length(args) != 8))
+        return false;
+    options.bamPathIn = args[0];
+    options.bamPathOut = args[1];
+    options.maxFragLen = lexicalCast<unsigned>(args[2]);
+    options.keepMapQual = args[3] == "Y";
+    if (!options.keepTagsGiven)
+        options.keepTags = options.keepMapQual ? "RG,MQ" : "RG";
+    options.minMatchingBases = lexicalCast<unsigned>(args[4]);
+    options.estimateCoverage = args[5] == "auto";
+    if (!options.estimateCoverage && !lexicalCast(options.avgCovByReadLen, args[5]))
+        return false;
+    if (length(args) == 8)
     {
-        std::cerr << "ERROR: Could not open " << bamPathIn << std::endl;
-        return 1;
+        options.baiPathIn = args[6];
+        options.intervalFile = args[7];
     }
-    map<CharString, Pair<MateEditInfo> > mateEditMap;
-    map<unsigned, String<BamAlignmentRecord> > beginPosToReads;
-    map<CharString, BamAlignmentRecord> adapterMap;
-    map<CharString, unsigned> readNameToNum;
-    unsigned currIdx = 0;
-    BamFileOut bamFileOut(context(bamFileIn), argv[2]);
-    BamAlignmentRecord record;
-    try
+    return true;
+}
+
+//Intervals whose fetch windows are closer than maxFragLen can share read pairs, so they have to be filtered one after the other by the same worker.
+String<Pair<unsigned> > groupIntervals(String<Triple<CharString, int, int > >& intervalString, int maxFragLen)
+{
+    String<Pair<unsigned> > groups;
+    appendValue(groups, Pair<unsigned>(0, 1));
+    for (unsigned i=1; i<length(intervalString); ++i)
+    {
+        Triple<CharString, int, int >& prev = intervalString[i-1];
+        Triple<CharString, int, int >& curr = intervalString[i];
+        if (curr.i1 == prev.i1 && (curr.i2-maxFragLen) - (prev.i3+maxFragLen) <= maxFragLen)
+            ++back(groups).i2;
+        else
+            appendValue(groups, Pair<unsigned>(i, i+1));
+    }
+    return groups;
+}
+
+struct WorkItem {
+    RecordBuffer buffer;
+    int returnValue = 0;
+    bool done = false;
+    //What the worker counted while filtering the item, for checkpoints.
+    DeletionStats stats;
+} ;
+
+//Runs filterItem(bamFileIn, item, buffer) for the items firstItem..nItems-1 on options.numThreads workers, each with
+//its own input file. The main thread renames and writes the buffered reads in item order, so the output does not depend
+//on which worker filtered which item. The items before firstItem have been written by the run that is resumed.
+template <typename TFilterItem>
+int filterItemsInOrder(unsigned firstItem, unsigned nItems, ShrinkOptions const & options, BamWriter& bamFileOut, ReadNamer& namer, TFilterItem filterItem)
+{
+    vector<WorkItem> work(nItems);
+    //Limits how far workers can run ahead of the writer, which bounds the memory and disk held in buffers.
+    unsigned maxAhead = 4 * options.numThreads;
+    unsigned nextItem = firstItem, nextToWrite = firstItem;
+    bool failed = false;
+    mutex workMutex;
+    condition_variable itemDone, slotFree;
+    DeletionStats& totalStats = delStats;
+    StageStats& totalStages = stageStats;
+    //The workers add their counters to the totals when they are done, checkpoints count the items written.
+    DeletionStats writtenStats = delStats;
+    //toCString() may write the terminating zero, so the workers must not call it on the shared options.
+    string bamPathIn = toCString(options.bamPathIn);
+    //Buffers too large for memory spill next to the output file, or into the temporary directory for standard output.
+    CharString spillPrefix = options.bamPathOut;
+    if (options.bamPathOut == "-")
+    {
+        char const * tmpDir = getenv("TMPDIR");
+        spillPrefix = tmpDir != NULL ? tmpDir : "/tmp";
+        append(spillPrefix, "/bamShrink.");
+        append(spillPrefix, std::to_string(getpid()));
+    }
+
+    auto worker = [&]()
     {
-        BamHeader header;
         try
         {
+            BamReader bamFileIn;
+            if (!open(bamFileIn, bamPathIn.c_str(), options.decompressionThreads))
+                throw IOError("Could not open input file.");
+            bamFileIn.bgzf.prefetchThread = options.prefetchThread;
+            bamFileIn.bgzf.timeBlocks = stageTiming;
+            BamHeader header;
             readHeader(header, bamFileIn);
-        } catch (...){
-            std::cerr<<"Failed to read the header from the BAM file"<<endl;
-            return 1;
-        }
-        writeHeader(bamFileOut, header);
-        if (readBamSlice)
-        {
-            for (unsigned i=0; i<length(intervalString); ++i)
-            {
-                //cout << "Quality filtering interval: " << i << ", which is: " << intervalString[i].i1 << ":" << intervalString[i].i2 << "-" << intervalString[i].i3 << endl;
-                int returnValue = qualityFilterSlice(intervalString[i], baiPathIn, bamFileIn, bamFileOut, mateEditMap, keepMapQual, maxFragLen, beginPosToReads, adapterMap, minMatchingBases, avgCovByReadLen, readNameToNum, currIdx);
-                beginPosToReads.clear();
-                if (returnValue != 0)
-                {
-                    std::cerr << "Something went wrong in filtering:" << intervalString[i].i1 << ":" << intervalString[i].i2 << "-" << intervalString[i].i3 << endl;
-                    return 1;
-                }
-            }
-        }
-        else
-        {
-            double maxQueSum = avgCovByReadLen*(double)50.0*(double)3.0;
-            unsigned currBeginPos = 0;
-            deque<unsigned> myQue;
-            BamAlignmentRecord record;
-            CharString binary_qual;
-            while (!atEnd(bamFileIn))
+            while (true)
             {
-                ++delStats.nTotalReads;
-                readRecord(record, bamFileIn);
-                removeHardClipped(record);
-                if (record.beginPos != currBeginPos)
+                unsigned item;
                 {
-                    if (record.beginPos-currBeginPos > 1)
-                    {
-                        for (unsigned i=1; i<record.beginPos-currBeginPos; ++i)
-                        {
-                            myQue.push_front(0);
-                            if (myQue.size()>50)
-                                myQue.pop_back();
-                        }
-                    }
-                    myQue.push_front(1);
-                    if (myQue.size()>50)
-                        myQue.pop_back();
-                    currBeginPos = record.beginPos;
-                }
-                else
-                    ++myQue.front();
-                if (std::accumulate(myQue.begin(),myQue.end(),0) > maxQueSum)
-                {
-                    ++delStats.nCoverageFiltered;
-                    --myQue.front();
-                    if (hasFlagRC(record))
-                        mateEditMap[record.qName].i2.mateRemoved = true;
-                    else
-                        mateEditMap[record.qName].i1.mateRemoved = true;
-                    continue;
+                    unique_lock<mutex> lock(workMutex);
+                    slotFree.wait(lock, [&]{ return failed || nextItem >= nItems || nextItem < nextToWrite + maxAhead; });
+                    if (failed || nextItem >= nItems)
+                        break;
+                    item = nextItem++;
                 }
-                if (qualityFilter(record, mateEditMap, maxFragLen, adapterMap, minMatchingBases, keepMapQual, beginPosToReads))
+                work[item].buffer.context = &context(bamFileIn);
+                work[item].buffer.spillPath = spillPrefix;
+                append(work[item].buffer.spillPath, ".tmp");
+                append(work[item].buffer.spillPath, std::to_string(item));
+                DeletionStats statsBefore = delStats;
+                int returnValue = filterItem(bamFileIn, item, work[item].buffer);
                 {
-                    binary_qual = "";
-                    for (unsigned x=0; x<length(record.qual); ++x)
-                    {
-                        if (record.qual[x]-33 >= 25)
-                            append(binary_qual,"I");
-                        else
-                            append(binary_qual,"!");
-                    }
-                    record.qual = binary_qual;
-                    appendValue(beginPosToReads[record.beginPos], record);
-                    if (record.beginPos-maxFragLen >=0)
-                        printReadyReads(mateEditMap, beginPosToReads, record.beginPos-maxFragLen, bamFileOut, readNameToNum, currIdx, keepMapQual, Pair<unsigned>(0,260000000));
+                    lock_guard<mutex> lock(workMutex);
+                    work[item].stats = delStats;
+                    work[item].stats -= statsBefore;
+                    work[item].returnValue = returnValue;
+                    work[item].done = true;
                 }
-                else
-                    --myQue.front();
+                itemDone.notify_all();
             }
-            if (beginPosToReads.size()>0)
+            addReadStats(delStats, stageStats, bamFileIn.bgzf);
+        }
+        catch (Exception const & e)
+        {
+            std::cerr << "ERROR: " << e.what() << std::endl;
+            lock_guard<mutex> lock(workMutex);
+            failed = true;
+        }
+        delStats.nAllocations = allocationCount;
+        {
+            lock_guard<mutex> lock(workMutex);
+            totalStats += delStats;
+            totalStages += stageStats;
+        }
+        itemDone.notify_all();
+        slotFree.notify_all();
+    };
+
+    vector<thread> threads;
+    for (unsigned t=0; t<std::min(options.numThreads, nItems - firstItem); ++t)
+        threads.push_back(thread(worker));
+    int returnValue = 0;
+    for (unsigned item=firstItem; item<nItems; ++item)
+    {
+        {
+            unique_lock<mutex> lock(workMutex);
+            itemDone.wait(lock, [&]{ return failed || work[item].done; });
+            if (!work[item].done || work[item].returnValue != 0)
             {
-                cout << "Smallest position in map before last call to printReadyReads: " << beginPosToReads.begin()->first << endl;
-                int safePos = (beginPosToReads.rbegin()->first)+1;
-                printReadyReads(mateEditMap, beginPosToReads, safePos, bamFileOut, readNameToNum, currIdx, keepMapQual, Pair<unsigned>(0,260000000));
+                failed = true;
+                returnValue = 1;
             }
-            if (beginPosToReads.size()>0)
-                cout << beginPosToReads.size() << " positions were not printed, something is wrong. " << endl;
         }
+        if (returnValue != 0)
+            break;
+        writeRecordBuffer(bamFileOut, work[item].buffer, namer);
+        writtenStats += work[item].stats;
+        if (item+1 < nItems && !checkpointContig(item+1, (__uint64)-1, bamFileOut, namer, writtenStats))
+        {
+            std::cerr << "ERROR: Could not write the checkpoint " << checkpointing.path << std::endl;
+            lock_guard<mutex> lock(workMutex);
+            failed = true;
+            returnValue = 1;
+        }
+        {
+            lock_guard<mutex> lock(workMutex);
+            ++nextToWrite;
+        }
+        slotFree.notify_all();
+        if (returnValue != 0)
+            break;
     }
-    catch (Exception const & e)
+    slotFree.notify_all();
+    for (unsigned t=0; t<threads.size(); ++t)
+        threads[t].join();
+    return returnValue;
+}
+
+//Filters a group of intervals that share read pairs into buffer, one interval after the other.
+int filterIntervalGroup(BamReader& bamFileIn, Pair<unsigned> group, String<Triple<CharString, int, int > >& intervalString, BamIndex<Bai> const & baiIndex, ShrinkOptions const & options, RecordBuffer& buffer)
+{
+    TMateEditTable mateEditMap;
+    ReadWindow readWindow(options.maxFragLen);
+    TAdapterTable adapterMap;
+    ReadNamer localNamer(options.readNaming, options.namePrefix);
+    unsigned prefetched = 0;
+    for (unsigned i=group.i1; i<group.i2; ++i)
     {
-        std::cout << "ERROR: " << e.what() << std::endl;
-        return 1;
+        prefetchIntervals(bamFileIn, baiIndex, intervalString, options.maxFragLen, prefetched, i+1, options.prefetchDepth);
+        startItem(localNamer, i);
+        int returnValue = reportItem(i, bamFileIn, [&]{ return qualityFilterSlice(intervalString[i], baiIndex, bamFileIn, buffer, mateEditMap, options.keepMapQual, options.maxFragLen, readWindow, adapterMap, options.minMatchingBases, coverageWindow(options), localCoverageScale(options), localNamer); });
+        clear(readWindow);
+        if (returnValue != 0)
+        {
+            std::cerr << "Something went wrong in filtering:" << intervalString[i].i1 << ":" << intervalString[i].i2 << "-" << intervalString[i].i3 << endl;
+            return returnValue;
+        }
+    }
+    return 0;
+}
+
+int qualityFilterIntervals(String<Triple<CharString, int, int > >& intervalString, BamIndex<Bai> const & baiIndex, ShrinkOptions const & options, BamWriter& bamFileOut, ReadNamer& namer)
+{
+    String<Pair<unsigned> > groups = groupIntervals(intervalString, options.maxFragLen);
+    return filterItemsInOrder(0, length(groups), options, bamFileOut, namer, [&](BamReader& bamFileIn, unsigned g, RecordBuffer& buffer)
+    {
+        return filterIntervalGroup(bamFileIn, groups[g], intervalString, baiIndex, options, buffer);
+    });
+}
+
+//Filters the contigs firstContig..endContig-1 with reads each on its own, jumping to them with the index, and writes
+//them in header order.
+int qualityFilterContigs(unsigned firstContig, unsigned endContig, BamIndex<Bai> const & baiIndex, ShrinkOptions const & options, BamWriter& bamFileOut, ReadNamer& namer)
+{
+    return filterItemsInOrder(firstContig, endContig, options, bamFileOut, namer, [&](BamReader& bamFileIn, unsigned rID, RecordBuffer& buffer)
+    {
+        bool hasRecord = false;
+        if (!jumpToReference(bamFileIn, hasRecord, rID, baiIndex))
+        {
+            std::cerr << "ERROR: Could not jump to " << contigNames(context(bamFileIn))[rID] << "\n";
+            return 1;
+        }
+        BamRawRecord record;
+        if (hasRecord)
+            hasRecord = readNextRecord(record, bamFileIn);
+        if (!hasRecord || record.rID != (int)rID)
+            return 0;
+        TMateEditTable mateEditMap;
+        ReadWindow readWindow(options.maxFragLen);
+        TAdapterTable adapterMap;
+        ReadNamer localNamer(options.readNaming, options.namePrefix);
+        startItem(localNamer, rID);
+        return reportItem(rID, bamFileIn, [&]
+        {
+            return qualityFilterContig(bamFileIn, record, hasRecord, buffer, mateEditMap, options.keepMapQual, options.maxFragLen, readWindow, adapterMap, options.minMatchingBases, coverageWindow(options, rID), localNamer);
+        });
+    });
+}
+
+//One sample of a batch run: its options, the index of its input and its output. Set up by the main thread when the
+//sample is started; the workers filter its items (groups of intervals) and whoever finishes the next one in line writes.
+struct BatchSample {
+    ShrinkOptions options;
+    //Holds the header the output is encoded with.
+    BamReader header;
+    BamIndex<Bai> baiIndex;
+    BamWriter bamFileOut;
+    BamIndexBuilder outIndex;
+    ReadNamer namer;
+    vector<WorkItem> work;
+    unsigned nextItem = 0;
+    unsigned nextToWrite = 0;
+    //Items being filtered, and whether a worker is writing.
+    unsigned running = 0;
+    bool writing = false;
+    bool failed = false;
+    DeletionStats stats;
+
+    BatchSample(ShrinkOptions const & options) : options(options), namer(options.readNaming, options.namePrefix) {}
+} ;
+
+//Reads the manifest of a batch run, one sample per line: IN.bam OUT.bam avgCovByReadLen|auto and optionally the
+//baiFile of IN.bam. The other options are those of the batch. Empty lines and lines starting with # are skipped.
+bool readManifest(vector<ShrinkOptions>& samples, CharString const & path, ShrinkOptions const & batchOptions)
+{
+    std::ifstream manifest(toCString(path));
+    if (!manifest)
+        return false;
+    string line;
+    while (getline(manifest, line))
+    {
+        std::istringstream fields(line);
+        string bamPathIn, bamPathOut, coverage, baiPathIn;
+        if (!(fields >> bamPathIn) || bamPathIn[0] == '#')
+            continue;
+        if (!(fields >> bamPathOut >> coverage))
+            return false;
+        fields >> baiPathIn;
+        ShrinkOptions options = batchOptions;
+        options.bamPathIn = bamPathIn;
+        options.bamPathOut = bamPathOut;
+        options.baiPathIn = baiPathIn;
+        options.estimateCoverage = coverage == "auto";
+        if (!options.estimateCoverage && !lexicalCast(options.avgCovByReadLen, coverage))
+            return false;
+        samples.push_back(options);
+    }
+    return !manifest.bad();
+}
+
+//Opens the input, its index and the output of a sample and writes the header.
+bool startSample(BatchSample& sample, unsigned nItems)
+{
+    ShrinkOptions& options = sample.options;
+    if (!open(sample.header, toCString(options.bamPathIn), 0))
+    {
+        std::cerr << "ERROR: Could not open " << options.bamPathIn << std::endl;
+        return false;
+    }
+    BamHeader header;
+    readHeader(header, sample.header);
+    CharString indexPath = empty(options.baiPathIn) ? options.bamPathIn : options.baiPathIn;
+    if (empty(options.baiPathIn))
+        append(indexPath, ".bai");
+    if (options.estimateCoverage)
+    {
+        std::vector<__uint64> readCounts;
+        if (!readBaiReadCounts(readCounts, toCString(indexPath)))
+        {
+            std::cerr << "ERROR: Could not read the read counts from BAI index file " << indexPath << std::endl;
+            return false;
+        }
+        options.avgCovByReadLen = averageReadsPerBase(readCounts, contigLengths(context(sample.header)));
+    }
+    if (!open(sample.baiIndex, toCString(indexPath)))
+    {
+        std::cerr << "ERROR: Could not read BAI index file " << indexPath << std::endl;
+        return false;
+    }
+    if (options.indexFormat != BAM_INDEX_NONE)
+    {
+        if (!setIndexBinning(sample.outIndex, options.indexFormat, longestReference(contigLengths(context(sample.header)))))
+        {
+            std::cerr << "ERROR: " << options.bamPathIn << " has references longer than 2^29 bp, which a BAI cannot index. Use --write-index csi." << std::endl;
+            return false;
+        }
+        attachIndex(sample.bamFileOut, sample.outIndex);
+    }
+    if (!open(sample.bamFileOut, toCString(options.bamPathOut), context(sample.header), options.compressionThreads, options.compressionLevel))
+    {
+        std::cerr << "ERROR: Could not open " << options.bamPathOut << " for writing." << std::endl;
+        return false;
+    }
+    writeHeader(sample.bamFileOut, header);
+    sample.work = vector<WorkItem>(nItems);
+    return true;
+}
+
+//Closes the output of a sample that has been filtered, writes its index and prints its counters.
+bool finishSample(BatchSample& sample)
+{
+    ShrinkOptions const & options = sample.options;
+    if (!close(sample.bamFileOut) && !sample.failed)
+    {
+        std::cerr << "ERROR: Could not write " << options.bamPathOut << std::endl;
+        sample.failed = true;
+    }
+    if (!sample.failed && options.indexFormat != BAM_INDEX_NONE)
+    {
+        CharString indexPathOut = options.bamPathOut;
+        append(indexPathOut, options.indexFormat == BAM_INDEX_CSI ? ".csi" : ".bai");
+        if (!sample.outIndex.sorted)
+        {
+            std::cerr << "ERROR: " << options.bamPathOut << " is not sorted by position, no index was written." << std::endl;
+            sample.failed = true;
+        }
+        else if (!sample.outIndex.fits)
+        {
+            std::cerr << "ERROR: " << options.bamPathOut << " has reads past the positions the index can hold, no index was written." << std::endl;
+            sample.failed = true;
+        }
+        else if (!writeIndex(sample.outIndex, sample.bamFileOut, length(contigNames(context(sample.header))), toCString(indexPathOut), options.indexFormat))
+        {
+            std::cerr << "ERROR: Could not write " << indexPathOut << std::endl;
+            sample.failed = true;
+        }
+    }
+    if (sample.failed)
+    {
+        cout << options.bamPathIn << ": failed" << endl;
+        return false;
+    }
+    DeletionStats const & stats = sample.stats;
+    cout << options.bamPathIn << " -> " << options.bamPathOut << ": Soft clipped bp: " << stats.nSoftClippedBp << " Number of coverage filtered reads: "<< stats.nCoverageFiltered << " Quality clipped bp: " << stats.nQualityClippedBp << " Not enough matches reads: " << stats.nMatchRemovedReads << " Adapter removed bp: " << stats.nAdapterClippedBp << " Number of adapter trimmed reads: " << stats.nAdapterReads << " Total number of reads: " << stats.nTotalReads << endl;
+    return true;
+}
+
+//Writes the items of a sample that are next in line, with the lock held by the worker that finished one of them. One
+//worker writes a sample at a time; the items finished meanwhile are left to it.
+void writeBatchItems(BatchSample& sample, unique_lock<mutex>& lock)
+{
+    if (sample.writing)
+        return;
+    sample.writing = true;
+    while (!sample.failed && sample.nextToWrite < sample.work.size() && sample.work[sample.nextToWrite].done)
+    {
+        WorkItem& item = sample.work[sample.nextToWrite];
+        lock.unlock();
+        bool written = true;
+        try
+        {
+            writeRecordBuffer(sample.bamFileOut, item.buffer, sample.namer);
+        }
+        catch (Exception const & e)
+        {
+            std::cerr << "ERROR: " << sample.options.bamPathOut << ": " << e.what() << std::endl;
+            written = false;
+        }
+        lock.lock();
+        sample.failed = sample.failed || !written;
+        sample.stats += item.stats;
+        ++sample.nextToWrite;
+    }
+    sample.writing = false;
+}
+
+//Filters the intervals of the interval file in every sample of the manifest on one pool of options.numThreads workers.
+//The intervals are read and grouped once. Up to numThreads+1 samples are open at a time and a worker takes the next
+//item of the first of them that is less than 4*numThreads items ahead of its output, so the memory held in buffers is
+//bounded per sample and the workers move on to the next sample while the last items of one are filtered. Each output is
+//the same as that of a run of the sample on its own.
+//bamShrink batch [options] MANIFEST maxFragmentLength keepMapQuality(Y/N) minNumMatches intervalFile
+int filterBatch(int argc, char const ** argv)
+{
+    //The samples are filtered in parallel, so by default their inputs are inflated and outputs compressed by the workers.
+    ShrinkOptions batchOptions;
+    batchOptions.compressionThreads = 0;
+    batchOptions.decompressionThreads = 0;
+    String<CharString> args;
+    if (!parseFlags(batchOptions, argc - 1, argv + 1, args) || length(args) != 5)
+    {
+        cerr << "USAGE: " << argv[0] << " batch [options] MANIFEST maxFragmentLength keepMapQuality(Y/N) minNumMatches intervalFile\n";
+        return 1;
+    }
+    if (!empty(batchOptions.statsJson) || batchOptions.checkpoint || batchOptions.resume || batchOptions.nShards > 0)
+    {
+        std::cerr << "ERROR: --stats-json, --checkpoint, --resume and --shard are not supported in batch mode." << std::endl;
+        return 1;
+    }
+    batchOptions.maxFragLen = lexicalCast<unsigned>(args[1]);
+    batchOptions.keepMapQual = args[2] == "Y";
+    if (!batchOptions.keepTagsGiven)
+        batchOptions.keepTags = batchOptions.keepMapQual ? "RG,MQ" : "RG";
+    batchOptions.minMatchingBases = lexicalCast<unsigned>(args[3]);
+    batchOptions.intervalFile = args[4];
+    parseQualityBinning(qualityBinning, toCString(batchOptions.qualityBinning));
+    parseTagFilter(tagFilter, toCString(batchOptions.keepTags));
+    vector<ShrinkOptions> sampleOptions;
+    if (!readManifest(sampleOptions, args[0], batchOptions))
+    {
+        std::cerr << "ERROR: Could not read the manifest " << args[0] << ", its lines are IN.bam OUT.bam avgCovByReadLen|auto [baiFile]." << std::endl;
+        return 1;
+    }
+    String<Triple<CharString, int, int > > intervalString = readIntervals(batchOptions.intervalFile, batchOptions.maxFragLen);
+    if (length(intervalString)==0)
+    {
+        std::cerr << "The interval file contained no intervals!" << endl;
+        return 1;
+    }
+    String<Pair<unsigned> > groups = groupIntervals(intervalString, batchOptions.maxFragLen);
+    unsigned nItems = length(groups), nSamples = sampleOptions.size();
+    cout << "Samples to filter: " << nSamples << " Intervals: " << length(intervalString) << " Interval groups: " << nItems << endl;
+
+    unsigned maxAhead = 4 * batchOptions.numThreads, maxOpen = batchOptions.numThreads + 1;
+    //Samples by their line in the manifest, set while they are open; openSamples holds their lines in manifest order.
+    vector<unique_ptr<BatchSample> > samples(nSamples);
+    vector<unsigned> openSamples;
+    unsigned nextSample = 0, nFailed = 0;
+    bool stopping = false;
+    mutex batchMutex;
+    condition_variable workAvailable, sampleDone;
+
+    //A sample is done when all of its items are written, or when it failed and none is being filtered any more.
+    auto isDone = [&](BatchSample const & sample)
+    {
+        return sample.running == 0 && !sample.writing && (sample.failed || sample.nextToWrite == nItems);
+    };
+
+    auto worker = [&]()
+    {
+        //The input of the sample the worker filtered last.
+        unique_ptr<BamReader> bamFileIn;
+        unsigned inputSample = nSamples;
+        while (true)
+        {
+            unique_lock<mutex> lock(batchMutex);
+            BatchSample * sample = NULL;
+            unsigned s = 0, item = 0;
+            auto claim = [&]
+            {
+                for (unsigned i=0; i<openSamples.size(); ++i)
+                {
+                    BatchSample& candidate = *samples[openSamples[i]];
+                    if (!candidate.failed && candidate.nextItem < nItems && candidate.nextItem < candidate.nextToWrite + maxAhead)
+                    {
+                        s = openSamples[i];
+                        sample = &candidate;
+                        return true;
+                    }
+                }
+                return false;
+            };
+            workAvailable.wait(lock, [&]{ return stopping || claim(); });
+            if (sample == NULL)
+                break;
+            item = sample->nextItem++;
+            ++sample->running;
+            CharString bamPathIn = sample->options.bamPathIn;
+            lock.unlock();
+
+            WorkItem& work = sample->work[item];
+            work.buffer.context = &context(sample->header);
+            work.buffer.spillPath = sample->options.bamPathOut;
+            append(work.buffer.spillPath, ".tmp");
+            append(work.buffer.spillPath, std::to_string(item));
+            DeletionStats statsBefore = delStats;
+            int returnValue = 1;
+            try
+            {
+                if (inputSample != s)
+                {
+                    bamFileIn.reset(new BamReader);
+                    inputSample = s;
+                    if (!open(*bamFileIn, toCString(bamPathIn), sample->options.decompressionThreads))
+                        throw IOError("Could not open input file.");
+                    bamFileIn->bgzf.prefetchThread = sample->options.prefetchThread;
+                    BamHeader header;
+                    readHeader(header, *bamFileIn);
+                }
+                returnValue = filterIntervalGroup(*bamFileIn, groups[item], intervalString, sample->baiIndex, sample->options, work.buffer);
+            }
+            catch (Exception const & e)
+            {
+                std::cerr << "ERROR: " << bamPathIn << ": " << e.what() << std::endl;
+                inputSample = nSamples;
+            }
+
+            lock.lock();
+            work.stats = delStats;
+            work.stats -= statsBefore;
+            work.returnValue = returnValue;
+            work.done = true;
+            sample->failed = sample->failed || returnValue != 0;
+            --sample->running;
+            writeBatchItems(*sample, lock);
+            if (isDone(*sample))
+                sampleDone.notify_one();
+            lock.unlock();
+            workAvailable.notify_all();
+        }
+    };
+
+    vector<thread> threads;
+    for (unsigned t=0; t<batchOptions.numThreads; ++t)
+        threads.push_back(thread(worker));
+    //The main thread opens the samples in manifest order and closes them when they are done.
+    {
+        unique_lock<mutex> lock(batchMutex);
+        while (nextSample < nSamples || !openSamples.empty())
+        {
+            unsigned done = openSamples.size();
+            sampleDone.wait(lock, [&]
+            {
+                for (done=0; done<openSamples.size() && !isDone(*samples[openSamples[done]]); ++done) {}
+                return done < openSamples.size() || (nextSample < nSamples && openSamples.size() < maxOpen);
+            });
+            if (done < openSamples.size())
+            {
+                unique_ptr<BatchSample> sample = std::move(samples[openSamples[done]]);
+                openSamples.erase(openSamples.begin() + done);
+                lock.unlock();
+                if (!finishSample(*sample))
+                    ++nFailed;
+                sample.reset();
+                lock.lock();
+                continue;
+            }
+            unsigned s = nextSample++;
+            lock.unlock();
+            unique_ptr<BatchSample> sample(new BatchSample(sampleOptions[s]));
+            bool started = false;
+            try
+            {
+                started = startSample(*sample, nItems);
+            }
+            catch (Exception const & e)
+            {
+                std::cerr << "ERROR: " << sampleOptions[s].bamPathIn << ": " << e.what() << std::endl;
+            }
+            if (!started)
+            {
+                cout << sampleOptions[s].bamPathIn << ": failed" << endl;
+                ++nFailed;
+            }
+            lock.lock();
+            if (started)
+            {
+                samples[s] = std::move(sample);
+                openSamples.push_back(s);
+                workAvailable.notify_all();
+            }
+        }
+        stopping = true;
+    }
+    workAvailable.notify_all();
+    for (unsigned t=0; t<threads.size(); ++t)
+        threads[t].join();
+    cout << "Filtered " << nSamples - nFailed << " of " << nSamples << " samples" << endl;
+    return nFailed == 0 ? 0 : 1;
+}
+
+//Joins the outputs of --shard runs, in the order given, into one BAM by copying their BGZF blocks as they are. The header
+//is taken from the first shard, and only the records that share the last block of a header are compressed again.
+//bamShrink merge [--write-index bai|csi] OUT.bam SHARD.bam...
+int mergeShards(int argc, char const ** argv)
+{
+    BamIndexFormat indexFormat = BAM_INDEX_NONE;
+    vector<string> paths;
+    for (int i=2; i<argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg.compare("--write-index")==0 && i+1 < argc && (string(argv[i+1]) == "bai" || string(argv[i+1]) == "csi"))
+            indexFormat = string(argv[++i]) == "csi" ? BAM_INDEX_CSI : BAM_INDEX_BAI;
+        else
+            paths.push_back(arg);
+    }
+    if (paths.size() < 2)
+    {
+        cerr << "USAGE: " << argv[0] << " merge [--write-index bai|csi] OUT.bam SHARD.bam...\n";
+        return 1;
+    }
+    string outPath = paths[0];
+    BamReader first;
+    BamWriter bamFileOut;
+    try
+    {
+        BamHeader header;
+        if (!open(first, paths[1].c_str(), 0))
+        {
+            std::cerr << "ERROR: Could not open " << paths[1] << std::endl;
+            return 1;
+        }
+        readHeader(header, first);
+        if (!open(bamFileOut, outPath.c_str(), context(first), 0, Z_BEST_SPEED))
+        {
+            std::cerr << "ERROR: Could not open " << outPath << " for writing." << std::endl;
+            return 1;
+        }
+        writeHeader(bamFileOut, header);
+        for (unsigned i=1; i<paths.size(); ++i)
+        {
+            BamReader shard;
+            if (!open(shard, paths[i].c_str(), 0))
+            {
+                std::cerr << "ERROR: Could not open " << paths[i] << std::endl;
+                return 1;
+            }
+            readHeader(header, shard);
+            if (contigNames(context(shard)) != contigNames(context(first)) || contigLengths(context(shard)) != contigLengths(context(first)))
+            {
+                std::cerr << "ERROR: The references of " << paths[i] << " and " << paths[1] << " differ." << std::endl;
+                return 1;
+            }
+            __uint64 offset = tell(shard.bgzf);
+            if ((offset & 0xffff) != 0)
+            {
+                BgzfReadBlock const & block = *shard.bgzf.current;
+                writeData(bamFileOut.bgzf, &block.data[shard.bgzf.pos], block.dataSize - shard.bgzf.pos);
+                offset = (block.offset + block.blockSize) << 16;
+            }
+            if (!copyBgzfBlocks(bamFileOut.bgzf, paths[i].c_str(), offset >> 16))
+            {
+                std::cerr << "ERROR: Could not copy the BGZF blocks of " << paths[i] << std::endl;
+                return 1;
+            }
+        }
+        if (!close(bamFileOut))
+        {
+            std::cerr << "ERROR: Could not write " << outPath << std::endl;
+            return 1;
+        }
+        if (indexFormat != BAM_INDEX_NONE)
+        {
+            string indexPath = outPath + (indexFormat == BAM_INDEX_CSI ? ".csi" : ".bai");
+            BamIndexBuilder index;
+            unsigned nRef = 0;
+            if (!indexBamFile(index, nRef, outPath.c_str(), indexFormat, std::max(std::thread::hardware_concurrency(), 1u)))
+            {
+                std::cerr << "ERROR: Could not read " << outPath << std::endl;
+                return 1;
+            }
+            if (!index.sorted)
+            {
+                std::cerr << "ERROR: " << outPath << " is not sorted by position, no index was written." << std::endl;
+                return 1;
+            }
+            if (!index.fits)
+            {
+                std::cerr << "ERROR: " << outPath << " has references or reads past the positions the index can hold, no index was written. A BAI holds 2^29 bp, use --write-index csi for longer references." << std::endl;
+                return 1;
+            }
+            if (!writeIndex(index, nRef, indexPath.c_str(), indexFormat))
+            {
+                std::cerr << "ERROR: Could not write " << indexPath << std::endl;
+                return 1;
+            }
+        }
+    }
+    catch (Exception const & e)
+    {
+        std::cerr << "ERROR: " << e.what() << std::endl;
+        return 1;
+    }
+    cout << "Merged " << paths.size() - 1 << " shards into " << outPath << endl;
+    return 0;
+}
+
+//bench/filter_bench compiles this file without main() to time the filters on their own.
+#ifndef BAMSHRINK_NO_MAIN
+int main(int argc, char const ** argv)
+{
+    if (argc > 1 && string(argv[1]) == "merge")
+        return mergeShards(argc, argv);
+    if (argc > 1 && string(argv[1]) == "batch")
+        return filterBatch(argc, argv);
+    ShrinkOptions options;
+    if (!parseOptions(options, argc, argv))
+    {
+        cerr << "USAGE: " << argv[0] << " merge [--write-index bai|csi] OUT.bam SHARD.bam...\n       " << argv[0] << " batch [options] MANIFEST maxFragmentLength keepMapQuality(Y/N) minNumMatches intervalFile\n       " << argv[0] << " [--threads N] [--compression-threads N] [--compression-level 0-9] [--uncompressed] [--write-index bai|csi] [--decompression-threads N] [--prefetch K] [--prefetch-thread] [--stats-json FILE] [--checkpoint SECONDS] [--resume] [--shard i/N] [--coverage-window N] [--coverage-multiplier X] [--local-coverage] [--quality-bins SCHEME] [--keep-tags TAG,...] [--read-names global|local] [--name-prefix STR] IN.bam OUT.bam maxFragmentLength keepMapQuality(Y/N) minNumMatches avgCovByReadLen|auto [baiFile intervalFile]\n";
+        return 1;
+    }
+    parseQualityBinning(qualityBinning, toCString(options.qualityBinning));
+    parseTagFilter(tagFilter, toCString(options.keepTags));
+    //Either file can be - for standard input or output. With the BAM on standard output all messages go to standard error.
+    bool streamIn = options.bamPathIn == "-", streamOut = options.bamPathOut == "-";
+    if (streamOut)
+        cout.rdbuf(cerr.rdbuf());
+    if (streamOut && options.indexFormat != BAM_INDEX_NONE)
+    {
+        std::cerr << "ERROR: No index can be written for standard output." << std::endl;
+        return 1;
+    }
+    if (streamIn && !empty(options.intervalFile))
+    {
+        std::cerr << "ERROR: Filtering intervals needs an input file that can seek, not standard input." << std::endl;
+        return 1;
+    }
+    if ((options.checkpoint || options.resume) && (streamIn || streamOut || !empty(options.intervalFile)))
+    {
+        std::cerr << "ERROR: Checkpoints are only taken in whole genome mode, from an input file to an output file." << std::endl;
+        return 1;
+    }
+    if (options.nShards > 0 && (streamIn || !empty(options.intervalFile)))
+    {
+        std::cerr << "ERROR: Shards are only filtered in whole genome mode, from an input file with an index." << std::endl;
+        return 1;
+    }
+    if (options.nShards > 0 && options.readNaming == READ_NAMES_GLOBAL && empty(options.namePrefix))
+    {
+        std::cerr << "ERROR: The read names of shards would collide, give them --read-names local or a --name-prefix each." << std::endl;
+        return 1;
+    }
+    //A run is resumed with the arguments it was started with.
+    string args;
+    for (int i=1; i<argc; ++i)
+        if (string(argv[i]) != "--resume")
+            args += (args.empty() ? "" : " ") + string(argv[i]);
+    cout<< "File to filter: " << options.bamPathIn << endl;
+    CharString bamPathIn = options.bamPathIn, intervalFile = options.intervalFile;
+    int maxFragLen = options.maxFragLen, minMatchingBases = options.minMatchingBases;
+    bool keepMapQual = options.keepMapQual, readBamSlice = false;
+    String<Triple<CharString, int, int > > intervalString;
+    if (!empty(intervalFile))
+    {
+        intervalString = readIntervals(intervalFile, maxFragLen);
+        // cout << "Listing intervals: " << endl;
+        // for (unsigned i=0; i<length(intervalString); ++i)
+        //     cout << intervalString[i].i2 << "-" << intervalString[i].i3 << endl;
+        if (length(intervalString)==0)
+        {
+            std::cerr << "The interval file contained no intervals!" << endl;
+            return 1;
+        }
+        readBamSlice = true;
+    }
+    BamReader bamFileIn;
+    if (!open(bamFileIn, toCString(bamPathIn), options.decompressionThreads))
+    {
+        std::cerr << "ERROR: Could not open " << bamPathIn << std::endl;
+        return 1;
+    }
+    bamFileIn.bgzf.prefetchThread = options.prefetchThread;
+    TMateEditTable mateEditMap;
+    ReadWindow readWindow(options.maxFragLen);
+    TAdapterTable adapterMap;
+    ReadNamer namer(options.readNaming, options.namePrefix);
+    BamWriter bamFileOut;
+    BamIndexBuilder outIndex;
+    if (options.indexFormat != BAM_INDEX_NONE)
+        attachIndex(bamFileOut, outIndex);
+    //The checkpoint is OUT.bam.checkpoint, the names it refers to are in OUT.bam.checkpoint.names.
+    checkpointing.path = options.bamPathOut;
+    append(checkpointing.path, ".checkpoint");
+    CharString namesPath = checkpointing.path;
+    append(namesPath, ".names");
+    if (options.resume)
+    {
+        if (!readCheckpoint(checkpointing.saved, toCString(checkpointing.path)) || !restoreCounters(delStats, checkpointing.saved.counters))
+        {
+            std::cerr << "ERROR: Could not read the checkpoint " << checkpointing.path << std::endl;
+            return 1;
+        }
+        if (checkpointing.saved.args != args)
+        {
+            std::cerr << "ERROR: " << checkpointing.path << " was written by a run with other arguments: " << checkpointing.saved.args << std::endl;
+            return 1;
+        }
+        cout << "Resuming at contig " << checkpointing.saved.nextItem << " after " << checkpointing.saved.outputOffset << " bytes of " << options.bamPathOut << endl;
+    }
+    bool outOpened = options.resume ? reopen(bamFileOut, toCString(options.bamPathOut), context(bamFileIn), checkpointing.saved.outputOffset, options.compressionThreads, options.compressionLevel)
+                                    : open(bamFileOut, toCString(options.bamPathOut), context(bamFileIn), options.compressionThreads, options.compressionLevel);
+    if (!outOpened)
+    {
+        std::cerr << "ERROR: Could not open " << options.bamPathOut << " for writing." << std::endl;
+        return 1;
+    }
+    if (options.checkpoint)
+    {
+        checkpointing.enabled = true;
+        checkpointing.intervalNanos = (__uint64)options.checkpointSeconds * 1000000000;
+        checkpointing.lastNanos = wallClockNanos();
+        checkpointing.saved.args = args;
+        checkpointing.namesFile = openCheckpointNames(toCString(namesPath), options.resume, checkpointing.saved, namer);
+        if (checkpointing.namesFile == NULL)
+        {
+            std::cerr << "ERROR: Could not open " << namesPath << std::endl;
+            return 1;
+        }
+    }
+    BamRawRecord record;
+    size_t allocationsBefore = allocationCount;
+    __uint64 wallBegin = wallClockNanos();
+    std::clock_t cpuBegin = std::clock();
+    if (!empty(options.statsJson))
+    {
+        stageTiming = true;
+        bamFileIn.bgzf.timeBlocks = true;
+        bamFileOut.bgzf.timeBlocks = true;
+    }
+    try
+    {
+        BamHeader header;
+        try
+        {
+            readHeader(header, bamFileIn);
+        } catch (...){
+            std::cerr<<"Failed to read the header from the BAM file"<<endl;
+            return 1;
+        }
+        if (options.indexFormat != BAM_INDEX_NONE && !setIndexBinning(outIndex, options.indexFormat, longestReference(contigLengths(context(bamFileIn)))))
+        {
+            std::cerr << "ERROR: " << bamPathIn << " has references longer than 2^29 bp, which a BAI cannot index. Use --write-index csi." << std::endl;
+            return 1;
+        }
+        //A resumed output has its header, and the records it keeps are indexed again.
+        if (!options.resume)
+            writeHeader(bamFileOut, header);
+        else if (options.indexFormat != BAM_INDEX_NONE && !indexWrittenRecords(bamFileOut, toCString(options.bamPathOut)))
+        {
+            std::cerr << "ERROR: Could not read " << options.bamPathOut << std::endl;
+            return 1;
+        }
+        if (stageTiming && readBamSlice)
+        {
+            itemReports.resize(length(intervalString));
+            for (unsigned i=0; i<length(intervalString); ++i)
+                itemReports[i].name = string(toCString(intervalString[i].i1)) + ":" + to_string(intervalString[i].i2) + "-" + to_string(intervalString[i].i3);
+        }
+        else if (stageTiming)
+        {
+            itemReports.resize(length(contigNames(context(bamFileIn))));
+            for (unsigned i=0; i<itemReports.size(); ++i)
+                itemReports[i].name = toCString(contigNames(context(bamFileIn))[i]);
+        }
+        //The index is next to the BAM unless one is given. It also holds the read counts per contig.
+        CharString indexPath = empty(options.baiPathIn) ? bamPathIn : options.baiPathIn;
+        if (empty(options.baiPathIn))
+            append(indexPath, ".bai");
+        if (options.estimateCoverage || (options.localCoverage && !readBamSlice))
+        {
+            std::vector<__uint64> readCounts;
+            if (!readBaiReadCounts(readCounts, toCString(indexPath)))
+            {
+                std::cerr << "ERROR: Could not read the read counts from BAI index file " << indexPath << std::endl;
+                return 1;
+            }
+            if (options.estimateCoverage)
+            {
+                options.avgCovByReadLen = averageReadsPerBase(readCounts, contigLengths(context(bamFileIn)));
+                cout << "Average coverage by read length from the index: " << options.avgCovByReadLen << endl;
+            }
+            options.contigReadsPerBase = contigReadsPerBase(readCounts, contigLengths(context(bamFileIn)));
+        }
+        //The index is read once and shared by all intervals, and by all threads.
+        BamIndex<Bai> baiIndex;
+        if (readBamSlice && !open(baiIndex, toCString(indexPath)))
+        {
+            std::cerr << "ERROR: Could not read BAI index file " << indexPath << std::endl;
+            return 1;
+        }
+        if (readBamSlice && options.numThreads > 1)
+        {
+            if (qualityFilterIntervals(intervalString, baiIndex, options, bamFileOut, namer) != 0)
+                return 1;
+        }
+        else if (readBamSlice)
+        {
+            unsigned prefetched = 0;
+            for (unsigned i=0; i<length(intervalString); ++i)
+            {
+                prefetchIntervals(bamFileIn, baiIndex, intervalString, maxFragLen, prefetched, i+1, options.prefetchDepth);
+                //cout << "Quality filtering interval: " << i << ", which is: " << intervalString[i].i1 << ":" << intervalString[i].i2 << "-" << intervalString[i].i3 << endl;
+                startItem(namer, i);
+                int returnValue = reportItem(i, bamFileIn, [&]{ return qualityFilterSlice(intervalString[i], baiIndex, bamFileIn, bamFileOut, mateEditMap, keepMapQual, maxFragLen, readWindow, adapterMap, minMatchingBases, coverageWindow(options), localCoverageScale(options), namer); });
+                clear(readWindow);
+                if (returnValue != 0)
+                {
+                    std::cerr << "Something went wrong in filtering:" << intervalString[i].i1 << ":" << intervalString[i].i2 << "-" << intervalString[i].i3 << endl;
+                    return 1;
+                }
+            }
+        }
+        else
+        {
+            //A shard is a run of contigs with about 1/N of the reads in the index.
+            unsigned firstContig = 0, endContig = length(contigNames(context(bamFileIn)));
+            if (options.nShards > 0)
+            {
+                std::vector<__uint64> readCounts;
+                if (!readBaiReadCounts(readCounts, toCString(indexPath)) || !open(baiIndex, toCString(indexPath)))
+                {
+                    std::cerr << "ERROR: Could not read BAI index file " << indexPath << std::endl;
+                    return 1;
+                }
+                readCounts.resize(endContig, 0);
+                Pair<unsigned> contigs = shardContigs(readCounts, options.shard, options.nShards);
+                firstContig = contigs.i1;
+                endContig = contigs.i2;
+                cout << "Shard " << options.shard + 1 << " of " << options.nShards << ": " << endContig - firstContig << " contigs";
+                if (firstContig < endContig)
+                    cout << " from " << contigNames(context(bamFileIn))[firstContig] << " to " << contigNames(context(bamFileIn))[endContig-1];
+                cout << endl;
+            }
+            if (options.resume)
+                firstContig = checkpointing.saved.nextItem;
+            //Per contig filtering needs the index, without one the file is streamed on a single thread.
+            if (options.numThreads > 1 && !streamIn && (options.nShards > 0 || open(baiIndex, toCString(indexPath))))
+            {
+                //Workers start their contigs from the beginning.
+                if (options.resume && !checkpointing.saved.contigState.empty())
+                {
+                    std::cerr << "ERROR: The checkpoint was taken inside a contig by a run on one thread, it cannot be resumed on threads." << std::endl;
+                    return 1;
+                }
+                if (qualityFilterContigs(firstContig, endContig, baiIndex, options, bamFileOut, namer) != 0)
+                    return 1;
+            }
+            else
+            {
+                if (options.numThreads > 1 && streamIn)
+                    cout << "Reading from standard input, filtering on one thread." << endl;
+                else if (options.numThreads > 1)
+                    cout << "Could not read BAI index file " << indexPath << ", filtering on one thread." << endl;
+                //A checkpoint of a run on threads has no input offset to go on from.
+                if (options.resume && (checkpointing.saved.inputOffset == (__uint64)-1 || !seek(bamFileIn.bgzf, checkpointing.saved.inputOffset)))
+                {
+                    std::cerr << "ERROR: Could not go on reading " << bamPathIn << " at the checkpoint." << std::endl;
+                    return 1;
+                }
+                //A shard starts at the first of its contigs with reads.
+                bool hasRecord = true;
+                if (!options.resume && firstContig > 0)
+                {
+                    hasRecord = false;
+                    for (unsigned c=firstContig; c<endContig && !hasRecord; ++c)
+                        jumpToReference(bamFileIn, hasRecord, c, baiIndex);
+                    clearReadLimit(bamFileIn.bgzf);
+                }
+                //Reads without a reference sequence at the end of the file are not filtered.
+                hasRecord = hasRecord && readNextRecord(record, bamFileIn);
+                //A checkpoint taken inside a contig goes on with the reads, pairs and coverage it kept of the contig.
+                bool resumeInContig = options.resume && !checkpointing.saved.contigState.empty();
+                while (hasRecord && record.rID != BamAlignmentRecord::INVALID_REFID && record.rID < (int)endContig)
+                {
+                    int rID = record.rID;
+                    startItem(namer, rID);
+                    CoverageWindow coverage = coverageWindow(options, rID);
+                    if (resumeInContig)
+                    {
+                        resumeInContig = false;
+                        namer.next = checkpointing.saved.nextName;
+                        if (!unpackContigState(coverage, readWindow, mateEditMap, adapterMap, checkpointing.saved.contigState))
+                        {
+                            std::cerr << "ERROR: Could not read the checkpoint " << checkpointing.path << std::endl;
+                            return 1;
+                        }
+                    }
+                    if (reportItem(rID, bamFileIn, [&]
+                    {
+                        return qualityFilterContig(bamFileIn, record, hasRecord, bamFileOut, mateEditMap, keepMapQual, maxFragLen, readWindow, adapterMap, minMatchingBases, coverage, namer);
+                    }) != 0)
+                        return 1;
+                    if (hasRecord && record.rID != BamAlignmentRecord::INVALID_REFID && record.rID < (int)endContig && !checkpointContig(record.rID, bamFileIn.recordOffset, bamFileOut, namer, delStats))
+                    {
+                        std::cerr << "ERROR: Could not write the checkpoint " << checkpointing.path << std::endl;
+                        return 1;
+                    }
+                }
+            }
+        }
+    }
+    catch (Exception const & e)
+    {
+        std::cout << "ERROR: " << e.what() << std::endl;
+        return 1;
+    }
+    if (!close(bamFileOut))
+    {
+        std::cerr << "ERROR: Could not write " << options.bamPathOut << std::endl;
+        return 1;
+    }
+    if (options.indexFormat != BAM_INDEX_NONE)
+    {
+        CharString indexPathOut = options.bamPathOut;
+        append(indexPathOut, options.indexFormat == BAM_INDEX_CSI ? ".csi" : ".bai");
+        if (!outIndex.sorted)
+        {
+            std::cerr << "ERROR: " << options.bamPathOut << " is not sorted by position, no index was written." << std::endl;
+            return 1;
+        }
+        if (!outIndex.fits)
+        {
+            std::cerr << "ERROR: " << options.bamPathOut << " has reads past the positions the index can hold, no index was written." << std::endl;
+            return 1;
+        }
+        if (!writeIndex(outIndex, bamFileOut, length(contigNames(context(bamFileIn))), toCString(indexPathOut), options.indexFormat))
+        {
+            std::cerr << "ERROR: Could not write " << indexPathOut << std::endl;
+            return 1;
+        }
+    }
+    //The output is complete, there is nothing left to resume.
+    if (checkpointing.enabled)
+    {
+        fclose(checkpointing.namesFile);
+        remove(toCString(checkpointing.path));
+        remove(toCString(namesPath));
+    }
+    delStats.nAllocations += allocationCount - allocationsBefore;
+    addReadStats(delStats, stageStats, bamFileIn.bgzf);
+    if (stageTiming)
+    {
+        //The wall time of compression is the time the filter waited for a free output block.
+        stageStats.stages[STAGE_COMPRESS].wallNanos += bamFileOut.bgzf.submitWaitNanos;
+        stageStats.stages[STAGE_COMPRESS].cpuNanos += bamFileOut.bgzf.deflateCpuNanos;
+        stageStats.stages[STAGE_COMPRESS].items += bamFileOut.bgzf.nCompressed;
+        if (!writeStatsJson(options.statsJson, delStats, stageStats, (wallClockNanos() - wallBegin)*1e-9, (double)(std::clock() - cpuBegin)/CLOCKS_PER_SEC))
+        {
+            std::cerr << "ERROR: Could not write " << options.statsJson << std::endl;
+            return 1;
+        }
     }
-    close(bamFileOut);
-    close(bamFileIn);
     cout << "Soft clipped bp: " << delStats.nSoftClippedBp << " Number of coverage filtered reads: "<< delStats.nCoverageFiltered << " Quality clipped bp: " << delStats.nQualityClippedBp << " Not enough matches reads: " << delStats.nMatchRemovedReads << " Adapter removed bp: " << delStats.nAdapterClippedBp << " Number of adapter trimmed reads: " << delStats.nAdapterReads << " Total number of reads: " << delStats.nTotalReads << " Fragment of adapter reads: " << (double)delStats.nAdapterReads/(double)delStats.nTotalReads << endl;
+    cout << "Largest number of tracked mates: " << delStats.maxMateEntries << " Largest number of waiting adapter reads: " << delStats.maxAdapterEntries << " Largest number of buffered reads: " << delStats.maxWindowReads << endl;
+    if (countAllocations)
+        cout << "Allocations: " << delStats.nAllocations << " Allocations per read: " << (double)delStats.nAllocations/(double)delStats.nTotalReads << endl;
+    cout << "Prefetched chunk ranges: " << delStats.nPrefetchedRanges << " Chunk ranges read: " << delStats.nRangesRead << " In page cache when read: " << delStats.nCachedRanges << " Seconds waiting for input blocks: " << delStats.stallSeconds << endl;
     return 0;
 }
+#endif
@@ -0,0 +1,164 @@
+#ifndef BAMSHRINK_BAM_CIGAR_H_
+#define BAMSHRINK_BAM_CIGAR_H_
+
+#include <algorithm>
+#include <seqan/basic.h>
+
+//CIGAR as it is packed in BAM records: one 32-bit value per operation with the length in the upper 28 bits and the
+//operation code in the lower 4. Everything here works on whole operations, so trimming a read costs time in the number
+//of operations and not in the number of bases.
+
+//CIGAR operation codes of the packed BAM CIGAR.
+enum BamCigarOp
+{
+    BAM_CIGAR_M = 0,
+    BAM_CIGAR_I = 1,
+    BAM_CIGAR_D = 2,
+    BAM_CIGAR_N = 3,
+    BAM_CIGAR_S = 4,
+    BAM_CIGAR_H = 5,
+    BAM_CIGAR_P = 6,
+    BAM_CIGAR_EQ = 7,
+    BAM_CIGAR_X = 8
+};
+
+//Operation classes, one bit per operation code. Codes above X are not valid and belong to no class.
+constexpr unsigned BAM_CIGAR_CONSUMES_QUERY = 1 << BAM_CIGAR_M | 1 << BAM_CIGAR_I | 1 << BAM_CIGAR_S | 1 << BAM_CIGAR_EQ | 1 << BAM_CIGAR_X;
+constexpr unsigned BAM_CIGAR_CONSUMES_REF = 1 << BAM_CIGAR_M | 1 << BAM_CIGAR_D | 1 << BAM_CIGAR_N | 1 << BAM_CIGAR_EQ | 1 << BAM_CIGAR_X;
+constexpr unsigned BAM_CIGAR_ALIGNED = BAM_CIGAR_CONSUMES_QUERY & BAM_CIGAR_CONSUMES_REF;
+
+constexpr unsigned cigarOp(__uint32 opAndCount)
+{
+    return opAndCount & 15;
+}
+
+constexpr unsigned cigarOpLength(__uint32 opAndCount)
+{
+    return opAndCount >> 4;
+}
+
+constexpr __uint32 packCigarOp(unsigned op, unsigned len)
+{
+    return len << 4 | op;
+}
+
+constexpr bool consumesQuery(unsigned op)
+{
+    return (BAM_CIGAR_CONSUMES_QUERY >> op) & 1;
+}
+
+constexpr bool consumesRef(unsigned op)
+{
+    return (BAM_CIGAR_CONSUMES_REF >> op) & 1;
+}
+
+static_assert(consumesQuery(BAM_CIGAR_S) && !consumesRef(BAM_CIGAR_S), "Soft clips are in the read only.");
+static_assert(!consumesQuery(BAM_CIGAR_D) && consumesRef(BAM_CIGAR_D), "Deletions are in the reference only.");
+static_assert(!consumesQuery(BAM_CIGAR_H) && !consumesRef(BAM_CIGAR_H), "Hard clips are in neither.");
+
+//Sum of the lengths of the operations in the given classes.
+inline unsigned cigarLength(__uint32 const * cigar, unsigned n, unsigned opClass)
+{
+    unsigned len = 0;
+    for (unsigned i = 0; i < n; ++i)
+        if ((opClass >> cigarOp(cigar[i])) & 1)
+            len += cigarOpLength(cigar[i]);
+    return len;
+}
+
+inline unsigned cigarQueryLength(__uint32 const * cigar, unsigned n)
+{
+    return cigarLength(cigar, n, BAM_CIGAR_CONSUMES_QUERY);
+}
+
+inline unsigned cigarRefLength(__uint32 const * cigar, unsigned n)
+{
+    return cigarLength(cigar, n, BAM_CIGAR_CONSUMES_REF);
+}
+
+//What a clip took off one end of a CIGAR: ops whole operations that the caller has to drop at that end, and the query
+//and reference bases that are no longer covered.
+struct CigarClip {
+    unsigned ops;
+    unsigned query;
+    unsigned ref;
+} ;
+
+//Clips queryBases read bases off the front. The operation the clip ends in is shortened in place. Operations without
+//read bases at the new front, such as a deletion right after the clipped bases, go as well, so the alignment starts
+//with a read base and clip.ref is how far its start moves on the reference.
+inline CigarClip clipCigarFront(__uint32 * cigar, unsigned n, unsigned queryBases)
+{
+    CigarClip clip = {0, 0, 0};
+    for (; clip.ops < n; ++clip.ops)
+    {
+        unsigned op = cigarOp(cigar[clip.ops]);
+        unsigned len = cigarOpLength(cigar[clip.ops]);
+        if (consumesQuery(op))
+        {
+            if (clip.query == queryBases && len != 0)
+                break;
+            if (len > queryBases - clip.query)
+            {
+                len = queryBases - clip.query;
+                cigar[clip.ops] = packCigarOp(op, cigarOpLength(cigar[clip.ops]) - len);
+                clip.query += len;
+                clip.ref += consumesRef(op) ? len : 0;
+                break;
+            }
+            clip.query += len;
+        }
+        clip.ref += consumesRef(op) ? len : 0;
+    }
+    return clip;
+}
+
+//Same as clipCigarFront() at the back. clip.ref is how much shorter the alignment gets on the reference.
+inline CigarClip clipCigarBack(__uint32 * cigar, unsigned n, unsigned queryBases)
+{
+    CigarClip clip = {0, 0, 0};
+    for (; clip.ops < n; ++clip.ops)
+    {
+        __uint32 & opAndCount = cigar[n - 1 - clip.ops];
+        unsigned op = cigarOp(opAndCount);
+        unsigned len = cigarOpLength(opAndCount);
+        if (consumesQuery(op))
+        {
+            if (clip.query == queryBases && len != 0)
+                break;
+            if (len > queryBases - clip.query)
+            {
+                len = queryBases - clip.query;
+                opAndCount = packCigarOp(op, cigarOpLength(opAndCount) - len);
+                clip.query += len;
+                clip.ref += consumesRef(op) ? len : 0;
+                break;
+            }
+            clip.query += len;
+        }
+        clip.ref += consumesRef(op) ? len : 0;
+    }
+    return clip;
+}
+
+//Clips the front so that the alignment starts refBases further on the reference, or at the first read base after
+//that if a deletion spans or follows the new start; clip.ref tells which. An insertion right at the new start is kept.
+inline CigarClip clipCigarFrontToRef(__uint32 * cigar, unsigned n, unsigned refBases)
+{
+    unsigned queryBases = 0;
+    for (unsigned i = 0; i < n && refBases > 0; ++i)
+    {
+        unsigned op = cigarOp(cigar[i]);
+        unsigned len = cigarOpLength(cigar[i]);
+        if (consumesRef(op))
+        {
+            len = std::min(len, refBases);
+            refBases -= len;
+        }
+        if (consumesQuery(op))
+            queryBases += len;
+    }
+    return clipCigarFront(cigar, n, queryBases);
+}
+
+#endif  // BAMSHRINK_BAM_CIGAR_H_
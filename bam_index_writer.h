@@ -0,0 +1,308 @@
+#ifndef BAMSHRINK_BAM_INDEX_WRITER_H_
+#define BAMSHRINK_BAM_INDEX_WRITER_H_
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <vector>
+#include <seqan/bam_io.h>
+#include "bgzf_writer.h"
+
+//Builds the BAI or CSI index of a BAM file while it is written, from the virtual offsets of every record, so the file
+//does not have to be read again by samtools index. The offsets handed in only have to be in file order: they are
+//translated when the index is written, which lets the BGZF writer give out offsets of blocks it has not compressed yet.
+
+enum BamIndexFormat
+{
+    BAM_INDEX_NONE,
+    BAM_INDEX_BAI,
+    BAM_INDEX_CSI
+};
+
+//Binning of the BAI: 16 kbp windows at the bottom and five levels of bins, which covers 2^29 bp. The CSI has the same
+//windows and as many levels as the longest reference needs, see setIndexBinning().
+const unsigned BAM_INDEX_MIN_SHIFT = 14;
+const unsigned BAM_INDEX_DEPTH = 5;
+
+//Bin that follows the real bins of a reference in the BAI. Its two chunks are the offsets of the first and past the
+//last record of the reference and the number of mapped and unmapped reads on it. The CSI puts it after its own bins,
+//see _pseudoBin().
+const __uint32 BAI_PSEUDO_BIN = 37450;
+
+const __uint64 BAM_INDEX_NO_OFFSET = (__uint64)-1;
+
+struct BamIndexChunk {
+    __uint64 begin;
+    __uint64 end;
+} ;
+
+struct BamIndexReference {
+    std::map<__uint32, std::vector<BamIndexChunk> > bins;
+    //Smallest offset of the records overlapping each window, BAM_INDEX_NO_OFFSET where none does.
+    std::vector<__uint64> linear;
+    BamIndexChunk span = {0, 0};
+    __uint64 nMapped = 0;
+    __uint64 nUnmapped = 0;
+} ;
+
+//Records have to come sorted by position, with the ones without a reference at the end. Anything else clears sorted
+//and the index is not written.
+struct BamIndexBuilder {
+    std::vector<BamIndexReference> refs;
+    __uint64 nNoCoord = 0;
+    bool sorted = true;
+    //The binning, and whether all records lie within it. Otherwise the index is not written either.
+    unsigned minShift = BAM_INDEX_MIN_SHIFT;
+    unsigned depth = BAM_INDEX_DEPTH;
+    bool fits = true;
+    //The last record, and the chunk of its bin that is still growing.
+    __int32 rID = -1;
+    __int32 pos = 0;
+    __uint32 bin = 0;
+    BamIndexChunk chunk = {0, 0};
+} ;
+
+//Length of the longest reference, from lengths such as the contigLengths() of a BAM header.
+template <typename TLengths>
+inline __uint64 longestReference(TLengths const & lengths)
+{
+    __uint64 longest = 0;
+    for (unsigned i = 0; i < seqan::length(lengths); ++i)
+        longest = std::max(longest, (__uint64)lengths[i]);
+    return longest;
+}
+
+//Picks the binning for the format and the longest reference. The CSI gets the levels that samtools gives it, the BAI
+//keeps its five; fits is cleared if the BAI cannot hold the reference. Returns fits.
+inline bool setIndexBinning(BamIndexBuilder & index, BamIndexFormat format, __uint64 maxLength)
+{
+    index.minShift = BAM_INDEX_MIN_SHIFT;
+    index.depth = BAM_INDEX_DEPTH;
+    if (format == BAM_INDEX_CSI)
+    {
+        maxLength += 256;
+        index.depth = 0;
+        for (__uint64 span = 1ull << index.minShift; maxLength > span; span <<= 3)
+            ++index.depth;
+    }
+    else if (maxLength > 1ull << (BAM_INDEX_MIN_SHIFT + 3 * BAM_INDEX_DEPTH))
+        index.fits = false;
+    return index.fits;
+}
+
+//Bin of [beginPos, endPos) in the binning of the index, the smallest that holds it.
+inline __uint32 _indexBin(BamIndexBuilder const & index, __int64 beginPos, __int64 endPos)
+{
+    unsigned shift = index.minShift;
+    __uint32 levelOffset = ((1u << 3 * index.depth) - 1) / 7;
+    --endPos;
+    for (unsigned level = index.depth; level > 0; --level, shift += 3, levelOffset -= 1u << 3 * level)
+        if (beginPos >> shift == endPos >> shift)
+            return levelOffset + (beginPos >> shift);
+    return 0;
+}
+
+inline __uint32 _pseudoBin(BamIndexBuilder const & index)
+{
+    return ((1u << 3 * (index.depth + 1)) - 1) / 7 + 1;
+}
+
+inline void _flushIndexChunk(BamIndexBuilder & index)
+{
+    if (index.rID >= 0)
+        index.refs[index.rID].bins[index.bin].push_back(index.chunk);
+}
+
+//Adds a record that covers [beginPos, endPos) of reference rID and takes up [begin, end) in the file.
+inline void addRecord(BamIndexBuilder & index, __int32 rID, __int32 beginPos, __int32 endPos, bool unmapped, __uint64 begin, __uint64 end)
+{
+    if (rID < 0 || beginPos < 0)
+    {
+        _flushIndexChunk(index);
+        index.rID = -2;
+        ++index.nNoCoord;
+        return;
+    }
+    if (rID < index.rID || (rID == index.rID && beginPos < index.pos) || index.rID == -2)
+        index.sorted = false;
+    if ((__int64)endPos > 1ll << (index.minShift + 3 * index.depth))
+        index.fits = false;
+    if (!index.sorted || !index.fits)
+        return;
+    __uint32 bin = _indexBin(index, beginPos, endPos);
+    if (rID != index.rID || bin != index.bin)
+    {
+        _flushIndexChunk(index);
+        if ((unsigned)rID >= index.refs.size())
+            index.refs.resize(rID + 1);
+        index.bin = bin;
+        index.chunk.begin = begin;
+    }
+    index.chunk.end = end;
+    BamIndexReference & ref = index.refs[rID];
+    if (rID != index.rID)
+        ref.span.begin = begin;
+    ref.span.end = end;
+    ++(unmapped ? ref.nUnmapped : ref.nMapped);
+    unsigned lastWindow = (endPos - 1) >> index.minShift;
+    if (lastWindow >= ref.linear.size())
+        ref.linear.resize(lastWindow + 1, BAM_INDEX_NO_OFFSET);
+    for (unsigned w = beginPos >> index.minShift; w <= lastWindow; ++w)
+        if (ref.linear[w] == BAM_INDEX_NO_OFFSET)
+            ref.linear[w] = begin;
+    index.rID = rID;
+    index.pos = beginPos;
+}
+
+//Ends the last chunk and translates all offsets to file offsets. Chunks of a bin that meet in one BGZF block are merged
+//and windows without records get the offset of the window before, as samtools does.
+template <typename TTranslate>
+inline void _finishIndex(BamIndexBuilder & index, TTranslate translate)
+{
+    _flushIndexChunk(index);
+    index.rID = -2;
+    for (unsigned r = 0; r < index.refs.size(); ++r)
+    {
+        BamIndexReference & ref = index.refs[r];
+        ref.span.begin = translate(ref.span.begin);
+        ref.span.end = translate(ref.span.end);
+        for (std::map<__uint32, std::vector<BamIndexChunk> >::iterator it = ref.bins.begin(); it != ref.bins.end(); ++it)
+        {
+            std::vector<BamIndexChunk> & chunks = it->second;
+            unsigned n = 0;
+            for (unsigned i = 0; i < chunks.size(); ++i)
+            {
+                BamIndexChunk chunk = {translate(chunks[i].begin), translate(chunks[i].end)};
+                if (n > 0 && chunk.begin >> 16 <= chunks[n - 1].end >> 16)
+                    chunks[n - 1].end = chunk.end;
+                else
+                    chunks[n++] = chunk;
+            }
+            chunks.resize(n);
+        }
+        __uint64 previous = 0;
+        for (unsigned w = 0; w < ref.linear.size(); ++w)
+        {
+            if (ref.linear[w] != BAM_INDEX_NO_OFFSET)
+                previous = translate(ref.linear[w]);
+            ref.linear[w] = previous;
+        }
+    }
+}
+
+template <typename TValue>
+inline void _appendIndexValue(std::vector<char> & out, TValue value)
+{
+    char bytes[sizeof(TValue)];
+    memcpy(bytes, &value, sizeof(TValue));
+    out.insert(out.end(), bytes, bytes + sizeof(TValue));
+}
+
+//First position covered by a bin of the binning of the index.
+inline __uint64 _binBegin(BamIndexBuilder const & index, __uint32 bin)
+{
+    unsigned level = 0;
+    __uint32 levelOffset = 0;
+    while (level < index.depth && bin >= levelOffset + (1u << 3 * level))
+        levelOffset += 1u << 3 * level++;
+    return (__uint64)(bin - levelOffset) << (index.minShift + 3 * (index.depth - level));
+}
+
+inline void _appendIndexReference(std::vector<char> & out, BamIndexBuilder const & index, BamIndexReference const & ref, BamIndexFormat format)
+{
+    bool hasReads = ref.nMapped + ref.nUnmapped > 0;
+    _appendIndexValue<__int32>(out, ref.bins.size() + hasReads);
+    for (std::map<__uint32, std::vector<BamIndexChunk> >::const_iterator it = ref.bins.begin(); it != ref.bins.end(); ++it)
+    {
+        _appendIndexValue<__uint32>(out, it->first);
+        if (format == BAM_INDEX_CSI)
+        {
+            //Smallest offset of the records overlapping the first window of the bin, the CSI has no linear index.
+            __uint64 window = _binBegin(index, it->first) >> index.minShift;
+            _appendIndexValue<__uint64>(out, window < ref.linear.size() ? ref.linear[window] : it->second[0].begin);
+        }
+        _appendIndexValue<__int32>(out, it->second.size());
+        for (unsigned i = 0; i < it->second.size(); ++i)
+        {
+            _appendIndexValue<__uint64>(out, it->second[i].begin);
+            _appendIndexValue<__uint64>(out, it->second[i].end);
+        }
+    }
+    if (hasReads)
+    {
+        _appendIndexValue<__uint32>(out, _pseudoBin(index));
+        if (format == BAM_INDEX_CSI)
+            _appendIndexValue<__uint64>(out, 0);
+        _appendIndexValue<__int32>(out, 2);
+        _appendIndexValue<__uint64>(out, ref.span.begin);
+        _appendIndexValue<__uint64>(out, ref.span.end);
+        _appendIndexValue<__uint64>(out, ref.nMapped);
+        _appendIndexValue<__uint64>(out, ref.nUnmapped);
+    }
+    if (format == BAM_INDEX_BAI)
+    {
+        _appendIndexValue<__int32>(out, ref.linear.size());
+        for (unsigned w = 0; w < ref.linear.size(); ++w)
+            _appendIndexValue<__uint64>(out, ref.linear[w]);
+    }
+}
+
+//Makes writer hand the offsets of its records to index.
+inline void attachIndex(BamWriter & writer, BamIndexBuilder & index)
+{
+    writer.index = &index;
+    writer.bgzf.trackBlockOffsets = true;
+}
+
+template <typename TTranslate>
+inline bool _writeIndex(BamIndexBuilder & index, unsigned nRef, char const * path, BamIndexFormat format, TTranslate translate)
+{
+    if (!index.sorted || !index.fits)
+        return false;
+    _finishIndex(index, translate);
+    std::vector<char> out;
+    if (format == BAM_INDEX_CSI)
+    {
+        out.insert(out.end(), "CSI\1", "CSI\1" + 4);
+        _appendIndexValue<__int32>(out, index.minShift);
+        _appendIndexValue<__int32>(out, index.depth);
+        _appendIndexValue<__int32>(out, 0);
+    }
+    else
+        out.insert(out.end(), "BAI\1", "BAI\1" + 4);
+    _appendIndexValue<__int32>(out, nRef);
+    BamIndexReference empty;
+    for (unsigned r = 0; r < nRef; ++r)
+        _appendIndexReference(out, index, r < index.refs.size() ? index.refs[r] : empty, format);
+    _appendIndexValue<__uint64>(out, index.nNoCoord);
+    if (format == BAM_INDEX_CSI)
+    {
+        BgzfWriter csi;
+        if (!open(csi, path, 0, Z_DEFAULT_COMPRESSION))
+            return false;
+        writeData(csi, &out[0], out.size());
+        return close(csi);
+    }
+    FILE * file = fopen(path, "wb");
+    if (file == NULL)
+        return false;
+    bool written = fwrite(&out[0], 1, out.size(), file) == out.size();
+    return fclose(file) == 0 && written;
+}
+
+//Writes the index of the records written with writer, which must be closed, for nRef references. The BAI is written
+//as it is, the CSI BGZF compressed. Returns false if the records were not sorted or did not fit the binning, or the file
+//could not be written.
+inline bool writeIndex(BamIndexBuilder & index, BamWriter const & writer, unsigned nRef, char const * path, BamIndexFormat format)
+{
+    return _writeIndex(index, nRef, path, format, [&writer](__uint64 offset) { return fileOffset(writer.bgzf, offset); });
+}
+
+//Writes the index of records that were added with their virtual file offsets, see indexBamFile().
+inline bool writeIndex(BamIndexBuilder & index, unsigned nRef, char const * path, BamIndexFormat format)
+{
+    return _writeIndex(index, nRef, path, format, [](__uint64 offset) { return offset; });
+}
+
+#endif  // BAMSHRINK_BAM_INDEX_WRITER_H_
@@ -0,0 +1,345 @@
+#ifndef BAMSHRINK_BAM_RAW_RECORD_H_
+#define BAMSHRINK_BAM_RAW_RECORD_H_
+
+#include <algorithm>
+#include <cstring>
+#include <seqan/bam_io.h>
+#include "bgzf_writer.h"
+#include "bgzf_reader.h"
+#include "bam_cigar.h"
+#include "bam_index_writer.h"
+
+//A BAM record kept in its encoded form. The fixed-size fields live in the BamAlignmentRecordCore base and can be read
+//and changed directly, the read name is kept apart so it can be swapped, and data holds the rest of the record (CIGAR,
+//sequence, qualities and tags) exactly as in the file. Reads are trimmed in this form as well, see trimBases() and the
+//CIGAR clips below.
+struct BamRawRecord : seqan::BamAlignmentRecordCore {
+    seqan::CharString qName;
+    seqan::CharString data;
+} ;
+
+//Exchanges two records. Only the buffer pointers of the name and data are swapped.
+inline void swap(BamRawRecord & a, BamRawRecord & b)
+{
+    std::swap(static_cast<seqan::BamAlignmentRecordCore &>(a), static_cast<seqan::BamAlignmentRecordCore &>(b));
+    seqan::swap(a.qName, b.qName);
+    seqan::swap(a.data, b.data);
+}
+
+//Moves source into target. source keeps its fixed-size fields and gets the buffers of target in exchange, so a record
+//that is read into again and again keeps passing on its contents without allocating.
+inline void moveRecord(BamRawRecord & target, BamRawRecord & source)
+{
+    static_cast<seqan::BamAlignmentRecordCore &>(target) = source;
+    seqan::swap(target.qName, source.qName);
+    seqan::swap(target.data, source.data);
+}
+
+//Empties a record that is not needed anymore but keeps its buffers for the next one, see ReadNameTable.
+inline void _resetValue(BamRawRecord & record)
+{
+    static_cast<seqan::BamAlignmentRecordCore &>(record) = seqan::BamAlignmentRecordCore();
+    seqan::clear(record.qName);
+    seqan::clear(record.data);
+}
+
+const unsigned BAM_BASE_N = 15;
+const unsigned BAM_CORE_BYTES = sizeof(seqan::BamAlignmentRecordCore);
+
+inline bool hasFlagMultiple(BamRawRecord const & record)
+{
+    return (record.flag & seqan::BAM_FLAG_MULTIPLE) == seqan::BAM_FLAG_MULTIPLE;
+}
+
+inline bool hasFlagUnmapped(BamRawRecord const & record)
+{
+    return (record.flag & seqan::BAM_FLAG_UNMAPPED) == seqan::BAM_FLAG_UNMAPPED;
+}
+
+inline bool hasFlagNextUnmapped(BamRawRecord const & record)
+{
+    return (record.flag & seqan::BAM_FLAG_NEXT_UNMAPPED) == seqan::BAM_FLAG_NEXT_UNMAPPED;
+}
+
+inline bool hasFlagRC(BamRawRecord const & record)
+{
+    return (record.flag & seqan::BAM_FLAG_RC) == seqan::BAM_FLAG_RC;
+}
+
+inline bool hasFlagNextRC(BamRawRecord const & record)
+{
+    return (record.flag & seqan::BAM_FLAG_NEXT_RC) == seqan::BAM_FLAG_NEXT_RC;
+}
+
+inline bool hasFlagDuplicate(BamRawRecord const & record)
+{
+    return (record.flag & seqan::BAM_FLAG_DUPLICATE) == seqan::BAM_FLAG_DUPLICATE;
+}
+
+inline unsigned readLength(BamRawRecord const & record)
+{
+    return record._l_qseq;
+}
+
+inline __uint32 cigarAt(BamRawRecord const & record, unsigned i)
+{
+    __uint32 opAndCount;
+    memcpy(&opAndCount, seqan::begin(record.data, seqan::Standard()) + 4 * i, 4);
+    return opAndCount;
+}
+
+inline void eraseCigarAt(BamRawRecord & record, unsigned i)
+{
+    seqan::erase(record.data, 4 * i, 4 * i + 4);
+    --record._n_cigar;
+}
+
+//The CIGAR comes first in data, whose buffer is allocated with new and so aligned for 32-bit access.
+inline __uint32 * cigarBegin(BamRawRecord & record)
+{
+    return reinterpret_cast<__uint32 *>(seqan::begin(record.data, seqan::Standard()));
+}
+
+inline __uint32 const * cigarBegin(BamRawRecord const & record)
+{
+    return reinterpret_cast<__uint32 const *>(seqan::begin(record.data, seqan::Standard()));
+}
+
+inline unsigned getAlignmentLengthInRef(BamRawRecord const & record)
+{
+    return cigarRefLength(cigarBegin(record), record._n_cigar);
+}
+
+inline unsigned _seqOffset(BamRawRecord const & record)
+{
+    return 4 * record._n_cigar;
+}
+
+inline unsigned _qualOffset(BamRawRecord const & record)
+{
+    return _seqOffset(record) + (record._l_qseq + 1) / 2;
+}
+
+inline unsigned _tagsOffset(BamRawRecord const & record)
+{
+    return _qualOffset(record) + record._l_qseq;
+}
+
+inline unsigned baseAt(BamRawRecord const & record, unsigned i)
+{
+    unsigned char packed = record.data[_seqOffset(record) + i / 2];
+    return (i & 1) ? (packed & 15) : (packed >> 4);
+}
+
+inline char * qualBegin(BamRawRecord & record)
+{
+    return seqan::begin(record.data, seqan::Standard()) + _qualOffset(record);
+}
+
+//Removes front bases from the start and back bases from the end of the sequence and the qualities, moving the rest of
+//the record up in place. The CIGAR is not changed.
+inline void trimBases(BamRawRecord & record, unsigned front, unsigned back)
+{
+    unsigned len = record._l_qseq;
+    front = std::min(front, len);
+    back = std::min(back, len - front);
+    if (front + back == 0)
+        return;
+    unsigned newLen = len - front - back;
+    char * seq = seqan::begin(record.data, seqan::Standard()) + _seqOffset(record);
+    char const * qual = seq + (len + 1) / 2;
+    unsigned tagsLength = seqan::length(record.data) - _tagsOffset(record);
+    //Bases only move towards the front, so every byte is read before it is written.
+    for (unsigned i = 0; i < newLen; i += 2)
+    {
+        unsigned packed = baseAt(record, front + i) << 4;
+        if (i + 1 < newLen)
+            packed |= baseAt(record, front + i + 1);
+        seq[i / 2] = packed;
+    }
+    char * newQual = seq + (newLen + 1) / 2;
+    memmove(newQual, qual + front, newLen);
+    memmove(newQual + newLen, qual + len, tagsLength);
+    record._l_qseq = newLen;
+    seqan::resize(record.data, _tagsOffset(record) + tagsLength);
+}
+
+//Clips read bases off the CIGAR, see clipCigarFront() and clipCigarBack(). The sequence is trimmed with trimBases() and
+//beginPos is left to the caller.
+inline CigarClip clipCigarFront(BamRawRecord & record, unsigned queryBases)
+{
+    CigarClip clip = clipCigarFront(cigarBegin(record), record._n_cigar, queryBases);
+    seqan::erase(record.data, 0, 4 * clip.ops);
+    record._n_cigar -= clip.ops;
+    return clip;
+}
+
+inline CigarClip clipCigarBack(BamRawRecord & record, unsigned queryBases)
+{
+    CigarClip clip = clipCigarBack(cigarBegin(record), record._n_cigar, queryBases);
+    seqan::erase(record.data, 4 * (record._n_cigar - clip.ops), 4 * record._n_cigar);
+    record._n_cigar -= clip.ops;
+    return clip;
+}
+
+//Clips the CIGAR so the alignment starts at refPos, see clipCigarFrontToRef().
+inline CigarClip clipCigarToRefPos(BamRawRecord & record, __int32 refPos)
+{
+    unsigned refBases = refPos > record.beginPos ? refPos - record.beginPos : 0;
+    CigarClip clip = clipCigarFrontToRef(cigarBegin(record), record._n_cigar, refBases);
+    seqan::erase(record.data, 0, 4 * clip.ops);
+    record._n_cigar -= clip.ops;
+    return clip;
+}
+
+//End of the alignment on the reference, one past the start for reads that cover no reference bases.
+inline __int32 _recordEnd(BamRawRecord const & record)
+{
+    return record.beginPos + std::max(1u, getAlignmentLengthInRef(record));
+}
+
+//Fills the block size and the fixed-size fields. Like SeqAn the bin is computed from the alignment.
+inline void _rawRecordHeader(char * header, BamRawRecord const & record)
+{
+    seqan::BamAlignmentRecordCore core = record;
+    core._l_qname = seqan::length(record.qName) + 1;
+    core.bin = seqan::_reg2Bin(record.beginPos, _recordEnd(record));
+    __int32 blockSize = BAM_CORE_BYTES + core._l_qname + seqan::length(record.data);
+    memcpy(header, &blockSize, 4);
+    memcpy(header + 4, &core, BAM_CORE_BYTES);
+}
+
+inline void appendRawRecord(seqan::CharString & target, BamRawRecord const & record)
+{
+    size_t pos = seqan::length(target);
+    seqan::resize(target, pos + 4 + BAM_CORE_BYTES + seqan::length(record.qName) + 1 + seqan::length(record.data));
+    char * out = seqan::begin(target, seqan::Standard()) + pos;
+    _rawRecordHeader(out, record);
+    out += 4 + BAM_CORE_BYTES;
+    memcpy(out, seqan::begin(record.qName, seqan::Standard()), seqan::length(record.qName));
+    out += seqan::length(record.qName);
+    *out++ = '\0';
+    memcpy(out, seqan::begin(record.data, seqan::Standard()), seqan::length(record.data));
+}
+
+inline void writeRecord(BamWriter & writer, BamRawRecord const & record)
+{
+    char header[4 + BAM_CORE_BYTES];
+    __uint64 begin = writer.index != NULL ? tell(writer.bgzf) : 0;
+    _rawRecordHeader(header, record);
+    writeData(writer.bgzf, header, sizeof(header));
+    writeData(writer.bgzf, seqan::begin(record.qName, seqan::Standard()), seqan::length(record.qName));
+    writeData(writer.bgzf, "", 1);
+    writeData(writer.bgzf, seqan::begin(record.data, seqan::Standard()), seqan::length(record.data));
+    if (writer.index != NULL)
+        addRecord(*writer.index, record.rID, record.beginPos, _recordEnd(record), hasFlagUnmapped(record), begin, tell(writer.bgzf));
+}
+
+//Whether the CIGAR, sequence and qualities that the fixed-size fields announce fit into data, so that the accessors
+//above stay within the record.
+inline bool _recordLengthsFit(BamRawRecord const & record)
+{
+    return record._l_qseq >= 0 &&
+           4 * (__uint64)record._n_cigar + ((__uint64)record._l_qseq + 1) / 2 + (__uint64)record._l_qseq <= seqan::length(record.data);
+}
+
+//Reads the record straight from the decompressed blocks into the record's own buffers. A record whose lengths do not
+//fit its block is reported like a file that ends early.
+inline void readRecord(BamRawRecord & record, BamReader & reader)
+{
+    __int32 blockSize = 0;
+    if (readData(reader.bgzf, reinterpret_cast<char *>(&blockSize), 4) != 4 ||
+        blockSize < (__int32)BAM_CORE_BYTES ||
+        readData(reader.bgzf, reinterpret_cast<char *>(static_cast<seqan::BamAlignmentRecordCore *>(&record)), BAM_CORE_BYTES) != BAM_CORE_BYTES ||
+        blockSize < (__int32)(BAM_CORE_BYTES + record._l_qname))
+        throw seqan::IOError("Unexpected end of BAM file.");
+    if (record._l_qname == 0)
+        throw seqan::IOError("Invalid BAM record: empty read name.");
+    seqan::resize(record.qName, record._l_qname);
+    seqan::resize(record.data, blockSize - BAM_CORE_BYTES - record._l_qname);
+    if (readData(reader.bgzf, seqan::begin(record.qName, seqan::Standard()), record._l_qname) != record._l_qname ||
+        readData(reader.bgzf, seqan::begin(record.data, seqan::Standard()), seqan::length(record.data)) != seqan::length(record.data))
+        throw seqan::IOError("Unexpected end of BAM file.");
+    if (!_recordLengthsFit(record))
+        throw seqan::IOError("Invalid BAM record: CIGAR and sequence do not fit the record.");
+    seqan::resize(record.qName, record._l_qname - 1);
+}
+
+//Reads the fixed-size fields of the next record and skips the rest of it.
+inline void readRecordCore(seqan::BamAlignmentRecordCore & core, BamReader & reader)
+{
+    __int32 blockSize = 0;
+    if (readData(reader.bgzf, reinterpret_cast<char *>(&blockSize), 4) != 4 ||
+        blockSize < (__int32)BAM_CORE_BYTES ||
+        readData(reader.bgzf, reinterpret_cast<char *>(&core), BAM_CORE_BYTES) != BAM_CORE_BYTES ||
+        skipData(reader.bgzf, blockSize - BAM_CORE_BYTES) != blockSize - BAM_CORE_BYTES)
+        throw seqan::IOError("Unexpected end of BAM file.");
+}
+
+//Parses a record written with appendRawRecord(). Returns the number of bytes it took up.
+inline size_t parseRawRecord(BamRawRecord & record, char const * bytes)
+{
+    __int32 blockSize = 0;
+    memcpy(&blockSize, bytes, 4);
+    memcpy(static_cast<seqan::BamAlignmentRecordCore *>(&record), bytes + 4, BAM_CORE_BYTES);
+    if (record._l_qname == 0 || blockSize < (__int32)(BAM_CORE_BYTES + record._l_qname))
+        throw seqan::IOError("Invalid BAM record: read name does not fit the record.");
+    char const * name = bytes + 4 + BAM_CORE_BYTES;
+    seqan::resize(record.qName, record._l_qname - 1);
+    memcpy(seqan::begin(record.qName, seqan::Standard()), name, record._l_qname - 1);
+    char const * data = name + record._l_qname;
+    seqan::resize(record.data, bytes + 4 + blockSize - data);
+    memcpy(seqan::begin(record.data, seqan::Standard()), data, seqan::length(record.data));
+    if (!_recordLengthsFit(record))
+        throw seqan::IOError("Invalid BAM record: CIGAR and sequence do not fit the record.");
+    return 4 + blockSize;
+}
+
+//Adds the records that a reopened writer kept, see reopen(), to its index. They are read back from the file at path, and
+//their offsets are given by the block numbers the writer uses.
+inline bool indexWrittenRecords(BamWriter & writer, char const * path)
+{
+    BamReader reader;
+    if (writer.index == NULL || !open(reader, path, 0))
+        return false;
+    seqan::BamHeader header;
+    readHeader(header, reader);
+    std::vector<__uint64> const & blockOffsets = writer.bgzf.blockOffsets;
+    auto writerOffset = [&blockOffsets](__uint64 offset)
+    {
+        __uint64 block = std::lower_bound(blockOffsets.begin(), blockOffsets.end(), offset >> 16) - blockOffsets.begin();
+        return block << 16 | (offset & 0xffff);
+    };
+    BamRawRecord record;
+    while (!atEnd(reader))
+    {
+        __uint64 begin = writerOffset(tell(reader.bgzf));
+        readRecord(record, reader);
+        addRecord(*writer.index, record.rID, record.beginPos, _recordEnd(record), hasFlagUnmapped(record), begin, writerOffset(tell(reader.bgzf)));
+    }
+    return true;
+}
+
+//Adds the records of the BAM file at path to the index with their virtual file offsets, for files that were not written
+//with the index attached, such as merged ones. nRef is set to the number of references in the header, the binning is
+//picked for format and the longest of them, see setIndexBinning().
+inline bool indexBamFile(BamIndexBuilder & index, unsigned & nRef, char const * path, BamIndexFormat format, unsigned numThreads)
+{
+    BamReader reader;
+    if (!open(reader, path, numThreads))
+        return false;
+    seqan::BamHeader header;
+    readHeader(header, reader);
+    nRef = seqan::length(seqan::contigNames(context(reader)));
+    setIndexBinning(index, format, longestReference(seqan::contigLengths(context(reader))));
+    BamRawRecord record;
+    while (!atEnd(reader))
+    {
+        __uint64 begin = tell(reader.bgzf);
+        readRecord(record, reader);
+        addRecord(index, record.rID, record.beginPos, _recordEnd(record), hasFlagUnmapped(record), begin, tell(reader.bgzf));
+    }
+    return true;
+}
+
+#endif  // BAMSHRINK_BAM_RAW_RECORD_H_
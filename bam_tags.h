@@ -0,0 +1,121 @@
+#ifndef BAMSHRINK_BAM_TAGS_H_
+#define BAMSHRINK_BAM_TAGS_H_
+
+#include <algorithm>
+#include <bitset>
+#include <cctype>
+#include <string>
+#include <sstream>
+#include <vector>
+#include "bam_raw_record.h"
+
+//Two-character tag key as one 16-bit value, the first character in the low byte as in the BAM tag block.
+constexpr __uint16 tagKey(char first, char second)
+{
+    return (unsigned char)first | (unsigned char)second << 8;
+}
+
+//Tags to keep, given at run time. The common lists are matched with a StaticTagKeys specialization instead.
+struct TagFilter {
+    std::vector<__uint16> keys;
+    std::bitset<65536> keep;
+} ;
+
+//Keep-list fixed at compile time.
+template <__uint16 ... KEYS>
+struct StaticTagKeys {} ;
+
+inline bool _keepTag(StaticTagKeys<> const &, __uint16)
+{
+    return false;
+}
+
+template <__uint16 KEY, __uint16 ... REST>
+inline bool _keepTag(StaticTagKeys<KEY, REST...> const &, __uint16 key)
+{
+    return key == KEY || _keepTag(StaticTagKeys<REST...>(), key);
+}
+
+inline bool _keepTag(TagFilter const & filter, __uint16 key)
+{
+    return filter.keep[key];
+}
+
+//Reads a comma separated list of tags such as RG,MQ. An empty list keeps no tags. Returns false if a tag is not two
+//characters, a letter followed by a letter or digit.
+inline bool parseTagFilter(TagFilter & filter, std::string const & list)
+{
+    filter = TagFilter();
+    std::stringstream ss(list);
+    std::string tag;
+    while (std::getline(ss, tag, ','))
+    {
+        if (tag.size() != 2 || !isalpha((unsigned char)tag[0]) || !isalnum((unsigned char)tag[1]))
+            return false;
+        __uint16 key = tagKey(tag[0], tag[1]);
+        if (!filter.keep[key])
+            filter.keys.push_back(key);
+        filter.keep[key] = true;
+    }
+    return true;
+}
+
+//Size of a tag value of the given BAM type, or 0 for the variable sized types.
+inline unsigned tagValueSize(char type)
+{
+    switch (type)
+    {
+        case 'A': case 'c': case 'C': return 1;
+        case 's': case 'S': return 2;
+        case 'i': case 'I': case 'f': return 4;
+        default: return 0;
+    }
+}
+
+//Moves the tags to keep to the front of the tag block in one pass and cuts off the rest.
+template <typename TKeep>
+inline void _filterTags(BamRawRecord & record, TKeep const & keep)
+{
+    char * tags = seqan::begin(record.data, seqan::Standard()) + _tagsOffset(record);
+    char * tagsEnd = seqan::end(record.data, seqan::Standard());
+    char * out = tags;
+    for (char * tag = tags; tag + 3 <= tagsEnd; )
+    {
+        char * value = tag + 3;
+        if (tag[2] == 'Z' || tag[2] == 'H')
+            value = std::find(value, tagsEnd, '\0') + 1;
+        else if (tag[2] == 'B')
+        {
+            __int32 count = 0;
+            memcpy(&count, value + 1, 4);
+            value += 5 + count * tagValueSize(value[0]);
+        }
+        else
+            value += tagValueSize(tag[2]);
+        value = std::min(value, tagsEnd);
+        if (_keepTag(keep, tagKey(tag[0], tag[1])))
+        {
+            if (out != tag)
+                memmove(out, tag, value - tag);
+            out += value - tag;
+        }
+        tag = value;
+    }
+    seqan::resize(record.data, out - seqan::begin(record.data, seqan::Standard()));
+}
+
+//Keeps the tags of the filter. RG alone and RG with MQ, the lists bamShrink uses by default, get their own loops.
+inline void filterTags(BamRawRecord & record, TagFilter const & filter)
+{
+    const __uint16 RG = tagKey('R', 'G'), MQ = tagKey('M', 'Q');
+    if (filter.keys.empty())
+        seqan::resize(record.data, _tagsOffset(record));
+    else if (filter.keys.size() == 1 && filter.keys[0] == RG)
+        _filterTags(record, StaticTagKeys<tagKey('R', 'G')>());
+    else if (filter.keys.size() == 2 && filter.keep[RG] && filter.keep[MQ])
+        _filterTags(record, StaticTagKeys<tagKey('R', 'G'), tagKey('M', 'Q')>());
+    else
+        _filterTags(record, filter);
+}
+
+#endif  // BAMSHRINK_BAM_TAGS_H_
@@ -0,0 +1,175 @@
+//Compares two BAM files record by record: read name, flag, reference, position, mapping quality, CIGAR, mate reference
+//and position, template length, sequence, qualities and tags. The first record that differs is printed from both files
+//as SAM, with the fields that differ, and the exit status is 1. Identical files print the number of records and exit 0.
+//
+//  bench/bam_diff EXPECTED.bam ACTUAL.bam
+
+#include <cstdio>
+#include <string>
+#include <seqan/bam_io.h>
+#include "bgzf_reader.h"
+#include "bam_raw_record.h"
+#include "bam_tags.h"
+
+struct DiffFile {
+    char const * path;
+    BamReader reader;
+    seqan::BamHeader header;
+} ;
+
+bool openDiffFile(DiffFile & file, char const * path)
+{
+    file.path = path;
+    if (!open(file.reader, path, 0))
+    {
+        fprintf(stderr, "ERROR: Could not open %s\n", path);
+        return false;
+    }
+    readHeader(file.header, file.reader);
+    return true;
+}
+
+std::string contigName(DiffFile & file, __int32 rID)
+{
+    if (rID < 0 || (unsigned)rID >= seqan::length(seqan::contigNames(context(file.reader))))
+        return "*";
+    return seqan::toCString(seqan::contigNames(context(file.reader))[rID]);
+}
+
+//The tags in SAM notation; arrays are given by their type and length.
+std::string formatTags(BamRawRecord const & record)
+{
+    std::string out;
+    char const * tag = seqan::begin(record.data, seqan::Standard()) + _tagsOffset(record);
+    char const * tagsEnd = seqan::end(record.data, seqan::Standard());
+    while (tag + 3 <= tagsEnd)
+    {
+        char const * value = tag + 3;
+        char text[64] = "";
+        out += std::string("\t") + tag[0] + tag[1] + ":";
+        switch (tag[2])
+        {
+            case 'A': snprintf(text, sizeof(text), "A:%c", value[0]); break;
+            case 'c': snprintf(text, sizeof(text), "i:%d", (int)*(__int8 const *)value); break;
+            case 'C': snprintf(text, sizeof(text), "i:%u", (unsigned)*(__uint8 const *)value); break;
+            case 's': { __int16 v; memcpy(&v, value, 2); snprintf(text, sizeof(text), "i:%d", (int)v); break; }
+            case 'S': { __uint16 v; memcpy(&v, value, 2); snprintf(text, sizeof(text), "i:%u", (unsigned)v); break; }
+            case 'i': { __int32 v; memcpy(&v, value, 4); snprintf(text, sizeof(text), "i:%d", v); break; }
+            case 'I': { __uint32 v; memcpy(&v, value, 4); snprintf(text, sizeof(text), "i:%u", v); break; }
+            case 'f': { float v; memcpy(&v, value, 4); snprintf(text, sizeof(text), "f:%g", v); break; }
+            case 'B': { __int32 n; memcpy(&n, value + 1, 4); snprintf(text, sizeof(text), "B:%c,<%d values>", value[0], n); break; }
+            default: break;
+        }
+        if (tag[2] == 'Z' || tag[2] == 'H')
+        {
+            char const * end = std::find(value, tagsEnd, '\0');
+            out += std::string(1, tag[2]) + ":" + std::string(value, end);
+            value = end + 1;
+        }
+        else if (tag[2] == 'B')
+        {
+            __int32 n = 0;
+            memcpy(&n, value + 1, 4);
+            value += 5 + n * tagValueSize(value[0]);
+        }
+        else
+            value += tagValueSize(tag[2]);
+        out += text;
+        tag = value;
+    }
+    return out;
+}
+
+std::string formatRecord(DiffFile & file, BamRawRecord const & record)
+{
+    char const * bases = "=ACMGRSVTWYHKDBN";
+    char const * ops = "MIDNSHP=X";
+    std::string cigar, seq, qual;
+    for (unsigned i = 0; i < record._n_cigar; ++i)
+        cigar += std::to_string(cigarOpLength(cigarAt(record, i))) + ops[cigarOp(cigarAt(record, i))];
+    for (unsigned i = 0; i < readLength(record); ++i)
+        seq += bases[baseAt(record, i)];
+    char const * q = seqan::begin(record.data, seqan::Standard()) + _qualOffset(record);
+    for (unsigned i = 0; i < readLength(record); ++i)
+        qual += (unsigned char)q[i] == 0xff ? '*' : (char)(q[i] + 33);
+    if (readLength(record) > 0 && (unsigned char)q[0] == 0xff)
+        qual = "*";
+    std::string rNext = record.rNextId == record.rID && record.rID >= 0 ? "=" : contigName(file, record.rNextId);
+    return std::string(seqan::toCString(record.qName)) + "\t" + std::to_string(record.flag) + "\t" + contigName(file, record.rID) +
+           "\t" + std::to_string(record.beginPos + 1) + "\t" + std::to_string(record.mapQ) + "\t" + (cigar.empty() ? "*" : cigar) +
+           "\t" + rNext + "\t" + std::to_string(record.pNext + 1) + "\t" + std::to_string(record.tLen) + "\t" +
+           (seq.empty() ? "*" : seq) + "\t" + (qual.empty() ? "*" : qual) + formatTags(record);
+}
+
+bool sameBytes(BamRawRecord const & a, BamRawRecord const & b, unsigned beginA, unsigned beginB, unsigned len)
+{
+    return len == 0 || memcmp(seqan::begin(a.data, seqan::Standard()) + beginA, seqan::begin(b.data, seqan::Standard()) + beginB, len) == 0;
+}
+
+//Names of the fields in which the records differ, empty if they are the same.
+std::string differingFields(BamRawRecord const & a, BamRawRecord const & b)
+{
+    std::string fields;
+    auto differs = [&fields](bool same, char const * name)
+    {
+        if (!same)
+            fields += fields.empty() ? name : std::string(",") + name;
+    };
+    differs(a.qName == b.qName, "name");
+    differs(a.flag == b.flag, "flag");
+    differs(a.rID == b.rID && a.beginPos == b.beginPos, "pos");
+    differs(a.mapQ == b.mapQ, "mapq");
+    differs(a._n_cigar == b._n_cigar && sameBytes(a, b, 0, 0, 4 * a._n_cigar), "cigar");
+    differs(a.rNextId == b.rNextId && a.pNext == b.pNext, "pnext");
+    differs(a.tLen == b.tLen, "tlen");
+    bool sameLength = a._l_qseq == b._l_qseq;
+    differs(sameLength && sameBytes(a, b, _seqOffset(a), _seqOffset(b), (a._l_qseq + 1) / 2), "seq");
+    differs(sameLength && sameBytes(a, b, _qualOffset(a), _qualOffset(b), a._l_qseq), "qual");
+    unsigned tagsA = seqan::length(a.data) - _tagsOffset(a), tagsB = seqan::length(b.data) - _tagsOffset(b);
+    differs(tagsA == tagsB && sameBytes(a, b, _tagsOffset(a), _tagsOffset(b), tagsA), "tags");
+    return fields;
+}
+
+int main(int argc, char const ** argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "USAGE: %s EXPECTED.bam ACTUAL.bam\n", argv[0]);
+        return 2;
+    }
+    DiffFile expected, actual;
+    if (!openDiffFile(expected, argv[1]) || !openDiffFile(actual, argv[2]))
+        return 2;
+    if (seqan::contigNames(context(expected.reader)) != seqan::contigNames(context(actual.reader)) ||
+        seqan::contigLengths(context(expected.reader)) != seqan::contigLengths(context(actual.reader)))
+    {
+        printf("The references in the headers of %s and %s differ\n", expected.path, actual.path);
+        return 1;
+    }
+
+    BamRawRecord a, b;
+    size_t n = 0;
+    for (;; ++n)
+    {
+        bool hasA = !atEnd(expected.reader), hasB = !atEnd(actual.reader);
+        if (!hasA || !hasB)
+        {
+            if (hasA == hasB)
+                break;
+            DiffFile & longer = hasA ? expected : actual;
+            readRecord(a, longer.reader);
+            printf("%s ends after %zu records, %s goes on with\n%s\n", (hasA ? actual : expected).path, n, longer.path, formatRecord(longer, a).c_str());
+            return 1;
+        }
+        readRecord(a, expected.reader);
+        readRecord(b, actual.reader);
+        std::string fields = differingFields(a, b);
+        if (!fields.empty())
+        {
+            printf("Record %zu differs in %s\n< %s\n> %s\n", n, fields.c_str(), formatRecord(expected, a).c_str(), formatRecord(actual, b).c_str());
+            return 1;
+        }
+    }
+    printf("%zu records are the same\n", n);
+    return 0;
+}
@@ -0,0 +1,139 @@
+//Checks how reads with unusual CIGARs are trimmed. Each case builds a read, runs the filter of bamShrink on it and
+//compares the CIGAR, the start and the counts with what the BAM operation classes give. It prints one line per case,
+//ok or FAILED with what was expected, and the exit status is 1 if a case failed.
+//
+//  bench/cigar_test
+
+#define BAMSHRINK_NO_MAIN
+#include "bamShrink.cpp"
+
+unsigned nFailed = 0;
+
+//Packs a CIGAR such as "10M3D90M".
+std::vector<__uint32> parseCigar(char const * cigar)
+{
+    std::vector<__uint32> ops;
+    unsigned len = 0;
+    for (char const * c = cigar; *c != 0; ++c)
+    {
+        if (isdigit(*c))
+        {
+            len = 10 * len + (*c - '0');
+            continue;
+        }
+        ops.push_back(packCigarOp(strchr("MIDNSHP=X", *c) - "MIDNSHP=X", len));
+        len = 0;
+    }
+    return ops;
+}
+
+std::string formatCigar(BamRawRecord const & record)
+{
+    std::string cigar;
+    for (unsigned i = 0; i < record._n_cigar; ++i)
+        cigar += std::to_string(cigarOpLength(cigarAt(record, i))) + "MIDNSHP=X"[cigarOp(cigarAt(record, i))];
+    return cigar;
+}
+
+//A read on the first reference with the CIGAR and sequence given and all qualities 30.
+BamRawRecord makeRead(__int32 beginPos, unsigned flag, char const * cigar, std::string const & seq)
+{
+    BamRawRecord record;
+    record.qName = "read";
+    record.rID = record.rNextId = 0;
+    record.beginPos = beginPos;
+    record.flag = flag;
+    record.mapQ = 60;
+    std::vector<__uint32> ops = parseCigar(cigar);
+    record._n_cigar = ops.size();
+    record._l_qseq = seq.size();
+    resize(record.data, _tagsOffset(record), 0);
+    memcpy(begin(record.data, Standard()), &ops[0], 4 * ops.size());
+    for (unsigned i = 0; i < seq.size(); ++i)
+    {
+        unsigned code = strchr("=ACMGRSVTWYHKDBN", seq[i]) - "=ACMGRSVTWYHKDBN";
+        record.data[_seqOffset(record) + i / 2] |= (i & 1) ? code : code << 4;
+    }
+    memset(qualBegin(record), 30, seq.size());
+    return record;
+}
+
+void check(char const * name, bool ok, std::string const & expected)
+{
+    if (ok)
+        printf("ok %s\n", name);
+    else
+        printf("FAILED %s: expected %s\n", name, expected.c_str());
+    nFailed += !ok;
+}
+
+//N trimming moves the start by the reference bases clipped, = and X as well as M, and drops an N operation left at
+//the new start together with it.
+void testNTrimShift()
+{
+    Pair<MateEditInfo> mateEdit;
+    BamRawRecord record = makeRead(1000, 99, "5=95X", std::string(3, 'N') + std::string(97, 'A'));
+    removeNsAtEnds(record, mateEdit, 30);
+    check("n_trim_moves_start_on_eq_and_x", record.beginPos == 1003 && formatCigar(record) == "2=95X" && mateEdit.i1.beginPosShift == 3,
+          "start 1003 and 2=95X, got " + std::to_string(record.beginPos) + " and " + formatCigar(record));
+
+    record = makeRead(1000, 99, "2M50N98M", std::string(3, 'N') + std::string(97, 'A'));
+    removeNsAtEnds(record, mateEdit, 30);
+    check("n_trim_moves_start_past_skipped_region", record.beginPos == 1053 && formatCigar(record) == "97M" && cigarAndSeqMatch(record),
+          "start 1053 and 97M, got " + std::to_string(record.beginPos) + " and " + formatCigar(record));
+}
+
+//Padding is neither in the read nor in the reference.
+void testPaddingNotCounted()
+{
+    BamRawRecord record = makeRead(1000, 99, "50M2P50M", std::string(100, 'A'));
+    check("padding_not_in_reference_length", getAlignmentLengthInRef(record) == 100 && cigarAndSeqMatch(record),
+          "100 reference bases, got " + std::to_string(getAlignmentLengthInRef(record)));
+
+    //The adapter clip of the reverse read does not count the padding as read or reference bases.
+    Pair<MateEditInfo> mateEdit;
+    BamRawRecord forward = makeRead(1010, 99, "100M", std::string(100, 'A'));
+    BamRawRecord reverse = makeRead(1000, 147, "5M2P95M", std::string(100, 'C'));
+    forward.tLen = 90;
+    reverse.tLen = -90;
+    removeAdapters(forward, reverse, mateEdit, 30);
+    check("padding_not_clipped_as_adapter", reverse.beginPos == 1010 && formatCigar(reverse) == "90M" && readLength(reverse) == 90,
+          "start 1010, 90M and 90 bases, got " + std::to_string(reverse.beginPos) + ", " + formatCigar(reverse) + " and " + std::to_string(readLength(reverse)));
+}
+
+//A reverse read clipped for adapters right before a deletion starts after it, at its first aligned base.
+void testClipAtDeletion()
+{
+    Pair<MateEditInfo> mateEdit;
+    BamRawRecord forward = makeRead(1010, 99, "100M", std::string(100, 'A'));
+    BamRawRecord reverse = makeRead(1000, 147, "10M3D90M", std::string(100, 'C'));
+    forward.tLen = 90;
+    reverse.tLen = -90;
+    removeAdapters(forward, reverse, mateEdit, 30);
+    check("adapter_clip_at_deletion_starts_after_it", reverse.beginPos == 1013 && formatCigar(reverse) == "90M" && forward.pNext == 1013,
+          "start 1013 and 90M, got " + std::to_string(reverse.beginPos) + " and " + formatCigar(reverse));
+}
+
+//= and X are aligned bases, N is not in the read.
+void testMatchingBases()
+{
+    BamRawRecord record = makeRead(1000, 99, "50=1X49=", std::string(100, 'A'));
+    check("eq_and_x_are_matching_bases", countMatchingBases(record) == 100, "100, got " + std::to_string(countMatchingBases(record)));
+    record = makeRead(1000, 99, "50M100N50M", std::string(100, 'A'));
+    check("skipped_region_not_in_read", cigarAndSeqMatch(record) && countMatchingBases(record) == 100,
+          "CIGAR matching 100 bases");
+}
+
+int main()
+{
+    //The filters print what they find odd; only the records are checked here. SeqAn strings are written to the stream
+    //buffer directly, so it is replaced rather than failed.
+    std::ostringstream filterMessages;
+    std::streambuf * stdoutBuffer = cout.rdbuf(filterMessages.rdbuf());
+    testNTrimShift();
+    testPaddingNotCounted();
+    testClipAtDeletion();
+    testMatchingBases();
+    cout.rdbuf(stdoutBuffer);
+    return nFailed == 0 ? 0 : 1;
+}
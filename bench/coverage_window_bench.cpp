@@ -0,0 +1,123 @@
+//Micro-benchmark of the coverage filter on deep amplicon data: compares CoverageWindow with the deque based filter it
+//replaced, checks that both make the same decision for every read and prints the time per read.
+//
+//  bench/coverage_window_bench [amplicons] [readsPerAmplicon] [seed]
+
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <algorithm>
+#include <deque>
+#include <numeric>
+#include <random>
+#include <vector>
+#include "coverage_window.h"
+
+//The filter as it was in qualityFilterSlice, keepRead stands in for the outcome of qualityFilter().
+struct DequeWindow {
+    std::deque<unsigned> myQue;
+    unsigned currBeginPos = 0;
+    double maxQueSum = 0.0;
+} ;
+
+bool dequeFilter(DequeWindow & w, unsigned beginPos, bool keepRead)
+{
+    if (beginPos != w.currBeginPos)
+    {
+        if (beginPos-w.currBeginPos > 1)
+        {
+            for (unsigned i=1; i<beginPos-w.currBeginPos; ++i)
+            {
+                w.myQue.push_front(0);
+                while (w.myQue.size()>50)
+                    w.myQue.pop_back();
+            }
+        }
+        w.myQue.push_front(1);
+        while (w.myQue.size()>50)
+            w.myQue.pop_back();
+        w.currBeginPos = beginPos;
+    }
+    else
+        ++w.myQue.front();
+    if (std::accumulate(w.myQue.begin(),w.myQue.end(),0) > w.maxQueSum)
+    {
+        --w.myQue.front();
+        return false;
+    }
+    if (!keepRead)
+    {
+        --w.myQue.front();
+        return false;
+    }
+    return true;
+}
+
+bool windowFilter(CoverageWindow & w, unsigned beginPos, bool keepRead)
+{
+    if (!addRead(w, beginPos))
+        return false;
+    if (!keepRead)
+    {
+        removeRead(w);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char const ** argv)
+{
+    unsigned nAmplicons = argc > 1 ? atoi(argv[1]) : 500;
+    unsigned readsPerAmplicon = argc > 2 ? atoi(argv[2]) : 20000;
+    unsigned seed = argc > 3 ? atoi(argv[3]) : 1;
+    //Amplicon reads pile up on a few start positions; the amplicons are spaced so some gaps are shorter than the window.
+    std::mt19937 rng(seed);
+    std::vector<unsigned> positions;
+    std::vector<char> keep;
+    unsigned ampliconStart = 1000;
+    for (unsigned a = 0; a < nAmplicons; ++a)
+    {
+        ampliconStart += 20 + rng() % 400;
+        for (unsigned i = 0; i < readsPerAmplicon; ++i)
+            positions.push_back(ampliconStart + (rng() % 100 < 90 ? rng() % 3 : rng() % 120));
+    }
+    //Reads come sorted by position as in a BAM file.
+    std::sort(positions.begin(), positions.end());
+    for (size_t i = 0; i < positions.size(); ++i)
+        keep.push_back(rng() % 10 != 0);
+    //Average coverage by read length as the avgCovByReadLen.sh script would give for a 2x150bp exome run.
+    double avgCovByReadLen = 0.8;
+    double maxSum = avgCovByReadLen*(double)50.0*(double)3.0;
+
+    DequeWindow dequeWindow;
+    dequeWindow.maxQueSum = maxSum;
+    std::vector<char> dequeDecisions(positions.size());
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < positions.size(); ++i)
+        dequeDecisions[i] = dequeFilter(dequeWindow, positions[i], keep[i]);
+    auto t1 = std::chrono::steady_clock::now();
+
+    CoverageWindow window(50, maxSum);
+    std::vector<char> windowDecisions(positions.size());
+    auto t2 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < positions.size(); ++i)
+        windowDecisions[i] = windowFilter(window, positions[i], keep[i]);
+    auto t3 = std::chrono::steady_clock::now();
+
+    size_t nKept = 0;
+    for (size_t i = 0; i < positions.size(); ++i)
+    {
+        if (dequeDecisions[i] != windowDecisions[i])
+        {
+            fprintf(stderr, "ERROR: Decisions differ at read %zu (position %u).\n", i, positions[i]);
+            return 1;
+        }
+        nKept += windowDecisions[i];
+    }
+    double dequeNs = std::chrono::duration<double, std::nano>(t1 - t0).count() / positions.size();
+    double windowNs = std::chrono::duration<double, std::nano>(t3 - t2).count() / positions.size();
+    printf("reads: %zu kept: %zu\n", positions.size(), nKept);
+    printf("deque filter:    %8.2f ns/read\n", dequeNs);
+    printf("coverage window: %8.2f ns/read (%.1fx)\n", windowNs, dequeNs / windowNs);
+    return 0;
+}
@@ -0,0 +1,146 @@
+#!/usr/bin/bash
+set -e
+set -o pipefail
+
+# The differential test of `make diff-test`: runs a reference bamShrink and the current one in its threaded and
+# otherwise optimized configurations on the BAMs of profiles.sh and compares the outputs record by record with
+# bam_diff, which prints the first record that differs. Each case gives the options of both runs and how the input is
+# read: the whole genome, the intervals of the profile, a pipe from standard input to standard output, three shards
+# of the whole genome that are merged afterwards, or the intervals in a batch of two samples.
+#
+# Every case is compared with the current bamShrink on one thread without decompression, compression or prefetch
+# threads. The interval cases that need no options in the reference run are also compared with bamShrink built from
+# REFERENCE_REV, by default the revision before the threads and the other optimizations, or with
+# REFERENCE=path/to/bamShrink. That bamShrink may know none of the options, so both runs get the same coverage instead of
+# auto. REFERENCE_REV= (empty) leaves this comparison out. The outputs of the references are kept in data/diff as the
+# golden outputs of the last run.
+
+bench=$(dirname "$0")
+root=${bench}/..
+data=${BENCH_DATA:-${bench}/data}
+out=${data}/diff
+bamShrink=${root}/bamShrink
+reference=${REFERENCE:-}
+referenceRev=${REFERENCE_REV-e9b7cc3}
+plain="--decompression-threads 0 --compression-threads 0 --prefetch 0"
+# The coverage given to the reference revision and the runs compared with it.
+referenceCoverage=0.3
+
+source "${bench}/profiles.sh"
+
+if [[ -z $reference && -n $referenceRev ]]; then
+  reference=${data}/bamShrink-$(git -C "$root" rev-parse --short "$referenceRev")
+  if [[ ! -x $reference ]]; then
+    tree=$(mktemp -d)
+    git -C "$root" worktree add -q --detach "$tree" "$referenceRev"
+    ln -s "$(realpath "${root}/include")" "${tree}/include"
+    # Older Makefiles link zlib only through LDLIBS given here.
+    if ! make -s -C "$tree" LDLIBS=-lz bamShrink 2> /dev/null; then
+      git -C "$root" worktree remove --force "$tree"
+      echo "Could not build bamShrink at ${referenceRev}"
+      exit 1
+    fi
+    mkdir -p "$data"
+    cp "${tree}/bamShrink" "$reference"
+    git -C "$root" worktree remove --force "$tree"
+  fi
+fi
+
+# Name, input (wgs, intervals or stream), options of the reference run and options of the run compared with it.
+cases=(
+  "threads|wgs||--threads 4"
+  "threads|intervals||--threads 4"
+  "decompression|wgs||--decompression-threads 3"
+  "decompression|intervals||--decompression-threads 3 --prefetch 8"
+  "compression|wgs||--compression-threads 3 --uncompressed"
+  "prefetch_thread|intervals||--prefetch-thread --prefetch 16"
+  "local_names|wgs|--read-names local|--threads 4 --read-names local"
+  "local_names|intervals|--read-names local|--threads 4 --read-names local"
+  "local_coverage|intervals|--local-coverage|--threads 4 --local-coverage"
+  "write_index|wgs||--write-index bai"
+  "stream|stream||"
+  "shards|shards|--read-names local|--threads 2 --read-names local"
+  "batch|batch||--threads 4"
+)
+# The cases also compared with the reference revision: the interval runs of the current bamShrink, on one thread and in
+# the configurations above that need no options in the reference run.
+referenceCases=(
+  "default|intervals||"
+  "threads|intervals||--threads 4"
+  "decompression|intervals||--decompression-threads 3 --prefetch 8"
+  "prefetch_thread|intervals||--prefetch-thread --prefetch 16"
+  "batch|batch||--threads 4"
+)
+
+# Runs bamShrink ($1) with options ($2) on input ($3) of the profile, writing output ($4), with the coverage in
+# $coverage. stream_file reads the file with the coverage the stream gets.
+shrink() {
+  local binary=$1 options=$2 input=$3 output=$4 bam=${data}/${name}.bam
+  case $input in
+    wgs) "$binary" $options "$bam" "$output" 500 Y 30 "$coverage" ;;
+    intervals) "$binary" $options "$bam" "$output" 500 Y 30 "$coverage" "${bam}.bai" "${data}/${name}.intervals" ;;
+    stream) "$binary" $options - - 500 Y 30 0.3 < "$bam" > "$output" ;;
+    stream_file) "$binary" $options "$bam" "$output" 500 Y 30 0.3 ;;
+    shards)
+      for i in 1 2 3; do
+        "$binary" $options --shard $i/3 "$bam" "${output%.bam}.shard${i}.bam" 500 Y 30 "$coverage"
+      done
+      "$binary" merge "$output" "${output%.bam}".shard{1,2,3}.bam
+      rm -f "${output%.bam}".shard{1,2,3}.bam ;;
+    batch)
+      # The profile twice, so the output compared shares the workers with another sample.
+      printf "%s %s $coverage\n" "$bam" "${output%.bam}.batch1.bam" "$bam" "$output" > "${output%.bam}.manifest"
+      "$binary" batch $options "${output%.bam}.manifest" 500 Y 30 "${data}/${name}.intervals"
+      rm -f "${output%.bam}.batch1.bam" "${output%.bam}.manifest" ;;
+  esac
+}
+
+# Runs the case ($4) of the profile and compares its output with the run of the reference ($1) with options ($2), whose
+# outputs are named after the prefix ($3).
+compare() {
+  local referenceBinary=$1 referencePlain=$2 prefix=$3
+  IFS='|' read -r label input referenceOptions options <<< "$4"
+  local expected=${out}/${name}.${prefix}${label}.${input}.expected.bam
+  local actual=${out}/${name}.${prefix}${label}.${input}.actual.bam
+  # The reference reads the stream case from the file, with the coverage given to the pipe, the shards in one run and
+  # the batch as a run on its own.
+  local referenceInput=${input/#stream/stream_file}
+  referenceInput=${referenceInput/#shards/wgs}
+  referenceInput=${referenceInput/#batch/intervals}
+  shrink "$referenceBinary" "$referencePlain $referenceOptions" "$referenceInput" "$expected" > "${expected%.bam}.log" 2>&1
+  shrink "$bamShrink" "$options" "$input" "$actual" > "${actual%.bam}.log" 2>&1
+  printf "%-48s " "${name} ${prefix}${label} ${input}"
+  if "${bench}/bam_diff" "$expected" "$actual" > "${actual%.bam}.diff"; then
+    cat "${actual%.bam}.diff"
+    rm -f "$actual" "${actual}.bai"
+  else
+    echo "DIFFERS"
+    sed 's/^/    /' "${actual%.bam}.diff"
+    failed=$((failed + 1))
+  fi
+}
+
+mkdir -p "$out"
+failed=0
+for profile in "${profiles[@]}"; do
+  set -- $profile
+  name=$1
+  shift
+  make_profile_bam "$name" "$@"
+  coverage=auto
+  for test in "${cases[@]}"; do
+    compare "$bamShrink" "$plain" "" "$test"
+  done
+  if [[ -n $reference ]]; then
+    coverage=$referenceCoverage
+    for test in "${referenceCases[@]}"; do
+      compare "$reference" "" "reference_" "$test"
+    done
+  fi
+done
+
+if [[ $failed -gt 0 ]]; then
+  echo "${failed} outputs differ from the reference"
+  exit 1
+fi
+echo "All outputs are the same as the reference"
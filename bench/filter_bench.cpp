@@ -0,0 +1,283 @@
+//Times the filters of bamShrink one at a time on the reads of a BAM file, such as one written by make_test_bam, and
+//prints the reads and MB of records per second of each. The reads are loaded into memory first and every run works on
+//fresh copies of them, so only the filter itself is timed. The best of --repeat runs is printed, one line per filter:
+//
+//  <name> <reads/s> <MB/s>
+//
+//  bench/filter_bench [--repeat N] [--max-fragment-length N] [--min-matches N] IN.bam
+//
+//It is built with the allocation counter of bamShrink and prints, as a # comment, the allocations per read made by
+//quality_filter and window_flush over the reads in file order, including the growth of their tables.
+
+#define BAMSHRINK_NO_MAIN
+#include "bamShrink.cpp"
+
+struct FilterBench {
+    std::vector<BamRawRecord> reads;
+    std::vector<unsigned> contigEnds;
+    //Adapter pairs as indices of the forward and the reverse read.
+    std::vector<Pair<unsigned> > adapterPairs;
+    unsigned repeat = 3;
+    int maxFragLen = 500;
+    unsigned minMatchingBases = 30;
+    __uint64 genomeLength = 0;
+} ;
+
+size_t recordBytes(BamRawRecord const & record)
+{
+    return 4 + BAM_CORE_BYTES + length(record.qName) + 1 + length(record.data);
+}
+
+void printRate(char const * name, size_t nReads, size_t nBytes, __uint64 nanos)
+{
+    double seconds = std::max(nanos, (__uint64)1) * 1e-9;
+    printf("%s %.0f %.2f\n", name, nReads / seconds, nBytes / seconds / 1e6);
+    fflush(stdout);
+}
+
+//Runs timed(work) on fresh copies of the reads and prints the best time. timed returns the time it took in ns.
+template <typename TTimed>
+void benchCopies(FilterBench const & bench, char const * name, size_t nReads, size_t nBytes, TTimed timed)
+{
+    __uint64 best = ~(__uint64)0;
+    for (unsigned r = 0; r < bench.repeat; ++r)
+    {
+        std::vector<BamRawRecord> work(bench.reads);
+        best = std::min(best, timed(work));
+    }
+    printRate(name, nReads, nBytes, best);
+}
+
+bool loadReads(FilterBench & bench, char const * path)
+{
+    BamReader bamFileIn;
+    if (!open(bamFileIn, path, 0))
+        return false;
+    BamHeader header;
+    readHeader(header, bamFileIn);
+    for (unsigned i = 0; i < length(contigLengths(context(bamFileIn))); ++i)
+        bench.genomeLength += contigLengths(context(bamFileIn))[i];
+    BamRawRecord record;
+    std::map<std::string, unsigned> adapterMates;
+    while (readNextRecord(record, bamFileIn))
+    {
+        if (!bench.reads.empty() && record.rID != bench.reads.back().rID)
+            bench.contigEnds.push_back(bench.reads.size());
+        if (abs(record.tLen) < (int)readLength(record) && record.rID == record.rNextId && !hasFlagUnmapped(record))
+        {
+            std::string name(toCString(record.qName));
+            std::map<std::string, unsigned>::iterator it = adapterMates.find(name);
+            if (it == adapterMates.end())
+                adapterMates[name] = bench.reads.size();
+            else
+            {
+                unsigned forward = hasFlagRC(record) ? it->second : bench.reads.size();
+                unsigned reverse = hasFlagRC(record) ? bench.reads.size() : it->second;
+                bench.adapterPairs.push_back(Pair<unsigned>(forward, reverse));
+                adapterMates.erase(it);
+            }
+        }
+        bench.reads.push_back(record);
+    }
+    bench.contigEnds.push_back(bench.reads.size());
+    return true;
+}
+
+//The hard clip and N filters work on each read on its own.
+void benchReadFilters(FilterBench const & bench, size_t nBytes)
+{
+    benchCopies(bench, "remove_hard_clipped", bench.reads.size(), nBytes, [&](std::vector<BamRawRecord>& work)
+    {
+        __uint64 begin = wallClockNanos();
+        for (unsigned i = 0; i < work.size(); ++i)
+            removeHardClipped(work[i]);
+        return wallClockNanos() - begin;
+    });
+    benchCopies(bench, "remove_ns_at_ends", bench.reads.size(), nBytes, [&](std::vector<BamRawRecord>& work)
+    {
+        Pair<MateEditInfo> mateEdit;
+        unsigned kept = 0;
+        __uint64 begin = wallClockNanos();
+        for (unsigned i = 0; i < work.size(); ++i)
+            kept += removeNsAtEnds(work[i], mateEdit, bench.minMatchingBases);
+        __uint64 nanos = wallClockNanos() - begin;
+        if (kept == 0)
+            printf("# remove_ns_at_ends kept no read\n");
+        return nanos;
+    });
+}
+
+//The CIGAR clips of adapter removal and quality clipping on every read: clipCigarToRefPos() to the middle of the
+//alignment on the reference, and clipCigarFront() of half of the read bases. Only the CIGAR is clipped.
+void benchCigarClips(FilterBench const & bench, size_t nBytes)
+{
+    benchCopies(bench, "clip_cigar_to_ref_pos", bench.reads.size(), nBytes, [&](std::vector<BamRawRecord>& work)
+    {
+        unsigned clipped = 0;
+        __uint64 begin = wallClockNanos();
+        for (unsigned i = 0; i < work.size(); ++i)
+            clipped += clipCigarToRefPos(work[i], work[i].beginPos + getAlignmentLengthInRef(work[i]) / 2).query;
+        __uint64 nanos = wallClockNanos() - begin;
+        if (clipped == 0)
+            printf("# clip_cigar_to_ref_pos clipped no base\n");
+        return nanos;
+    });
+    benchCopies(bench, "clip_cigar_front", bench.reads.size(), nBytes, [&](std::vector<BamRawRecord>& work)
+    {
+        unsigned clipped = 0;
+        __uint64 begin = wallClockNanos();
+        for (unsigned i = 0; i < work.size(); ++i)
+            clipped += clipCigarFront(work[i], readLength(work[i]) / 2).query;
+        __uint64 nanos = wallClockNanos() - begin;
+        if (clipped == 0)
+            printf("# clip_cigar_front clipped no base\n");
+        return nanos;
+    });
+}
+
+void benchAdapters(FilterBench const & bench)
+{
+    size_t nBytes = 0;
+    for (unsigned i = 0; i < bench.adapterPairs.size(); ++i)
+        nBytes += recordBytes(bench.reads[bench.adapterPairs[i].i1]) + recordBytes(bench.reads[bench.adapterPairs[i].i2]);
+    if (bench.adapterPairs.empty())
+        return;
+    benchCopies(bench, "adapter_removal", 2 * bench.adapterPairs.size(), nBytes, [&](std::vector<BamRawRecord>& work)
+    {
+        Pair<MateEditInfo> mateEdit;
+        __uint64 begin = wallClockNanos();
+        for (unsigned i = 0; i < bench.adapterPairs.size(); ++i)
+            removeAdapters(work[bench.adapterPairs[i].i1], work[bench.adapterPairs[i].i2], mateEdit, bench.minMatchingBases);
+        return wallClockNanos() - begin;
+    });
+}
+
+//The coverage window with the defaults of bamShrink and the average coverage of the file.
+void benchCoverage(FilterBench const & bench, size_t nBytes)
+{
+    ShrinkOptions options;
+    options.avgCovByReadLen = (double)bench.reads.size() / std::max(bench.genomeLength, (__uint64)1);
+    CoverageWindow coverage = coverageWindow(options);
+    __uint64 best = ~(__uint64)0;
+    for (unsigned r = 0; r < bench.repeat; ++r)
+    {
+        unsigned kept = 0;
+        __uint64 begin = wallClockNanos();
+        for (unsigned c = 0, i = 0; c < bench.contigEnds.size(); ++c)
+        {
+            clear(coverage);
+            for (; i < bench.contigEnds[c]; ++i)
+                kept += addRead(coverage, bench.reads[i].beginPos);
+        }
+        best = std::min(best, wallClockNanos() - begin);
+        if (kept == 0)
+            printf("# coverage_filter kept no read\n");
+    }
+    printRate("coverage_filter", bench.reads.size(), nBytes, best);
+}
+
+//qualityFilter() and printReadyReads() depend on the reads before, so they are run over the reads in file order as in
+//qualityFilterContig() and every call is timed on its own. The reads are written into a buffer that is emptied
+//between calls.
+void benchStream(FilterBench const & bench, size_t nBytes)
+{
+    __uint64 bestFilter = ~(__uint64)0, bestFlush = ~(__uint64)0;
+    size_t nFlushed = 0, flushedBytes = 0, allocations = 0;
+    for (unsigned r = 0; r < bench.repeat; ++r)
+    {
+        std::vector<BamRawRecord> work(bench.reads);
+        TMateEditTable mateEditMap;
+        ReadWindow readWindow(bench.maxFragLen);
+        TAdapterTable adapterMap;
+        RecordBuffer buffer;
+        ReadNamer namer;
+        __uint64 filterNanos = 0, flushNanos = 0;
+        nFlushed = flushedBytes = 0;
+        size_t allocationsBefore = allocationCount;
+        auto flush = [&](unsigned readyPos)
+        {
+            __uint64 start = wallClockNanos();
+            printReadyReads(mateEditMap, readWindow, readyPos, buffer, namer, true, Pair<unsigned>(0,260000000));
+            flushNanos += wallClockNanos() - start;
+            for (size_t pos = 0; pos < length(buffer.data); ++nFlushed)
+            {
+                __int32 blockSize = 0;
+                memcpy(&blockSize, begin(buffer.data, Standard()) + pos, 4);
+                pos += 4 + blockSize;
+            }
+            flushedBytes += length(buffer.data);
+            clear(buffer.data);
+        };
+        for (unsigned c = 0, i = 0; c < bench.contigEnds.size(); ++c)
+        {
+            for (; i < bench.contigEnds[c]; ++i)
+            {
+                BamRawRecord & record = work[i];
+                __uint64 start = wallClockNanos();
+                bool keep = qualityFilter(record, mateEditMap, bench.maxFragLen, adapterMap, bench.minMatchingBases, true, readWindow);
+                filterNanos += wallClockNanos() - start;
+                if (!keep)
+                    continue;
+                moveRead(readWindow, record);
+                if (record.beginPos - bench.maxFragLen >= 0)
+                {
+                    flush(record.beginPos - bench.maxFragLen);
+                    evictExpired(mateEditMap, record.beginPos);
+                    evictExpired(adapterMap, record.beginPos);
+                }
+            }
+            if (!empty(readWindow))
+                flush(lastPos(readWindow));
+            clear(readWindow);
+            clear(mateEditMap);
+            clear(adapterMap);
+        }
+        bestFilter = std::min(bestFilter, filterNanos);
+        bestFlush = std::min(bestFlush, flushNanos);
+        allocations = allocationCount - allocationsBefore;
+    }
+    printRate("quality_filter", bench.reads.size(), nBytes, bestFilter);
+    printRate("window_flush", nFlushed, flushedBytes, bestFlush);
+    printf("# quality_filter and window_flush allocations per read: %.3f\n", (double)allocations / std::max(bench.reads.size(), (size_t)1));
+}
+
+int main(int argc, char const ** argv)
+{
+    FilterBench bench;
+    char const * path = NULL;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--repeat" && i + 1 < argc)
+            bench.repeat = std::max(1, atoi(argv[++i]));
+        else if (arg == "--max-fragment-length" && i + 1 < argc)
+            bench.maxFragLen = atoi(argv[++i]);
+        else if (arg == "--min-matches" && i + 1 < argc)
+            bench.minMatchingBases = atoi(argv[++i]);
+        else if (path == NULL && arg.compare(0, 2, "--") != 0)
+            path = argv[i];
+        else
+            path = NULL, i = argc;
+    }
+    if (path == NULL)
+    {
+        fprintf(stderr, "USAGE: %s [--repeat N] [--max-fragment-length N] [--min-matches N] IN.bam\n", argv[0]);
+        return 1;
+    }
+    if (!loadReads(bench, path))
+    {
+        fprintf(stderr, "ERROR: Could not open %s\n", path);
+        return 1;
+    }
+    size_t nBytes = 0;
+    for (unsigned i = 0; i < bench.reads.size(); ++i)
+        nBytes += recordBytes(bench.reads[i]);
+    //The filters print what they find odd; that is not what is timed here.
+    cout.setstate(std::ios::failbit);
+    benchReadFilters(bench, nBytes);
+    benchCigarClips(bench, nBytes);
+    benchAdapters(bench);
+    benchCoverage(bench, nBytes);
+    benchStream(bench, nBytes);
+    return 0;
+}
@@ -0,0 +1,355 @@
+//Writes a synthetic coordinate sorted paired-end BAM with its BAI for the benchmarks. The same options and seed give
+//the same file byte for byte. Reads are copies of a random genome; the share of fragments shorter than a read (adapter
+//read-through), of reads ending in a run of Ns, of soft and hard clipped reads and of duplicates can be set, as can the
+//number of tags on every read. With --intervals an interval file for the interval mode of bamShrink is written too.
+//
+//  bench/make_test_bam [--contigs N] [--contig-length N] [--depth X] [--read-length N] [--fragment-mean N]
+//                      [--fragment-sd N] [--adapter-rate P] [--n-rate P] [--soft-clip-rate P] [--hard-clip-rate P]
+//                      [--duplicate-rate P] [--tags N] [--seed N] [--intervals FILE] OUT.bam
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+#include <seqan/bam_io.h>
+#include "bgzf_writer.h"
+#include "bam_raw_record.h"
+#include "bam_index_writer.h"
+
+struct GeneratorOptions {
+    unsigned contigs = 2;
+    unsigned contigLength = 2000000;
+    double depth = 30.0;
+    unsigned readLength = 100;
+    double fragmentMean = 300.0;
+    double fragmentSd = 60.0;
+    double adapterRate = 0.05;
+    double nRate = 0.02;
+    double softClipRate = 0.05;
+    double hardClipRate = 0.01;
+    double duplicateRate = 0.05;
+    unsigned tags = 4;
+    unsigned seed = 1;
+    const char * intervalPath = NULL;
+    const char * bamPath = NULL;
+} ;
+
+//A read pair; both reads are made from it when they are written.
+struct Fragment {
+    __int32 begin;
+    __int32 length;
+    bool duplicate;
+} ;
+
+//One read of a fragment, in the order they are written.
+struct ReadSlot {
+    __int32 beginPos;
+    unsigned fragment;
+    bool reverse;
+} ;
+
+bool slotLess(ReadSlot const & left, ReadSlot const & right)
+{
+    if (left.beginPos != right.beginPos)
+        return left.beginPos < right.beginPos;
+    if (left.fragment != right.fragment)
+        return left.fragment < right.fragment;
+    return left.reverse < right.reverse;
+}
+
+bool parseArgs(GeneratorOptions & options, int argc, char const ** argv)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0)
+        {
+            if (options.bamPath != NULL)
+                return false;
+            options.bamPath = argv[i];
+            continue;
+        }
+        if (i + 1 == argc)
+            return false;
+        char const * value = argv[++i];
+        if (arg == "--contigs")
+            options.contigs = atoi(value);
+        else if (arg == "--contig-length")
+            options.contigLength = atoi(value);
+        else if (arg == "--depth")
+            options.depth = atof(value);
+        else if (arg == "--read-length")
+            options.readLength = atoi(value);
+        else if (arg == "--fragment-mean")
+            options.fragmentMean = atof(value);
+        else if (arg == "--fragment-sd")
+            options.fragmentSd = atof(value);
+        else if (arg == "--adapter-rate")
+            options.adapterRate = atof(value);
+        else if (arg == "--n-rate")
+            options.nRate = atof(value);
+        else if (arg == "--soft-clip-rate")
+            options.softClipRate = atof(value);
+        else if (arg == "--hard-clip-rate")
+            options.hardClipRate = atof(value);
+        else if (arg == "--duplicate-rate")
+            options.duplicateRate = atof(value);
+        else if (arg == "--tags")
+            options.tags = atoi(value);
+        else if (arg == "--seed")
+            options.seed = atoi(value);
+        else if (arg == "--intervals")
+            options.intervalPath = value;
+        else
+            return false;
+    }
+    return options.bamPath != NULL && options.contigs > 0 && options.readLength >= 20 &&
+           options.contigLength > 4 * (options.fragmentMean + 4 * options.fragmentSd);
+}
+
+//Fragment lengths follow a normal distribution cut to [read length, 3 * mean]; adapter fragments are shorter than a
+//read but at least half as long.
+std::vector<Fragment> makeFragments(GeneratorOptions const & options, std::mt19937 & rng)
+{
+    unsigned nFragments = options.depth * options.contigLength / (2 * options.readLength);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::normal_distribution<double> fragmentLength(options.fragmentMean, options.fragmentSd);
+    std::vector<Fragment> fragments(nFragments);
+    for (unsigned f = 0; f < nFragments; ++f)
+    {
+        Fragment & fragment = fragments[f];
+        if (unit(rng) < options.adapterRate)
+            fragment.length = options.readLength / 2 + rng() % (options.readLength / 2);
+        else
+            fragment.length = std::max((double)options.readLength, std::min(3 * options.fragmentMean, fragmentLength(rng)));
+        fragment.begin = rng() % (options.contigLength - fragment.length);
+        fragment.duplicate = false;
+    }
+    std::sort(fragments.begin(), fragments.end(), [](Fragment const & left, Fragment const & right) { return left.begin < right.begin; });
+    //A duplicate is a second copy of the fragment before it.
+    for (unsigned f = 1; f < nFragments; ++f)
+        if (unit(rng) < options.duplicateRate)
+        {
+            fragments[f].begin = fragments[f - 1].begin;
+            fragments[f].length = fragments[f - 1].length;
+            fragments[f].duplicate = true;
+        }
+    return fragments;
+}
+
+void appendIntTag(seqan::CharString & tags, char const * key, __int32 value)
+{
+    char bytes[7] = {key[0], key[1], 'i'};
+    memcpy(bytes + 3, &value, 4);
+    seqan::append(tags, seqan::CharString(std::string(bytes, 7)));
+}
+
+void appendStringTag(seqan::CharString & tags, char const * key, std::string const & value)
+{
+    seqan::append(tags, seqan::CharString(std::string(key, 2) + "Z" + value + std::string(1, '\0')));
+}
+
+//Tags as an aligner writes them, the first n of them.
+void makeTags(seqan::CharString & tags, unsigned n, unsigned readLength, std::minstd_rand & rng)
+{
+    char const * barcodes = "ACGT";
+    std::string barcode;
+    for (unsigned i = 0; i < 8; ++i)
+        barcode += barcodes[rng() % 4];
+    seqan::clear(tags);
+    for (unsigned t = 0; t < n; ++t)
+        switch (t % 8)
+        {
+            case 0: appendIntTag(tags, "NM", rng() % 3); break;
+            case 1: appendStringTag(tags, "MD", std::to_string(readLength)); break;
+            case 2: appendIntTag(tags, "AS", readLength - rng() % 10); break;
+            case 3: appendIntTag(tags, "XS", rng() % readLength); break;
+            case 4: appendStringTag(tags, "RG", "bench"); break;
+            case 5: appendStringTag(tags, "BC", barcode); break;
+            case 6: appendIntTag(tags, "MQ", 60); break;
+            case 7: appendStringTag(tags, "MC", std::to_string(readLength) + "M"); break;
+        }
+}
+
+//Mixes the seed with the position of a read in the file (splitmix64).
+unsigned _readSeed(unsigned seed, __int32 rID, unsigned f, bool reverse)
+{
+    __uint64 x = ((__uint64)seed << 40) ^ ((__uint64)rID << 33) ^ ((__uint64)f << 1) ^ reverse;
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return (unsigned)(x % 2147483646u) + 1;
+}
+
+//Makes a read of a fragment with its own generator, so the read does not depend on the order reads are made in.
+void makeRead(seqan::BamAlignmentRecord & record, GeneratorOptions const & options, seqan::Dna5String const & genome,
+              __int32 rID, std::vector<Fragment> const & fragments, unsigned f, bool reverse)
+{
+    Fragment const & fragment = fragments[f];
+    std::minstd_rand rng(_readSeed(options.seed, rID, f, reverse));
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    unsigned len = options.readLength;
+    unsigned aligned = std::min(len, (unsigned)fragment.length);
+    __int32 mateBegin = reverse ? fragment.begin : fragment.begin + fragment.length - aligned;
+
+    seqan::clear(record);
+    record.qName = "bench:" + std::to_string(rID) + ":" + std::to_string(f);
+    record.rID = record.rNextId = rID;
+    record.mapQ = 60;
+    record.flag = seqan::BAM_FLAG_MULTIPLE | seqan::BAM_FLAG_ALL_PROPER;
+    record.flag |= reverse ? seqan::BAM_FLAG_RC | seqan::BAM_FLAG_LAST : seqan::BAM_FLAG_NEXT_RC | seqan::BAM_FLAG_FIRST;
+    if (fragment.duplicate)
+        record.flag |= seqan::BAM_FLAG_DUPLICATE;
+    record.beginPos = reverse ? fragment.begin + fragment.length - aligned : fragment.begin;
+    record.pNext = mateBegin;
+    record.tLen = reverse ? -fragment.length : fragment.length;
+
+    //An adapter read runs past the fragment into adapter, which the aligner soft clips: at the end of the forward and
+    //at the beginning of the reverse read.
+    unsigned clipFront = 0, clipBack = 0, hardClip = 0;
+    if (aligned < len)
+        (reverse ? clipFront : clipBack) = len - aligned;
+    else if (unit(rng) < options.softClipRate)
+        (unit(rng) < 0.5 ? clipFront : clipBack) = 1 + rng() % (len / 5);
+    else if (unit(rng) < options.hardClipRate)
+        hardClip = 1 + rng() % (len / 5);
+
+    unsigned matched = aligned < len ? aligned : len - clipFront - clipBack - hardClip;
+
+    char const * bases = "ACGT";
+    for (unsigned i = 0; i < clipFront; ++i)
+        seqan::appendValue(record.seq, bases[rng() % 4]);
+    seqan::append(record.seq, seqan::infix(genome, record.beginPos, record.beginPos + matched));
+    for (unsigned i = 0; i < clipBack; ++i)
+        seqan::appendValue(record.seq, bases[rng() % 4]);
+    //A few mismatches, and sometimes a run of Ns at one end.
+    for (unsigned i = 0; i < seqan::length(record.seq); ++i)
+        if (rng() % 200 == 0)
+            record.seq[i] = bases[rng() % 4];
+    if (unit(rng) < options.nRate)
+    {
+        unsigned run = 1 + rng() % 5;
+        bool front = unit(rng) < 0.5;
+        for (unsigned i = 0; i < run; ++i)
+            record.seq[front ? i : seqan::length(record.seq) - 1 - i] = 'N';
+    }
+    for (unsigned i = 0; i < seqan::length(record.seq); ++i)
+        seqan::appendValue(record.qual, (char)('!' + (rng() % 10 == 0 ? 2 + rng() % 20 : 30 + rng() % 11)));
+
+    if (clipFront > 0)
+        seqan::appendValue(record.cigar, seqan::CigarElement<>('S', clipFront));
+    seqan::appendValue(record.cigar, seqan::CigarElement<>('M', matched));
+    if (clipBack > 0)
+        seqan::appendValue(record.cigar, seqan::CigarElement<>('S', clipBack));
+    if (hardClip > 0)
+        seqan::appendValue(record.cigar, seqan::CigarElement<>('H', hardClip));
+    makeTags(record.tags, options.tags, len, rng);
+}
+
+bool writeIntervals(char const * path, GeneratorOptions const & options)
+{
+    FILE * file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+    //One 1 kbp interval every 20 kbp, 1-based and inclusive as bamShrink reads them.
+    for (unsigned c = 0; c < options.contigs; ++c)
+        for (unsigned begin = 10000; begin + 1000 < options.contigLength; begin += 20000)
+            fprintf(file, "chr%u\t%u\t%u\n", c + 1, begin + 1, begin + 1000);
+    return fclose(file) == 0;
+}
+
+int main(int argc, char const ** argv)
+{
+    GeneratorOptions options;
+    if (!parseArgs(options, argc, argv))
+    {
+        fprintf(stderr, "USAGE: %s [--contigs N] [--contig-length N] [--depth X] [--read-length N] [--fragment-mean N] [--fragment-sd N] [--adapter-rate P] [--n-rate P] [--soft-clip-rate P] [--hard-clip-rate P] [--duplicate-rate P] [--tags N] [--seed N] [--intervals FILE] OUT.bam\n", argv[0]);
+        return 1;
+    }
+
+    seqan::BamFileIn::TOwnerContext nameStore;
+    seqan::BamFileIn::TDependentContext context(nameStore);
+    seqan::BamHeader header;
+    seqan::BamHeaderRecord hd;
+    hd.type = seqan::BAM_HEADER_FIRST;
+    seqan::appendValue(hd.tags, seqan::Pair<seqan::CharString>("VN", "1.4"));
+    seqan::appendValue(hd.tags, seqan::Pair<seqan::CharString>("SO", "coordinate"));
+    seqan::appendValue(header, hd);
+    for (unsigned c = 0; c < options.contigs; ++c)
+    {
+        std::string name = "chr" + std::to_string(c + 1);
+        seqan::appendValue(seqan::contigNames(context), name);
+        seqan::appendValue(seqan::contigLengths(context), options.contigLength);
+        seqan::BamHeaderRecord sq;
+        sq.type = seqan::BAM_HEADER_REFERENCE;
+        seqan::appendValue(sq.tags, seqan::Pair<seqan::CharString>("SN", name));
+        seqan::appendValue(sq.tags, seqan::Pair<seqan::CharString>("LN", std::to_string(options.contigLength)));
+        seqan::appendValue(header, sq);
+    }
+
+    BamWriter writer;
+    BamIndexBuilder index;
+    if (!open(writer, options.bamPath, context, 0, 6))
+    {
+        fprintf(stderr, "ERROR: Could not open %s for writing.\n", options.bamPath);
+        return 1;
+    }
+    attachIndex(writer, index);
+    writeHeader(writer, header);
+
+    std::mt19937 rng(options.seed);
+    seqan::BamAlignmentRecord record;
+    seqan::CharString encoded;
+    BamRawRecord raw;
+    size_t nReads = 0;
+    for (unsigned c = 0; c < options.contigs; ++c)
+    {
+        seqan::Dna5String genome;
+        seqan::resize(genome, options.contigLength);
+        for (unsigned i = 0; i < options.contigLength; ++i)
+            genome[i] = rng() % 4;
+        std::vector<Fragment> fragments = makeFragments(options, rng);
+        std::vector<ReadSlot> slots;
+        slots.reserve(2 * fragments.size());
+        for (unsigned f = 0; f < fragments.size(); ++f)
+        {
+            __int32 reverseBegin = fragments[f].begin + fragments[f].length - std::min(options.readLength, (unsigned)fragments[f].length);
+            ReadSlot forward = {fragments[f].begin, f, false}, reverse = {reverseBegin, f, true};
+            slots.push_back(forward);
+            slots.push_back(reverse);
+        }
+        std::sort(slots.begin(), slots.end(), slotLess);
+        for (unsigned s = 0; s < slots.size(); ++s)
+        {
+            makeRead(record, options, genome, c, fragments, slots[s].fragment, slots[s].reverse);
+            seqan::clear(encoded);
+            seqan::write(encoded, record, context, seqan::Bam());
+            parseRawRecord(raw, seqan::begin(encoded, seqan::Standard()));
+            writeRecord(writer, raw);
+        }
+        nReads += slots.size();
+    }
+
+    if (!close(writer))
+    {
+        fprintf(stderr, "ERROR: Could not write %s.\n", options.bamPath);
+        return 1;
+    }
+    std::string indexPath = std::string(options.bamPath) + ".bai";
+    if (!writeIndex(index, writer, options.contigs, indexPath.c_str(), BAM_INDEX_BAI))
+    {
+        fprintf(stderr, "ERROR: Could not write %s.\n", indexPath.c_str());
+        return 1;
+    }
+    if (options.intervalPath != NULL && !writeIntervals(options.intervalPath, options))
+    {
+        fprintf(stderr, "ERROR: Could not write %s.\n", options.intervalPath);
+        return 1;
+    }
+    printf("%s: %zu reads on %u contigs\n", options.bamPath, nReads, options.contigs);
+    return 0;
+}
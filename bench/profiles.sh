@@ -0,0 +1,21 @@
+# The synthetic inputs of the benchmarks and the differential test, sourced by run_bench.sh and diff_outputs.sh. Each
+# profile is a name and make_test_bam options; changing the options of a profile writes its BAM again.
+
+profiles=(
+  "wgs --contigs 2 --contig-length 1000000 --depth 30"
+  "adapters --contigs 1 --contig-length 1000000 --depth 30 --fragment-mean 150 --fragment-sd 40 --adapter-rate 0.3 --n-rate 0.1 --soft-clip-rate 0.2 --hard-clip-rate 0.05 --duplicate-rate 0.2 --tags 8"
+  "deep --contigs 1 --contig-length 100000 --depth 600 --duplicate-rate 0.3"
+)
+
+# Writes data/NAME.bam with its index, interval file and read count (NAME.reads) unless they are there for the same
+# options. Takes the profile name and its options.
+make_profile_bam() {
+  local name=$1
+  shift
+  local bam=${data}/${name}.bam
+  mkdir -p "$data"
+  if [[ ! -f $bam || ! -f ${data}/${name}.reads || "$(cat "${data}/${name}.args" 2>/dev/null)" != "$*" ]]; then
+    "${bench}/make_test_bam" "$@" --intervals "${data}/${name}.intervals" "$bam" | tee /dev/stderr | awk '{print $1, $2}' > "${data}/${name}.reads"
+    echo "$*" > "${data}/${name}.args"
+  fi
+}
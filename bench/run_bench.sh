@@ -0,0 +1,85 @@
+#!/usr/bin/bash
+set -e
+set -o pipefail
+
+# Runs the benchmarks of `make bench`: bamShrink end to end and filter_bench on synthetic BAMs written by make_test_bam,
+# one per profile of profiles.sh. Every benchmark gives reads/s and MB/s; the results go to bench/results.txt and are compared
+# with bench/baseline.txt if there is one. A benchmark more than BENCH_TOLERANCE percent (default 10) slower than its
+# baseline makes the run fail. --update-baseline makes the results the new baseline.
+
+if [[ "$#" -gt 1 || ( "$#" -eq 1 && "$1" != "--update-baseline" ) ]]; then
+  echo "Usage: bash bench/run_bench.sh [--update-baseline]"
+  exit 1
+fi
+
+update=$1
+bench=$(dirname "$0")
+data=${BENCH_DATA:-${bench}/data}
+results=${bench}/results.txt
+baseline=${bench}/baseline.txt
+tolerance=${BENCH_TOLERANCE:-10}
+bamShrink=${bench}/../bamShrink
+
+source "${bench}/profiles.sh"
+
+now() {
+  date +%s%N
+}
+
+# Prints "name reads/s MB/s" for a run of bamShrink over reads reads of a file of bytes bytes in nanos ns.
+rate() {
+  awk -v name="$1" -v reads="$2" -v bytes="$3" -v nanos="$4" 'BEGIN{s=nanos/1e9; printf "%s %.0f %.2f\n", name, reads/s, bytes/s/1e6}'
+}
+
+# Times bamShrink with the given arguments. The MB/s are of the part of the input file the filtered reads take up, taken
+# as their share of all reads of the file (total).
+end_to_end() {
+  local name=$1 bam=$2 total=$3
+  shift 3
+  local begin=$(now)
+  "$bamShrink" --stats-json "${data}/${name}.json" "$@" > "${data}/${name}.log"
+  local end=$(now)
+  local reads=$(grep -o '"reads": [0-9]*' "${data}/${name}.json" | head -n 1 | awk '{print $2}')
+  rate "$name" "$reads" $(($(stat -c %s "$bam") * reads / total)) $((end - begin))
+}
+
+: > "${results}.tmp"
+for profile in "${profiles[@]}"; do
+  set -- $profile
+  name=$1
+  shift
+  bam=${data}/${name}.bam
+  make_profile_bam "$name" "$@"
+  total=$(awk '{print $2}' "${data}/${name}.reads")
+  end_to_end "${name}.end_to_end" "$bam" "$total" "$bam" "${data}/${name}.out.bam" 500 Y 30 auto >> "${results}.tmp"
+  end_to_end "${name}.intervals" "$bam" "$total" "$bam" "${data}/${name}.out.bam" 500 Y 30 auto "${bam}.bai" "${data}/${name}.intervals" >> "${results}.tmp"
+  "${bench}/filter_bench" "$bam" | grep -v '^#' | sed "s/^/${name}./" >> "${results}.tmp"
+done
+rm -f "${data}"/*.out.bam
+mv "${results}.tmp" "$results"
+
+if [[ "$update" == "--update-baseline" ]]; then
+  cp "$results" "$baseline"
+  echo "Baseline written to ${baseline}"
+fi
+
+if [[ ! -f $baseline ]]; then
+  printf "%-36s %14s %10s\n" benchmark reads/s MB/s
+  awk '{printf "%-36s %14s %10s\n", $1, $2, $3}' "$results"
+  echo "No baseline to compare with, run make bench-baseline to keep these results as one."
+  exit 0
+fi
+
+# Compares reads/s with the baseline.
+awk -v tolerance="$tolerance" '
+  FNR == NR { base[$1] = $2; next }
+  FNR == 1 { printf "%-36s %14s %10s %14s %8s\n", "benchmark", "reads/s", "MB/s", "baseline", "change" }
+  {
+    if (!($1 in base) || base[$1] == 0) { printf "%-36s %14s %10s %14s %8s\n", $1, $2, $3, "-", "new"; next }
+    change = 100 * ($2 - base[$1]) / base[$1]
+    flag = change < -tolerance ? "  SLOWER" : ""
+    if (flag != "") slower++
+    printf "%-36s %14s %10s %14s %+7.1f%%%s\n", $1, $2, $3, base[$1], change, flag
+  }
+  END { if (slower > 0) { printf "%d benchmarks more than %s%% slower than the baseline\n", slower, tolerance; exit 1 } }
+' "$baseline" "$results"
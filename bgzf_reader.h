@@ -0,0 +1,680 @@
+#ifndef BAMSHRINK_BGZF_READER_H_
+#define BAMSHRINK_BGZF_READER_H_
+
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <set>
+#include <utility>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <seqan/bam_io.h>
+#include "bgzf_writer.h"
+#include "stage_stats.h"
+
+const unsigned BGZF_READ_HISTORY = 16;
+
+struct BgzfReadBlock {
+    std::vector<char> compressed;
+    std::vector<char> data;
+    unsigned dataSize = 0;
+    __uint64 offset = 0;
+    unsigned blockSize = 0;
+    bool ready = false;
+    bool ok = false;
+    //Claimed and not ready yet. A seek ahead can leave such a block behind, its slot is not claimed again until then.
+    bool reading = false;
+    //Why the block could not be read, if it could not.
+    char const * error = NULL;
+
+    BgzfReadBlock() : compressed(BGZF_MAX_BLOCK_BYTES), data(BGZF_MAX_BLOCK_BYTES) {}
+} ;
+
+//Blocks are read from the file in order and inflated by a pool of worker threads into a bounded ring indexed by their
+//sequence number. The reading thread only copies bytes out of the block at the front of the ring. Read-ahead stops after
+//the block at limitOffset; blocks past it are only inflated, on the reading thread, if the caller asks for them. The
+//last BGZF_READ_HISTORY blocks read stay in the ring, so seeking back into them, or ahead into blocks already read
+//ahead, does not read or inflate them again.
+//Callers that know which parts of the file they read next can prefetch() them: the kernel is asked to read them into
+//the page cache with posix_fadvise(), or, where that fails or prefetchThread is set, a thread reads them with pread().
+struct BgzfReader {
+    int fd = -1;
+    //Standard input or a pipe, which is read in order with read(); files are read with pread() outside the lock.
+    bool stream = false;
+    __uint64 fileSize = 0;
+    std::vector<BgzfReadBlock> ring;
+    size_t nextClaim = 0;
+    size_t nextConsume = 0;
+    unsigned inFlight = 0;
+    __uint64 nextOffset = 0;
+    __uint64 limitOffset = (__uint64)-1;
+    bool eof = false;
+    //A thread is reading the header of the next block, whose size is needed to claim the one after it.
+    bool claiming = false;
+    bool seeking = false;
+    bool stop = false;
+    BgzfReadBlock * current = NULL;
+    unsigned pos = 0;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable blockClaimable;
+    std::condition_variable blockReady;
+    z_stream strm;
+    //File offset up to which prefetch() has asked for the bytes.
+    __uint64 prefetchEnd = 0;
+    bool prefetchThread = false;
+    std::thread prefetcher;
+    std::deque<std::pair<__uint64, __uint64> > prefetchQueue;
+    std::condition_variable prefetchQueued;
+    std::vector<unsigned char> residency;
+    //Ranges prefetched, ranges read and how many of them were in the page cache when reading began, and the time the
+    //reading thread waited for blocks, or read and inflated them itself.
+    __uint64 nPrefetched = 0;
+    __uint64 nRanges = 0;
+    __uint64 nCached = 0;
+    __uint64 stallNanos = 0;
+    //With timeBlocks, the blocks inflated and the CPU time spent on them by all threads.
+    bool timeBlocks = false;
+    __uint64 nInflated = 0;
+    __uint64 inflateCpuNanos = 0;
+
+    BgzfReader() {}
+    BgzfReader(BgzfReader const &) = delete;
+    ~BgzfReader();
+} ;
+
+//Reads len bytes at the file offset, or the next len bytes of a stream. Returns the number of bytes read, which is less
+//than len only at the end of the file, or -1 on a read error.
+inline ssize_t _readBgzfBytes(BgzfReader & reader, char * buffer, size_t len, __uint64 offset)
+{
+    size_t total = 0;
+    while (total != len)
+    {
+        ssize_t n = reader.stream ? read(reader.fd, buffer + total, len - total)
+                                  : pread(reader.fd, buffer + total, len - total, offset + total);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        total += n;
+    }
+    return total;
+}
+
+inline bool _initBgzfInflateStream(z_stream & strm)
+{
+    memset(&strm, 0, sizeof(z_stream));
+    return inflateInit2(&strm, -15) == Z_OK;
+}
+
+inline bool _inflateBgzfBlock(BgzfReadBlock & block, z_stream & strm)
+{
+    if (inflateReset(&strm) != Z_OK)
+        return false;
+    strm.next_in = reinterpret_cast<Bytef *>(&block.compressed[BGZF_HEADER_BYTES]);
+    strm.avail_in = block.blockSize - BGZF_HEADER_BYTES - BGZF_FOOTER_BYTES;
+    strm.next_out = reinterpret_cast<Bytef *>(&block.data[0]);
+    strm.avail_out = block.data.size();
+    if (inflate(&strm, Z_FINISH) != Z_STREAM_END)
+        return false;
+    __uint32 isize = 0;
+    memcpy(&isize, &block.compressed[block.blockSize - 4], 4);
+    block.dataSize = strm.total_out;
+    return block.dataSize == isize;
+}
+
+//Claims the next block of the file, reads and inflates it. Only the claim holds the lock: the header is read by the one
+//thread claiming, as the size of the block gives the offset of the next one, and the rest of the block is read and
+//inflated while the next block is claimed. A stream is read in order under the lock. Returns false at the end of the
+//file; a block that cannot be read is reported by the reading thread when it gets there.
+inline bool _fetchBgzfBlock(BgzfReader & reader, std::unique_lock<std::mutex> & lock, z_stream & strm)
+{
+    BgzfReadBlock & block = reader.ring[reader.nextClaim % reader.ring.size()];
+    char * header = &block.compressed[0];
+    __uint64 offset = reader.nextOffset;
+    bool stream = reader.stream;
+    reader.claiming = true;
+    ++reader.inFlight;
+    if (!stream)
+        lock.unlock();
+    ssize_t headerBytes = _readBgzfBytes(reader, header, BGZF_HEADER_BYTES, offset);
+    if (!stream)
+        lock.lock();
+    reader.claiming = false;
+    if (headerBytes == 0)
+    {
+        //The reading thread may be waiting for this block.
+        --reader.inFlight;
+        reader.eof = true;
+        reader.blockReady.notify_all();
+        return false;
+    }
+    __uint16 bsize = 0;
+    memcpy(&bsize, header + 16, 2);
+    block.offset = offset;
+    block.blockSize = bsize + 1;
+    block.ready = false;
+    block.reading = true;
+    block.error = NULL;
+    if (headerBytes < 0)
+        block.error = "Could not read the input file.";
+    else if (headerBytes != (ssize_t)BGZF_HEADER_BYTES)
+        block.error = "Truncated BGZF block header at the end of the input file.";
+    else if (header[0] != '\x1f' || header[1] != '\x8b' || header[12] != 'B' || header[13] != 'C' ||
+             block.blockSize <= BGZF_HEADER_BYTES + BGZF_FOOTER_BYTES)
+        block.error = "Invalid BGZF block header.";
+    unsigned bodyBytes = block.blockSize - BGZF_HEADER_BYTES;
+    if (block.error == NULL && stream && _readBgzfBytes(reader, header + BGZF_HEADER_BYTES, bodyBytes, 0) != (ssize_t)bodyBytes)
+        block.error = "Truncated BGZF block at the end of the input file.";
+    //A damaged block ends the file for the read-ahead.
+    if (block.error != NULL)
+        reader.eof = true;
+    reader.nextOffset += block.blockSize;
+    ++reader.nextClaim;
+    reader.blockClaimable.notify_all();
+    reader.blockReady.notify_all();
+    bool timeBlock = reader.timeBlocks;
+    lock.unlock();
+    if (block.error == NULL && !stream && _readBgzfBytes(reader, header + BGZF_HEADER_BYTES, bodyBytes, offset + BGZF_HEADER_BYTES) != (ssize_t)bodyBytes)
+        block.error = "Truncated BGZF block at the end of the input file.";
+    __uint64 cpuBegin = timeBlock ? threadCpuNanos() : 0;
+    block.ok = block.error == NULL && _inflateBgzfBlock(block, strm);
+    __uint64 cpuNanos = timeBlock ? threadCpuNanos() - cpuBegin : 0;
+    lock.lock();
+    reader.nInflated += timeBlock;
+    reader.inflateCpuNanos += cpuNanos;
+    block.ready = true;
+    block.reading = false;
+    --reader.inFlight;
+    reader.blockClaimable.notify_all();
+    reader.blockReady.notify_all();
+    return true;
+}
+
+inline bool _canClaimBgzfBlock(BgzfReader & reader)
+{
+    return !reader.seeking && !reader.claiming && !reader.eof && reader.nextOffset <= reader.limitOffset &&
+           reader.nextClaim + BGZF_READ_HISTORY < reader.nextConsume + reader.ring.size() &&
+           !reader.ring[reader.nextClaim % reader.ring.size()].reading;
+}
+
+inline void _bgzfReadWorker(BgzfReader & reader)
+{
+    z_stream strm;
+    if (!_initBgzfInflateStream(strm))
+        return;
+    std::unique_lock<std::mutex> lock(reader.mutex);
+    while (true)
+    {
+        reader.blockClaimable.wait(lock, [&reader]{ return reader.stop || _canClaimBgzfBlock(reader); });
+        if (reader.stop)
+            break;
+        _fetchBgzfBlock(reader, lock, strm);
+    }
+    inflateEnd(&strm);
+}
+
+//The path - reads from standard input, which cannot seek.
+inline bool open(BgzfReader & reader, char const * path, unsigned numThreads)
+{
+    reader.fd = strcmp(path, "-") == 0 ? dup(STDIN_FILENO) : ::open(path, O_RDONLY);
+    if (reader.fd < 0)
+        return false;
+    reader.stream = strcmp(path, "-") == 0 || lseek(reader.fd, 0, SEEK_CUR) < 0;
+    struct stat status;
+    if (fstat(reader.fd, &status) == 0)
+        reader.fileSize = status.st_size;
+    if (!_initBgzfInflateStream(reader.strm))
+        return false;
+    reader.ring = std::vector<BgzfReadBlock>((numThreads == 0 ? 1 : 4 * numThreads) + BGZF_READ_HISTORY);
+    for (unsigned i = 0; i < numThreads; ++i)
+        reader.threads.push_back(std::thread(_bgzfReadWorker, std::ref(reader)));
+    return true;
+}
+
+//Moves on to the next non-empty block. Returns false at the end of the file.
+inline bool _nextBgzfBlock(BgzfReader & reader)
+{
+    std::unique_lock<std::mutex> lock(reader.mutex);
+    while (true)
+    {
+        if (reader.current != NULL)
+        {
+            ++reader.nextConsume;
+            reader.current = NULL;
+            reader.blockClaimable.notify_all();
+        }
+        BgzfReadBlock & block = reader.ring[reader.nextConsume % reader.ring.size()];
+        auto blockAvailable = [&reader, &block]{
+            return (reader.nextConsume < reader.nextClaim && block.ready) ||
+                   (reader.nextConsume == reader.nextClaim && !reader.claiming && !block.reading && (reader.threads.empty() || reader.eof || reader.nextOffset > reader.limitOffset));
+        };
+        std::chrono::steady_clock::time_point stallBegin;
+        bool stalled = !blockAvailable() || reader.nextConsume == reader.nextClaim;
+        if (stalled)
+            stallBegin = std::chrono::steady_clock::now();
+        reader.blockReady.wait(lock, blockAvailable);
+        bool fetched = reader.nextConsume < reader.nextClaim || _fetchBgzfBlock(reader, lock, reader.strm);
+        if (stalled)
+            reader.stallNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - stallBegin).count();
+        if (!fetched)
+            return false;
+        if (!block.ok)
+            throw seqan::IOError(block.error != NULL ? block.error : "Could not decompress BGZF block.");
+        reader.current = &block;
+        reader.pos = 0;
+        if (block.dataSize != 0)
+            return true;
+    }
+}
+
+//Restricts the read-ahead to the blocks up to and including the one that holds the virtual offset voffset.
+inline void setReadLimit(BgzfReader & reader, __uint64 voffset)
+{
+    std::lock_guard<std::mutex> lock(reader.mutex);
+    reader.limitOffset = voffset == (__uint64)-1 ? voffset : voffset >> 16;
+    reader.blockClaimable.notify_all();
+}
+
+inline void clearReadLimit(BgzfReader & reader)
+{
+    setReadLimit(reader, (__uint64)-1);
+}
+
+//Index of the block at the file offset blockOffset in the ring, or the end of the ring if it is not there. The ring
+//holds the blocks from nextClaim - ring.size() to nextClaim in file order, except the oldest while it is being claimed.
+inline size_t _findBgzfBlock(BgzfReader & reader, __uint64 blockOffset)
+{
+    size_t oldest = reader.nextClaim + reader.claiming;
+    size_t first = oldest > reader.ring.size() ? oldest - reader.ring.size() : 0;
+    for (size_t i = first; i < reader.nextClaim; ++i)
+        if (reader.ring[i % reader.ring.size()].offset == blockOffset)
+            return i;
+    return reader.nextClaim;
+}
+
+inline bool seek(BgzfReader & reader, __uint64 voffset)
+{
+    {
+        std::unique_lock<std::mutex> lock(reader.mutex);
+        size_t found = _findBgzfBlock(reader, voffset >> 16);
+        if (found != reader.nextClaim)
+        {
+            reader.current = NULL;
+            reader.nextConsume = found;
+        }
+        else
+        {
+            reader.seeking = true;
+            reader.blockReady.wait(lock, [&reader]{ return reader.inFlight == 0; });
+            reader.seeking = false;
+            reader.current = NULL;
+            reader.nextClaim = reader.nextConsume = 0;
+            reader.nextOffset = voffset >> 16;
+            reader.eof = lseek(reader.fd, reader.nextOffset, SEEK_SET) < 0;
+            if (reader.eof)
+                return false;
+            reader.blockClaimable.notify_all();
+        }
+    }
+    if (!_nextBgzfBlock(reader))
+        return (voffset & 0xffff) == 0;
+    reader.pos = voffset & 0xffff;
+    return reader.pos <= reader.current->dataSize;
+}
+
+//Virtual offset of the next byte read. At the end of a block this is the start of the next one, as in an index.
+inline __uint64 tell(BgzfReader & reader)
+{
+    if (reader.current == NULL)
+        return (__uint64)-1;
+    if (reader.pos == reader.current->dataSize)
+        return (reader.current->offset + reader.current->blockSize) << 16;
+    return reader.current->offset << 16 | reader.pos;
+}
+
+inline bool atEnd(BgzfReader & reader)
+{
+    if (reader.current != NULL && reader.pos < reader.current->dataSize)
+        return false;
+    return !_nextBgzfBlock(reader);
+}
+
+inline size_t readData(BgzfReader & reader, char * data, size_t len)
+{
+    size_t total = 0;
+    while (total != len && !atEnd(reader))
+    {
+        size_t n = std::min(len - total, (size_t)(reader.current->dataSize - reader.pos));
+        memcpy(data + total, &reader.current->data[reader.pos], n);
+        reader.pos += n;
+        total += n;
+    }
+    return total;
+}
+
+//Moves past len bytes without copying them. Returns the number of bytes skipped.
+inline size_t skipData(BgzfReader & reader, size_t len)
+{
+    size_t total = 0;
+    while (total != len && !atEnd(reader))
+    {
+        size_t n = std::min(len - total, (size_t)(reader.current->dataSize - reader.pos));
+        reader.pos += n;
+        total += n;
+    }
+    return total;
+}
+
+//File offset past the last block that holds bytes before the virtual offset end.
+inline __uint64 _fileEnd(BgzfReader const & reader, __uint64 end)
+{
+    __uint64 fileEnd = (end >> 16) + ((end & 0xffff) != 0 ? BGZF_MAX_BLOCK_BYTES : 0);
+    return reader.fileSize != 0 ? std::min(fileEnd, reader.fileSize) : fileEnd;
+}
+
+inline void _bgzfPrefetchWorker(BgzfReader & reader)
+{
+    std::vector<char> buffer(1 << 20);
+    std::unique_lock<std::mutex> lock(reader.mutex);
+    while (true)
+    {
+        reader.prefetchQueued.wait(lock, [&reader]{ return reader.stop || !reader.prefetchQueue.empty(); });
+        if (reader.stop)
+            break;
+        std::pair<__uint64, __uint64> range = reader.prefetchQueue.front();
+        reader.prefetchQueue.pop_front();
+        lock.unlock();
+        for (__uint64 offset = range.first; offset < range.second; )
+        {
+            ssize_t n = pread(reader.fd, &buffer[0], std::min((__uint64)buffer.size(), range.second - offset), offset);
+            if (n <= 0)
+                break;
+            offset += n;
+        }
+        lock.lock();
+    }
+}
+
+//Starts reading the blocks of the virtual offset range [begin, end) into the page cache in the background. Bytes before
+//the end of an earlier prefetch are not asked for again, so ranges should come in file order.
+inline void prefetch(BgzfReader & reader, __uint64 begin, __uint64 end)
+{
+    __uint64 fileBegin = std::max(begin >> 16, reader.prefetchEnd);
+    __uint64 fileEnd = _fileEnd(reader, end);
+    if (fileEnd <= fileBegin)
+        return;
+    reader.prefetchEnd = fileEnd;
+    ++reader.nPrefetched;
+    if (!reader.prefetchThread && posix_fadvise(reader.fd, fileBegin, fileEnd - fileBegin, POSIX_FADV_WILLNEED) == 0)
+        return;
+    std::lock_guard<std::mutex> lock(reader.mutex);
+    reader.prefetchThread = true;
+    if (!reader.prefetcher.joinable())
+        reader.prefetcher = std::thread(_bgzfPrefetchWorker, std::ref(reader));
+    reader.prefetchQueue.push_back(std::make_pair(fileBegin, fileEnd));
+    reader.prefetchQueued.notify_all();
+}
+
+//Counts a range of virtual offsets that is about to be read, and whether all of its pages are in the page cache.
+inline void countRangeRead(BgzfReader & reader, __uint64 begin, __uint64 end)
+{
+    ++reader.nRanges;
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    __uint64 fileBegin = (begin >> 16) / pageSize * pageSize;
+    __uint64 fileEnd = _fileEnd(reader, end);
+    if (fileEnd <= fileBegin)
+        return;
+    size_t len = fileEnd - fileBegin;
+    void * map = mmap(NULL, len, PROT_READ, MAP_SHARED, reader.fd, fileBegin);
+    if (map == MAP_FAILED)
+        return;
+    reader.residency.resize((len + pageSize - 1) / pageSize);
+    bool cached = mincore(map, len, &reader.residency[0]) == 0;
+    for (size_t i = 0; cached && i < reader.residency.size(); ++i)
+        cached = (reader.residency[i] & 1) != 0;
+    munmap(map, len);
+    reader.nCached += cached;
+}
+
+inline BgzfReader::~BgzfReader()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+        blockClaimable.notify_all();
+        prefetchQueued.notify_all();
+    }
+    for (unsigned i = 0; i < threads.size(); ++i)
+        threads[i].join();
+    if (prefetcher.joinable())
+        prefetcher.join();
+    if (fd >= 0)
+    {
+        inflateEnd(&strm);
+        ::close(fd);
+    }
+}
+
+//Counterpart of BamWriter for the BamFileIn usage in bamShrink. It owns its name store like BamFileIn, so several
+//readers of the same file can be used on different threads.
+struct BamReader {
+    BgzfReader bgzf;
+    seqan::BamFileIn::TOwnerContext data_context;
+    seqan::BamFileIn::TDependentContext context;
+    seqan::CharString buffer;
+    //Virtual offset of the last record read by readNextRecord() of bamShrink, where a resumed run reads on from.
+    __uint64 recordOffset = 0;
+
+    BamReader() : context(data_context) {}
+} ;
+
+inline bool open(BamReader & reader, char const * path, unsigned numThreads)
+{
+    return open(reader.bgzf, path, numThreads);
+}
+
+inline seqan::BamFileIn::TDependentContext & context(BamReader & reader)
+{
+    return reader.context;
+}
+
+inline bool atEnd(BamReader & reader)
+{
+    return atEnd(reader.bgzf);
+}
+
+inline void _readBamBytes(BamReader & reader, size_t len)
+{
+    size_t oldLength = seqan::length(reader.buffer);
+    seqan::resize(reader.buffer, oldLength + len);
+    if (readData(reader.bgzf, seqan::begin(reader.buffer, seqan::Standard()) + oldLength, len) != len)
+        throw seqan::IOError("Unexpected end of BAM file.");
+}
+
+inline __int32 _readBamInt32(BamReader & reader)
+{
+    _readBamBytes(reader, 4);
+    __int32 value = 0;
+    memcpy(&value, seqan::end(reader.buffer, seqan::Standard()) - 4, 4);
+    return value;
+}
+
+//The header is collected as raw bytes and handed to the SeqAn BAM header parser, which fills the name store.
+inline void readHeader(seqan::BamHeader & header, BamReader & reader)
+{
+    seqan::clear(reader.buffer);
+    _readBamBytes(reader, 4);
+    _readBamBytes(reader, _readBamInt32(reader));
+    __int32 nRef = _readBamInt32(reader);
+    for (__int32 i = 0; i < nRef; ++i)
+        _readBamBytes(reader, _readBamInt32(reader) + 4);
+    seqan::DirectionIterator<seqan::CharString, seqan::Input>::Type it = seqan::directionIterator(reader.buffer, seqan::Input());
+    seqan::readHeader(header, reader.context, it, seqan::Bam());
+}
+
+inline void readRecord(seqan::BamAlignmentRecord & record, BamReader & reader)
+{
+    seqan::clear(reader.buffer);
+    _readBamBytes(reader, _readBamInt32(reader));
+    seqan::DirectionIterator<seqan::CharString, seqan::Input>::Type it = seqan::directionIterator(reader.buffer, seqan::Input());
+    seqan::readRecord(record, reader.context, it, seqan::Bam());
+}
+
+//Smallest offset of the records that can overlap pos, from the linear index, chosen as in SeqAn.
+inline __uint64 linearIndexOffset(seqan::BamIndex<seqan::Bai> const & index, __int32 refId, __int32 pos)
+{
+    unsigned windowIdx = pos >> 14;
+    __uint64 offset = 0;
+    if (windowIdx >= seqan::length(index._linearIndices[refId]))
+    {
+        if (seqan::empty(index._linearIndices[refId]))
+        {
+            for (unsigned i = refId; i < seqan::length(index._linearIndices); ++i)
+            {
+                if (!seqan::empty(index._linearIndices[i]))
+                {
+                    offset = seqan::front(index._linearIndices[i]);
+                    if (offset != 0u)
+                        break;
+                    for (unsigned j = 1; j < seqan::length(index._linearIndices[i]); ++j)
+                    {
+                        if (index._linearIndices[i][j] > offset)
+                        {
+                            offset = index._linearIndices[i][j];
+                            break;
+                        }
+                    }
+                    if (offset != 0u)
+                        break;
+                }
+            }
+        }
+        else
+        {
+            offset = seqan::back(index._linearIndices[refId]);
+        }
+    }
+    else
+    {
+        offset = index._linearIndices[refId][windowIdx];
+    }
+    return offset;
+}
+
+//Largest chunk end of the bins overlapping [pos, posEnd) that is not before the linear index offset of pos. Reading
+//the reference refId up to this virtual offset returns every record overlapping the region.
+inline __uint64 regionChunkEnd(seqan::BamIndex<seqan::Bai> const & index, __int32 refId, __int32 pos, __int32 posEnd, __uint64 linearMinOffset)
+{
+    seqan::String<__uint16> candidateBins;
+    seqan::_baiReg2bins(candidateBins, pos, posEnd);
+    __uint64 chunkEnd = 0;
+    for (unsigned i = 0; i < seqan::length(candidateBins); ++i)
+    {
+        std::map<__uint32, seqan::BaiBamIndexBinData_>::const_iterator mIt = index._binIndices[refId].find(candidateBins[i]);
+        if (mIt == index._binIndices[refId].end())
+            continue;
+        for (unsigned j = 0; j < seqan::length(mIt->second.chunkBegEnds); ++j)
+            if (mIt->second.chunkBegEnds[j].i2 >= linearMinOffset)
+                chunkEnd = std::max(chunkEnd, (__uint64)mIt->second.chunkBegEnds[j].i2);
+    }
+    return chunkEnd;
+}
+
+//The jumpToRegion() of SeqAn for a BamReader. In addition the read-ahead is limited to the chunk end of the region, and
+//each candidate offset is probed without reading ahead.
+inline bool jumpToRegion(BamReader & reader, bool & hasAlignments, __int32 refId, __int32 pos, __int32 posEnd, seqan::BamIndex<seqan::Bai> const & index)
+{
+    hasAlignments = false;
+    if (refId < 0 || static_cast<unsigned>(refId) >= seqan::length(index._binIndices))
+        return false;
+
+    seqan::String<__uint16> candidateBins;
+    seqan::_baiReg2bins(candidateBins, pos, posEnd);
+
+    __uint64 linearMinOffset = linearIndexOffset(index, refId, pos);
+
+    std::set<__uint64> offsetCandidates;
+    for (unsigned i = 0; i < seqan::length(candidateBins); ++i)
+    {
+        std::map<__uint32, seqan::BaiBamIndexBinData_>::const_iterator mIt = index._binIndices[refId].find(candidateBins[i]);
+        if (mIt == index._binIndices[refId].end())
+            continue;
+        for (unsigned j = 0; j < seqan::length(mIt->second.chunkBegEnds); ++j)
+            if (mIt->second.chunkBegEnds[j].i2 >= linearMinOffset)
+                offsetCandidates.insert(mIt->second.chunkBegEnds[j].i1);
+    }
+
+    //Search through candidate offsets, find the rightmost possible.
+    __uint64 offset = (__uint64)-1;
+    seqan::BamAlignmentRecord record;
+    for (std::set<__uint64>::const_iterator candIt = offsetCandidates.begin(); candIt != offsetCandidates.end(); ++candIt)
+    {
+        setReadLimit(reader.bgzf, *candIt);
+        if (!seek(reader.bgzf, *candIt) || atEnd(reader))
+            continue;
+        readRecord(record, reader);
+        if (record.rID != refId)
+            continue;
+        if (!hasAlignments || record.beginPos <= pos)
+        {
+            hasAlignments = true;
+            offset = *candIt;
+        }
+        if (record.beginPos >= posEnd)
+            break;
+    }
+
+    setReadLimit(reader.bgzf, regionChunkEnd(index, refId, pos, posEnd, linearMinOffset));
+    if (offset != (__uint64)-1)
+        seek(reader.bgzf, offset);
+    return true;
+}
+
+//Jumps to the first record of the whole reference refId. The chunks of its bins only hold its records, so the smallest
+//chunk begin is where it starts and nothing has to be probed; the read-ahead is limited to the largest chunk end. Both
+//are the span that samtools keeps in the pseudo bin, which SeqAn reads as a bin of its own.
+inline bool jumpToReference(BamReader & reader, bool & hasAlignments, __int32 refId, seqan::BamIndex<seqan::Bai> const & index)
+{
+    hasAlignments = false;
+    if (refId < 0 || static_cast<unsigned>(refId) >= seqan::length(index._binIndices))
+        return false;
+
+    //BAI_PSEUDO_BIN of the index writer.
+    const __uint32 pseudoBin = 37450;
+    std::map<__uint32, seqan::BaiBamIndexBinData_> const & bins = index._binIndices[refId];
+    __uint64 chunkBegin = (__uint64)-1;
+    __uint64 chunkEnd = 0;
+    std::map<__uint32, seqan::BaiBamIndexBinData_>::const_iterator pseudo = bins.find(pseudoBin);
+    if (pseudo != bins.end() && seqan::length(pseudo->second.chunkBegEnds) > 0)
+    {
+        chunkBegin = pseudo->second.chunkBegEnds[0].i1;
+        chunkEnd = pseudo->second.chunkBegEnds[0].i2;
+    }
+    else
+    {
+        for (std::map<__uint32, seqan::BaiBamIndexBinData_>::const_iterator mIt = bins.begin(); mIt != bins.end(); ++mIt)
+            for (unsigned j = 0; mIt->first != pseudoBin && j < seqan::length(mIt->second.chunkBegEnds); ++j)
+            {
+                chunkBegin = std::min(chunkBegin, (__uint64)mIt->second.chunkBegEnds[j].i1);
+                chunkEnd = std::max(chunkEnd, (__uint64)mIt->second.chunkBegEnds[j].i2);
+            }
+    }
+    if (chunkBegin >= chunkEnd)
+        return true;
+    setReadLimit(reader.bgzf, chunkEnd);
+    hasAlignments = seek(reader.bgzf, chunkBegin);
+    return true;
+}
+
+#endif  // BAMSHRINK_BGZF_READER_H_
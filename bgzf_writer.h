@@ -0,0 +1,462 @@
+#ifndef BAMSHRINK_BGZF_WRITER_H_
+#define BAMSHRINK_BGZF_WRITER_H_
+
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <unistd.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <zlib.h>
+#include <seqan/bam_io.h>
+#include "stage_stats.h"
+
+//Uncompressed bytes per block, as in htslib. Stored, a full block still fits into BGZF_MAX_BLOCK_BYTES, so data that does
+//not deflate to less can always be written as it is.
+const unsigned BGZF_BLOCK_DATA_SIZE = 0xff00;
+const unsigned BGZF_MAX_BLOCK_BYTES = 65536;
+const unsigned BGZF_HEADER_BYTES = 18;
+const unsigned BGZF_FOOTER_BYTES = 8;
+
+const char BGZF_BLOCK_HEADER[BGZF_HEADER_BYTES] =
+{
+    '\x1f', '\x8b', 8, 4, 0, 0, 0, 0, 0, '\xff', 6, 0, 'B', 'C', 2, 0, 0, 0
+};
+
+const char BGZF_EOF_BLOCK[28] =
+{
+    '\x1f', '\x8b', 8, 4, 0, 0, 0, 0, 0, '\xff', 6, 0, 'B', 'C', 2, 0, 0x1b, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+enum BgzfBlockState
+{
+    BGZF_BLOCK_IDLE,
+    BGZF_BLOCK_QUEUED,
+    BGZF_BLOCK_COMPRESSED
+};
+
+struct BgzfBlock {
+    std::vector<char> data;
+    unsigned dataSize = 0;
+    std::vector<char> block;
+    unsigned blockSize = 0;
+    BgzfBlockState state = BGZF_BLOCK_IDLE;
+
+    BgzfBlock() : data(BGZF_BLOCK_DATA_SIZE), block(BGZF_MAX_BLOCK_BYTES) {}
+} ;
+
+//Blocks are filled by the calling thread and compressed by a pool of worker threads. They live in a ring indexed by
+//their sequence number; whichever worker finishes the oldest outstanding block writes all consecutive compressed blocks,
+//so the file is written in order without a separate writer thread. With zero threads blocks are compressed inline.
+struct BgzfWriter {
+    FILE * file = NULL;
+    int level = Z_BEST_SPEED;
+    bool failed = false;
+    std::vector<BgzfBlock> blocks;
+    size_t nextSubmit = 0;
+    size_t nextWrite = 0;
+    bool writing = false;
+    bool stop = false;
+    std::deque<size_t> queue;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable blockQueued;
+    std::condition_variable blockWritten;
+    z_stream strm;
+    //Compressed bytes written so far and, if tracked, the file offset of every block by its sequence number.
+    __uint64 bytesWritten = 0;
+    bool trackBlockOffsets = false;
+    std::vector<__uint64> blockOffsets;
+    //With timeBlocks, the blocks compressed and the CPU time spent on them by all threads, and the time the writing
+    //thread waited for a free block.
+    bool timeBlocks = false;
+    __uint64 nCompressed = 0;
+    __uint64 deflateCpuNanos = 0;
+    __uint64 submitWaitNanos = 0;
+
+    BgzfWriter() {}
+    BgzfWriter(BgzfWriter const &) = delete;
+    ~BgzfWriter();
+} ;
+
+inline bool _initBgzfStream(z_stream & strm, int level)
+{
+    memset(&strm, 0, sizeof(z_stream));
+    return deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+//Level 0 stores the data in a single deflate block of type 0, as deflate() would, but without going through zlib.
+inline unsigned _storeBgzfBlock(BgzfBlock & block, char * out)
+{
+    __uint16 len = block.dataSize, nlen = ~len;
+    out[0] = 1;
+    memcpy(out + 1, &len, 2);
+    memcpy(out + 3, &nlen, 2);
+    memcpy(out + 5, &block.data[0], block.dataSize);
+    return 5 + block.dataSize;
+}
+
+inline bool _compressBgzfBlock(BgzfBlock & block, z_stream & strm, int level)
+{
+    char * out = &block.block[0];
+    memcpy(out, BGZF_BLOCK_HEADER, BGZF_HEADER_BYTES);
+    unsigned compressedSize = 0;
+    if (level == 0)
+        compressedSize = _storeBgzfBlock(block, out + BGZF_HEADER_BYTES);
+    else
+    {
+        if (deflateReset(&strm) != Z_OK)
+            return false;
+        strm.next_in = reinterpret_cast<Bytef *>(&block.data[0]);
+        strm.avail_in = block.dataSize;
+        strm.next_out = reinterpret_cast<Bytef *>(out + BGZF_HEADER_BYTES);
+        strm.avail_out = BGZF_MAX_BLOCK_BYTES - BGZF_HEADER_BYTES - BGZF_FOOTER_BYTES;
+        int status = deflate(&strm, Z_FINISH);
+        //Incompressible data can deflate to more than fits into a block, it is stored instead.
+        if (status == Z_OK || status == Z_BUF_ERROR)
+            compressedSize = _storeBgzfBlock(block, out + BGZF_HEADER_BYTES);
+        else if (status == Z_STREAM_END)
+            compressedSize = strm.total_out;
+        else
+            return false;
+    }
+    block.blockSize = BGZF_HEADER_BYTES + compressedSize + BGZF_FOOTER_BYTES;
+    __uint16 bsize = block.blockSize - 1;
+    __uint32 crc = crc32(crc32(0u, NULL, 0u), reinterpret_cast<Bytef *>(&block.data[0]), block.dataSize);
+    memcpy(out + 16, &bsize, 2);
+    memcpy(out + block.blockSize - 8, &crc, 4);
+    memcpy(out + block.blockSize - 4, &block.dataSize, 4);
+    return true;
+}
+
+//Writes the compressed blocks that are next in line. Called with the lock held; only one thread writes at a time.
+inline void _writeCompressedBlocks(BgzfWriter & writer, std::unique_lock<std::mutex> & lock)
+{
+    if (writer.writing)
+        return;
+    writer.writing = true;
+    while (writer.nextWrite != writer.nextSubmit)
+    {
+        BgzfBlock & block = writer.blocks[writer.nextWrite % writer.blocks.size()];
+        if (block.state != BGZF_BLOCK_COMPRESSED)
+            break;
+        lock.unlock();
+        bool written = fwrite(&block.block[0], 1, block.blockSize, writer.file) == block.blockSize;
+        lock.lock();
+        if (!written)
+            writer.failed = true;
+        if (writer.trackBlockOffsets)
+            writer.blockOffsets.push_back(writer.bytesWritten);
+        writer.bytesWritten += block.blockSize;
+        block.dataSize = 0;
+        block.state = BGZF_BLOCK_IDLE;
+        ++writer.nextWrite;
+        writer.blockWritten.notify_all();
+    }
+    writer.writing = false;
+}
+
+inline void _bgzfWorker(BgzfWriter & writer)
+{
+    z_stream strm;
+    bool initialized = _initBgzfStream(strm, writer.level);
+    std::unique_lock<std::mutex> lock(writer.mutex);
+    while (true)
+    {
+        writer.blockQueued.wait(lock, [&writer]{ return writer.stop || !writer.queue.empty(); });
+        if (writer.queue.empty())
+            break;
+        BgzfBlock & block = writer.blocks[writer.queue.front() % writer.blocks.size()];
+        writer.queue.pop_front();
+        bool timeBlock = writer.timeBlocks;
+        lock.unlock();
+        __uint64 cpuBegin = timeBlock ? threadCpuNanos() : 0;
+        bool compressed = initialized && _compressBgzfBlock(block, strm, writer.level);
+        __uint64 cpuNanos = timeBlock ? threadCpuNanos() - cpuBegin : 0;
+        lock.lock();
+        writer.nCompressed += timeBlock;
+        writer.deflateCpuNanos += cpuNanos;
+        if (!compressed)
+        {
+            //Nothing is written for this block and close() reports the failure.
+            writer.failed = true;
+            block.blockSize = 0;
+        }
+        block.state = BGZF_BLOCK_COMPRESSED;
+        _writeCompressedBlocks(writer, lock);
+    }
+    if (initialized)
+        deflateEnd(&strm);
+}
+
+inline bool _startBgzfWriter(BgzfWriter & writer, unsigned numThreads, int level)
+{
+    writer.level = level;
+    writer.failed = false;
+    writer.stop = false;
+    writer.blocks = std::vector<BgzfBlock>(numThreads == 0 ? 1 : 4 * numThreads);
+    if (numThreads == 0)
+        return _initBgzfStream(writer.strm, level);
+    for (unsigned i = 0; i < numThreads; ++i)
+        writer.threads.push_back(std::thread(_bgzfWorker, std::ref(writer)));
+    return true;
+}
+
+//The path - writes to standard output.
+inline bool open(BgzfWriter & writer, char const * path, unsigned numThreads, int level)
+{
+    writer.file = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+    if (writer.file == NULL)
+        return false;
+    writer.nextSubmit = writer.nextWrite = 0;
+    writer.bytesWritten = 0;
+    writer.blockOffsets.clear();
+    return _startBgzfWriter(writer, numThreads, level);
+}
+
+//Goes on writing the BGZF file at path after its first offset bytes, which have to end with a whole block, and cuts off
+//the rest. With trackBlockOffsets the headers of the blocks that are kept are read for their offsets, and the blocks
+//written from now on are numbered after them.
+inline bool reopen(BgzfWriter & writer, char const * path, __uint64 offset, unsigned numThreads, int level)
+{
+    writer.file = fopen(path, "r+b");
+    if (writer.file == NULL)
+        return false;
+    std::vector<__uint64> blockOffsets;
+    bool kept = fseeko(writer.file, 0, SEEK_END) == 0 && ftello(writer.file) >= (off_t)offset;
+    for (__uint64 pos = 0; kept && writer.trackBlockOffsets && pos < offset; )
+    {
+        char header[BGZF_HEADER_BYTES];
+        __uint16 bsize = 0;
+        kept = fseeko(writer.file, pos, SEEK_SET) == 0 && fread(header, 1, BGZF_HEADER_BYTES, writer.file) == BGZF_HEADER_BYTES &&
+               memcmp(header, BGZF_BLOCK_HEADER, 4) == 0 && header[12] == 'B' && header[13] == 'C';
+        memcpy(&bsize, header + 16, 2);
+        blockOffsets.push_back(pos);
+        pos += bsize + 1;
+        kept = kept && pos <= offset;
+    }
+    if (!kept || ftruncate(fileno(writer.file), offset) != 0 || fseeko(writer.file, offset, SEEK_SET) != 0)
+    {
+        fclose(writer.file);
+        writer.file = NULL;
+        return false;
+    }
+    writer.nextSubmit = writer.nextWrite = blockOffsets.size();
+    writer.bytesWritten = offset;
+    writer.blockOffsets.swap(blockOffsets);
+    return _startBgzfWriter(writer, numThreads, level);
+}
+
+//Hands the block that is being filled to the workers and waits until the next slot of the ring is free.
+inline void _submitBgzfBlock(BgzfWriter & writer)
+{
+    std::unique_lock<std::mutex> lock(writer.mutex);
+    BgzfBlock & block = writer.blocks[writer.nextSubmit % writer.blocks.size()];
+    ++writer.nextSubmit;
+    if (writer.threads.empty())
+    {
+        __uint64 cpuBegin = writer.timeBlocks ? threadCpuNanos() : 0;
+        if (!_compressBgzfBlock(block, writer.strm, writer.level))
+        {
+            writer.failed = true;
+            block.blockSize = 0;
+        }
+        if (writer.timeBlocks)
+        {
+            ++writer.nCompressed;
+            writer.deflateCpuNanos += threadCpuNanos() - cpuBegin;
+        }
+        block.state = BGZF_BLOCK_COMPRESSED;
+        _writeCompressedBlocks(writer, lock);
+    }
+    else
+    {
+        block.state = BGZF_BLOCK_QUEUED;
+        writer.queue.push_back(writer.nextSubmit - 1);
+        writer.blockQueued.notify_one();
+    }
+    BgzfBlock & next = writer.blocks[writer.nextSubmit % writer.blocks.size()];
+    __uint64 waitBegin = writer.timeBlocks ? wallClockNanos() : 0;
+    writer.blockWritten.wait(lock, [&next]{ return next.state == BGZF_BLOCK_IDLE; });
+    if (writer.timeBlocks)
+        writer.submitWaitNanos += wallClockNanos() - waitBegin;
+}
+
+inline void writeData(BgzfWriter & writer, char const * data, size_t len)
+{
+    while (len != 0)
+    {
+        BgzfBlock & block = writer.blocks[writer.nextSubmit % writer.blocks.size()];
+        size_t n = std::min(len, (size_t)(BGZF_BLOCK_DATA_SIZE - block.dataSize));
+        memcpy(&block.data[block.dataSize], data, n);
+        block.dataSize += n;
+        data += n;
+        len -= n;
+        if (block.dataSize == BGZF_BLOCK_DATA_SIZE)
+            _submitBgzfBlock(writer);
+    }
+}
+
+//Virtual offset of the next byte written, with the sequence number of its block in place of the file offset, which is
+//not known before the blocks in front of it are compressed. fileOffset() translates it once the block is written.
+inline __uint64 tell(BgzfWriter & writer)
+{
+    return (__uint64)writer.nextSubmit << 16 | writer.blocks[writer.nextSubmit % writer.blocks.size()].dataSize;
+}
+
+//Virtual file offset of an offset returned by tell(). Needs trackBlockOffsets; the offset past the last block, such as
+//the end of the last record, is the offset of the end-of-file marker.
+inline __uint64 fileOffset(BgzfWriter const & writer, __uint64 offset)
+{
+    size_t block = offset >> 16;
+    __uint64 blockOffset = block < writer.blockOffsets.size() ? writer.blockOffsets[block] : writer.bytesWritten;
+    return blockOffset << 16 | (offset & 0xffff);
+}
+
+//Writes out the block that is being filled, however full it is, waits until all blocks are in the file and syncs it to
+//disk, so that bytesWritten bytes of the file survive a crash. Returns false if any block could not be compressed or
+//written.
+inline bool flush(BgzfWriter & writer)
+{
+    if (writer.blocks[writer.nextSubmit % writer.blocks.size()].dataSize != 0)
+        _submitBgzfBlock(writer);
+    {
+        std::unique_lock<std::mutex> lock(writer.mutex);
+        writer.blockWritten.wait(lock, [&writer]{ return writer.nextWrite == writer.nextSubmit; });
+    }
+    if (fflush(writer.file) != 0 || fsync(fileno(writer.file)) != 0)
+        writer.failed = true;
+    return !writer.failed;
+}
+
+//Writes a block that is compressed already, such as one of another BGZF file, after the data written so far. The block
+//being filled is written out first, however full it is.
+inline bool writeRawBlock(BgzfWriter & writer, char const * block, unsigned blockSize)
+{
+    if (writer.blocks[writer.nextSubmit % writer.blocks.size()].dataSize != 0)
+        _submitBgzfBlock(writer);
+    std::unique_lock<std::mutex> lock(writer.mutex);
+    writer.blockWritten.wait(lock, [&writer]{ return writer.nextWrite == writer.nextSubmit; });
+    if (fwrite(block, 1, blockSize, writer.file) != blockSize)
+        writer.failed = true;
+    if (writer.trackBlockOffsets)
+        writer.blockOffsets.push_back(writer.bytesWritten);
+    writer.bytesWritten += blockSize;
+    ++writer.nextSubmit;
+    ++writer.nextWrite;
+    return !writer.failed;
+}
+
+//Copies the blocks of the BGZF file at path from the file offset on as they are, without inflating them. Empty blocks,
+//such as the end-of-file marker, are left out. Returns false if the file cannot be read or holds no BGZF blocks.
+inline bool copyBgzfBlocks(BgzfWriter & writer, char const * path, __uint64 offset)
+{
+    FILE * file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    std::vector<char> block(BGZF_MAX_BLOCK_BYTES);
+    bool copied = fseeko(file, offset, SEEK_SET) == 0;
+    for (size_t n; copied && (n = fread(&block[0], 1, BGZF_HEADER_BYTES, file)) != 0; )
+    {
+        __uint16 bsize = 0;
+        __uint32 isize = 0;
+        memcpy(&bsize, &block[16], 2);
+        copied = n == BGZF_HEADER_BYTES && memcmp(&block[0], BGZF_BLOCK_HEADER, 4) == 0 && block[12] == 'B' && block[13] == 'C' &&
+                 bsize + 1u >= BGZF_HEADER_BYTES + BGZF_FOOTER_BYTES &&
+                 fread(&block[BGZF_HEADER_BYTES], 1, bsize + 1 - BGZF_HEADER_BYTES, file) == bsize + 1u - BGZF_HEADER_BYTES;
+        if (copied)
+            memcpy(&isize, &block[bsize + 1 - 4], 4);
+        if (copied && isize != 0)
+            copied = writeRawBlock(writer, &block[0], bsize + 1);
+    }
+    copied = copied && !ferror(file);
+    fclose(file);
+    return copied;
+}
+
+//Flushes the last block, waits for the workers and appends the BGZF end-of-file marker. Returns false if any block
+//could not be compressed or written.
+inline bool close(BgzfWriter & writer)
+{
+    if (writer.file == NULL)
+        return false;
+    if (writer.blocks[writer.nextSubmit % writer.blocks.size()].dataSize != 0)
+        _submitBgzfBlock(writer);
+    {
+        std::unique_lock<std::mutex> lock(writer.mutex);
+        writer.stop = true;
+        writer.blockQueued.notify_all();
+        writer.blockWritten.wait(lock, [&writer]{ return writer.nextWrite == writer.nextSubmit; });
+    }
+    if (writer.threads.empty())
+        deflateEnd(&writer.strm);
+    for (unsigned i = 0; i < writer.threads.size(); ++i)
+        writer.threads[i].join();
+    writer.threads.clear();
+    if (fwrite(BGZF_EOF_BLOCK, 1, sizeof(BGZF_EOF_BLOCK), writer.file) != sizeof(BGZF_EOF_BLOCK))
+        writer.failed = true;
+    if (fclose(writer.file) != 0)
+        writer.failed = true;
+    writer.file = NULL;
+    return !writer.failed;
+}
+
+inline BgzfWriter::~BgzfWriter()
+{
+    if (file != NULL)
+        close(*this);
+}
+
+struct BamIndexBuilder;
+
+//Drop-in replacement for the BamFileOut usage in bamShrink: records are encoded with the input file's context and
+//handed to a BgzfWriter with a configurable number of compression threads and compression level. If index is set, the
+//raw records written are added to it, see bam_index_writer.h.
+struct BamWriter {
+    BgzfWriter bgzf;
+    seqan::BamFileIn::TDependentContext * context = NULL;
+    seqan::CharString buffer;
+    BamIndexBuilder * index = NULL;
+} ;
+
+inline bool open(BamWriter & writer, char const * path, seqan::BamFileIn::TDependentContext & context, unsigned numThreads, int level)
+{
+    writer.context = &context;
+    return open(writer.bgzf, path, numThreads, level);
+}
+
+//Goes on writing the BAM file at path after its first offset bytes, see reopen() of BgzfWriter. The header is not
+//written again.
+inline bool reopen(BamWriter & writer, char const * path, seqan::BamFileIn::TDependentContext & context, __uint64 offset, unsigned numThreads, int level)
+{
+    writer.context = &context;
+    return reopen(writer.bgzf, path, offset, numThreads, level);
+}
+
+inline seqan::BamFileIn::TDependentContext & context(BamWriter & writer)
+{
+    return *writer.context;
+}
+
+inline void writeHeader(BamWriter & writer, seqan::BamHeader const & header)
+{
+    seqan::clear(writer.buffer);
+    seqan::write(writer.buffer, header, *writer.context, seqan::Bam());
+    writeData(writer.bgzf, seqan::begin(writer.buffer, seqan::Standard()), seqan::length(writer.buffer));
+}
+
+inline void writeRecord(BamWriter & writer, seqan::BamAlignmentRecord const & record)
+{
+    seqan::clear(writer.buffer);
+    seqan::write(writer.buffer, record, *writer.context, seqan::Bam());
+    writeData(writer.bgzf, seqan::begin(writer.buffer, seqan::Standard()), seqan::length(writer.buffer));
+}
+
+inline bool close(BamWriter & writer)
+{
+    return close(writer.bgzf);
+}
+
+#endif  // BAMSHRINK_BGZF_WRITER_H_
@@ -0,0 +1,212 @@
+#ifndef BAMSHRINK_CHECKPOINT_H_
+#define BAMSHRINK_CHECKPOINT_H_
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <seqan/sequence.h>
+#include "bam_raw_record.h"
+#include "read_names.h"
+
+//State of a whole genome run from which it can be resumed: the offsets to go on from, the read numbering and the
+//counters. A checkpoint taken inside a contig also keeps what the filter holds of that contig, the reads waiting to be
+//written, the mate and adapter tables and the coverage window, packed with putState(). The names that the namer keeps
+//numbers for only grow; they are not written into the checkpoint but appended to a file of their own, of which the
+//checkpoint holds how much belongs to it.
+struct Checkpoint {
+    //The arguments of the run, which the resumed run has to be given as well.
+    std::string args;
+    //The contig to go on with and the virtual offset of its first record in the input, if the input is read in one pass.
+    unsigned nextItem = 0;
+    __uint64 inputOffset = (__uint64)-1;
+    //Bytes of the output that are kept.
+    __uint64 outputOffset = 0;
+    //The next read number, and the number of names and bytes of the names file that belong to the checkpoint.
+    unsigned nextName = 0;
+    __uint64 nNames = 0;
+    __uint64 namesBytes = 0;
+    std::vector<__uint64> counters;
+    //The state of the contig the record at inputOffset belongs to, empty between two contigs.
+    std::string contigState;
+} ;
+
+const char CHECKPOINT_MAGIC[] = "bamShrink checkpoint 2";
+
+//Values are packed as their bytes in memory, a checkpoint is only resumed by the same program on the same machine.
+template <typename TValue>
+inline void putState(std::string & state, TValue const & value)
+{
+    state.append((char const *)&value, sizeof(TValue));
+}
+
+inline void putStateBytes(std::string & state, char const * bytes, size_t length)
+{
+    putState(state, (__uint64)length);
+    state.append(bytes, length);
+}
+
+inline void putState(std::string & state, seqan::CharString const & text)
+{
+    putStateBytes(state, seqan::begin(text, seqan::Standard()), seqan::length(text));
+}
+
+inline void putState(std::string & state, BamRawRecord const & record)
+{
+    putState(state, static_cast<seqan::BamAlignmentRecordCore const &>(record));
+    putState(state, record.qName);
+    putState(state, record.data);
+}
+
+//Unpacks a value packed with putState() at pos and moves pos past it. Returns false if the state ends before it.
+template <typename TValue>
+inline bool takeState(TValue & value, std::string const & state, size_t & pos)
+{
+    if (state.size() - pos < sizeof(TValue))
+        return false;
+    memcpy((void *)&value, state.data() + pos, sizeof(TValue));
+    pos += sizeof(TValue);
+    return true;
+}
+
+inline bool takeState(seqan::CharString & text, std::string const & state, size_t & pos)
+{
+    __uint64 length = 0;
+    if (!takeState(length, state, pos) || state.size() - pos < length)
+        return false;
+    seqan::resize(text, length);
+    memcpy(seqan::begin(text, seqan::Standard()), state.data() + pos, length);
+    pos += length;
+    return true;
+}
+
+inline bool takeState(BamRawRecord & record, std::string const & state, size_t & pos)
+{
+    return takeState(static_cast<seqan::BamAlignmentRecordCore &>(record), state, pos) && takeState(record.qName, state, pos) &&
+           takeState(record.data, state, pos);
+}
+
+//Writes the checkpoint next to path and renames it to path once it is on disk, so path always holds a whole checkpoint.
+inline bool writeCheckpoint(Checkpoint const & checkpoint, char const * path)
+{
+    std::string tmpPath = std::string(path) + ".tmp";
+    FILE * file = fopen(tmpPath.c_str(), "wb");
+    if (file == NULL)
+        return false;
+    fprintf(file, "%s\nargs %s\n", CHECKPOINT_MAGIC, checkpoint.args.c_str());
+    fprintf(file, "next_item %u\ninput_offset %llu\noutput_offset %llu\n", checkpoint.nextItem,
+            (unsigned long long)checkpoint.inputOffset, (unsigned long long)checkpoint.outputOffset);
+    fprintf(file, "names %u %llu %llu\ncounters", checkpoint.nextName, (unsigned long long)checkpoint.nNames,
+            (unsigned long long)checkpoint.namesBytes);
+    for (unsigned i = 0; i < checkpoint.counters.size(); ++i)
+        fprintf(file, " %llu", (unsigned long long)checkpoint.counters[i]);
+    fprintf(file, "\ncontig_state %llu\n", (unsigned long long)checkpoint.contigState.size());
+    fwrite(checkpoint.contigState.data(), 1, checkpoint.contigState.size(), file);
+    bool written = !ferror(file) && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    if (fclose(file) != 0 || !written || rename(tmpPath.c_str(), path) != 0)
+    {
+        remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+inline bool _readCheckpointLine(std::string & line, FILE * file)
+{
+    line.clear();
+    for (int c = fgetc(file); c != EOF && c != '\n'; c = fgetc(file))
+        line += (char)c;
+    return !ferror(file) && !feof(file);
+}
+
+inline bool readCheckpoint(Checkpoint & checkpoint, char const * path)
+{
+    FILE * file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    std::string line;
+    unsigned long long inputOffset = 0, outputOffset = 0, nNames = 0, namesBytes = 0, stateBytes = 0;
+    bool valid = _readCheckpointLine(line, file) && line == CHECKPOINT_MAGIC &&
+                 _readCheckpointLine(line, file) && line.compare(0, 5, "args ") == 0;
+    if (valid)
+        checkpoint.args = line.substr(5);
+    valid = valid && fscanf(file, "next_item %u\ninput_offset %llu\noutput_offset %llu\n", &checkpoint.nextItem, &inputOffset, &outputOffset) == 3 &&
+            fscanf(file, "names %u %llu %llu\n", &checkpoint.nextName, &nNames, &namesBytes) == 3 &&
+            _readCheckpointLine(line, file) && line.compare(0, 8, "counters") == 0;
+    //The packed state follows its line directly, so nothing after the number is skipped but the newline.
+    valid = valid && fscanf(file, "contig_state %llu", &stateBytes) == 1 && fgetc(file) == '\n';
+    if (valid)
+    {
+        checkpoint.contigState.resize(stateBytes);
+        valid = fread(&checkpoint.contigState[0], 1, stateBytes, file) == stateBytes;
+    }
+    fclose(file);
+    if (!valid)
+        return false;
+    checkpoint.inputOffset = inputOffset;
+    checkpoint.outputOffset = outputOffset;
+    checkpoint.nNames = nNames;
+    checkpoint.namesBytes = namesBytes;
+    checkpoint.counters.clear();
+    char const * p = line.c_str() + 8;
+    char * end = NULL;
+    for (__uint64 value = strtoull(p, &end, 10); end != p; value = strtoull(p, &end, 10))
+    {
+        checkpoint.counters.push_back(value);
+        p = end;
+    }
+    return true;
+}
+
+//Appends the names numbered since the last checkpoint to the names file, one "NAME ITEM NUMBER" line each, and syncs it.
+//Names are never erased from the namer, so its entries are in the order the names were numbered in.
+inline bool appendCheckpointNames(Checkpoint & checkpoint, FILE * file, ReadNamer const & namer)
+{
+    typedef ReadNameTable<seqan::Pair<unsigned> > TNumbers;
+    TNumbers const & numbers = namer.numbers;
+    for (; checkpoint.nNames < numbers.entries.size(); ++checkpoint.nNames)
+    {
+        TNumbers::Entry const & entry = numbers.entries[checkpoint.nNames];
+        fwrite(&numbers.arena[entry.nameBegin], 1, entry.nameLength, file);
+        fprintf(file, " %u %u\n", entry.value.i1, entry.value.i2);
+    }
+    if (ferror(file) || fflush(file) != 0 || fsync(fileno(file)) != 0)
+        return false;
+    checkpoint.namesBytes = ftello(file);
+    return true;
+}
+
+//Opens the names file at path. A resumed run reads the names of the checkpoint back into the namer and cuts off the
+//names that were appended after it.
+inline FILE * openCheckpointNames(char const * path, bool resume, Checkpoint const & checkpoint, ReadNamer & namer)
+{
+    FILE * file = fopen(path, resume ? "r+b" : "w+b");
+    if (file == NULL || !resume)
+        return file;
+    std::string line;
+    seqan::CharString name;
+    for (__uint64 i = 0; i < checkpoint.nNames; ++i)
+    {
+        unsigned item = 0, number = 0;
+        size_t space = std::string::npos;
+        if (!_readCheckpointLine(line, file) || (space = line.find(' ')) == std::string::npos ||
+            sscanf(line.c_str() + space, " %u %u", &item, &number) != 2)
+        {
+            fclose(file);
+            return NULL;
+        }
+        name = line.substr(0, space);
+        entryValue(namer.numbers, insertName(namer.numbers, name)) = seqan::Pair<unsigned>(item, number);
+    }
+    namer.next = checkpoint.nextName;
+    if (ftello(file) != (off_t)checkpoint.namesBytes || ftruncate(fileno(file), checkpoint.namesBytes) != 0 ||
+        fseeko(file, checkpoint.namesBytes, SEEK_SET) != 0)
+    {
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+#endif  // BAMSHRINK_CHECKPOINT_H_
@@ -0,0 +1,137 @@
+#ifndef BAMSHRINK_COVERAGE_ESTIMATE_H_
+#define BAMSHRINK_COVERAGE_ESTIMATE_H_
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "bgzf_reader.h"
+#include "bam_raw_record.h"
+#include "bam_index_writer.h"
+#include "fetch_plan.h"
+
+//The coverage filter needs the average number of reads per reference base, which avgCovByReadLen.sh gets from samtools
+//idxstats. The same counts are in the BAI, so they are read from there instead.
+
+//Reads the number of reads placed on each reference, mapped and unmapped, from the pseudo-bins of a BAI. A reference
+//without a pseudo-bin counts as empty, as in samtools idxstats. Returns false if the file is not a BAI or is cut short.
+inline bool readBaiReadCounts(std::vector<__uint64> & counts, char const * path)
+{
+    FILE * file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    std::vector<char> bai;
+    char buffer[1 << 16];
+    for (size_t n; (n = fread(buffer, 1, sizeof(buffer), file)) > 0; )
+        bai.insert(bai.end(), buffer, buffer + n);
+    fclose(file);
+
+    if (bai.size() < 4 || memcmp(&bai[0], "BAI\1", 4) != 0)
+        return false;
+    size_t pos = 4;
+    auto read32 = [&](__uint32 & value)
+    {
+        if (bai.size() - pos < 4)
+            return false;
+        memcpy(&value, &bai[pos], 4);
+        pos += 4;
+        return true;
+    };
+    __uint32 nRef = 0;
+    if (!read32(nRef))
+        return false;
+    counts.assign(nRef, 0);
+    for (__uint32 ref = 0; ref < nRef; ++ref)
+    {
+        __uint32 nBin = 0;
+        if (!read32(nBin))
+            return false;
+        for (__uint32 b = 0; b < nBin; ++b)
+        {
+            __uint32 bin = 0, nChunk = 0;
+            if (!read32(bin) || !read32(nChunk) || (bai.size() - pos) / 16 < nChunk)
+                return false;
+            if (bin == BAI_PSEUDO_BIN && nChunk == 2)
+            {
+                __uint64 nMapped = 0, nUnmapped = 0;
+                memcpy(&nMapped, &bai[pos + 16], 8);
+                memcpy(&nUnmapped, &bai[pos + 24], 8);
+                counts[ref] = nMapped + nUnmapped;
+            }
+            pos += 16 * (size_t)nChunk;
+        }
+        __uint32 nIntv = 0;
+        if (!read32(nIntv) || (bai.size() - pos) / 8 < nIntv)
+            return false;
+        pos += 8 * (size_t)nIntv;
+    }
+    return true;
+}
+
+//Reads per base over the whole genome, the value avgCovByReadLen.sh prints.
+template <typename TLengths>
+inline double averageReadsPerBase(std::vector<__uint64> const & counts, TLengths const & contigLengths)
+{
+    __uint64 nReads = 0, nBases = 0;
+    for (unsigned i = 0; i < counts.size(); ++i)
+        nReads += counts[i];
+    for (unsigned i = 0; i < seqan::length(contigLengths); ++i)
+        nBases += contigLengths[i];
+    return nBases == 0 ? 0.0 : (double)nReads / (double)nBases;
+}
+
+//Reads per base of every contig on its own.
+template <typename TLengths>
+inline std::vector<double> contigReadsPerBase(std::vector<__uint64> const & counts, TLengths const & contigLengths)
+{
+    std::vector<double> readsPerBase(seqan::length(contigLengths), 0.0);
+    for (unsigned i = 0; i < readsPerBase.size() && i < counts.size(); ++i)
+        if (contigLengths[i] > 0)
+            readsPerBase[i] = (double)counts[i] / (double)contigLengths[i];
+    return readsPerBase;
+}
+
+//Contigs [begin, end) of shard i (from 0) of nShards. The contigs are split in header order into runs with about the
+//same number of reads: a contig goes to the shard that the middle of its reads falls into.
+inline seqan::Pair<unsigned> shardContigs(std::vector<__uint64> const & counts, unsigned i, unsigned nShards)
+{
+    __uint64 nReads = 0, before = 0;
+    for (unsigned c = 0; c < counts.size(); ++c)
+        nReads += counts[c];
+    seqan::Pair<unsigned> contigs(0, counts.size());
+    for (unsigned c = 0; c < counts.size(); ++c)
+    {
+        unsigned shard = nReads == 0 ? 0 : std::min(nShards - 1, (unsigned)(((before + counts[c] / 2.0) * nShards) / nReads));
+        if (shard < i)
+            contigs.i1 = c + 1;
+        else if (shard > i && contigs.i2 == counts.size())
+            contigs.i2 = c;
+        before += counts[c];
+    }
+    contigs.i2 = std::max(contigs.i1, contigs.i2);
+    return contigs;
+}
+
+//Reads per base starting in [beginPos, endPos) of the reference rID, counted in a pre-scan that reads only the fixed
+//size fields of the records. The blocks it reads stay in the history of the reader for the filter pass. Returns a
+//negative value if the region is empty or the reference is not in the index.
+inline double regionReadsPerBase(BamReader & reader, seqan::BamIndex<seqan::Bai> const & index, __int32 rID, __int32 beginPos, __int32 endPos)
+{
+    if (endPos <= beginPos || rID < 0 || static_cast<unsigned>(rID) >= seqan::length(index._binIndices))
+        return -1.0;
+    FetchPlan plan;
+    planFetch(plan, index, rID, beginPos, endPos);
+    __uint64 nReads = 0;
+    seqan::BamAlignmentRecordCore core;
+    while (nextPlannedRecord(reader, plan))
+    {
+        readRecordCore(core, reader);
+        if (core.rID != rID || core.beginPos >= endPos)
+            break;
+        if (core.beginPos >= beginPos)
+            ++nReads;
+    }
+    return (double)nReads / (double)(endPos - beginPos);
+}
+
+#endif  // BAMSHRINK_COVERAGE_ESTIMATE_H_
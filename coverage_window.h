@@ -0,0 +1,87 @@
+#ifndef BAMSHRINK_COVERAGE_WINDOW_H_
+#define BAMSHRINK_COVERAGE_WINDOW_H_
+
+#include <vector>
+
+//Number of reads starting at each of the last `size` positions, kept in a ring indexed by position together with their
+//sum. A read is rejected when the sum goes over maxSum. Moving more than the window size ahead clears the window in
+//constant time: slots carry the epoch they were written in and older slots count as empty.
+struct CoverageWindow {
+    std::vector<int> counts;
+    std::vector<unsigned> epochs;
+    unsigned epoch = 0;
+    unsigned pos = 0;
+    int sum = 0;
+    double maxSum = 0.0;
+
+    CoverageWindow() {}
+    CoverageWindow(unsigned size, double maxSum_) : counts(size == 0 ? 1 : size, 0), epochs(counts.size(), 0), maxSum(maxSum_) {}
+} ;
+
+inline void clear(CoverageWindow & window)
+{
+    ++window.epoch;
+    window.pos = 0;
+    window.sum = 0;
+}
+
+inline int & _slot(CoverageWindow & window, unsigned pos)
+{
+    unsigned i = pos % window.counts.size();
+    if (window.epochs[i] != window.epoch)
+    {
+        window.epochs[i] = window.epoch;
+        window.counts[i] = 0;
+    }
+    return window.counts[i];
+}
+
+//Number of reads counted at pos, one of the positions in the window.
+inline int countAt(CoverageWindow const & window, unsigned pos)
+{
+    unsigned i = pos % window.counts.size();
+    return window.epochs[i] == window.epoch ? window.counts[i] : 0;
+}
+
+//Takes back the last read counted by addRead().
+inline void removeRead(CoverageWindow & window)
+{
+    --_slot(window, window.pos);
+    --window.sum;
+}
+
+//Counts a read starting at pos, which is not before the previous read unless the window is cleared. Returns false if
+//the window is over its limit; the read is not counted then.
+inline bool addRead(CoverageWindow & window, unsigned pos)
+{
+    if (pos != window.pos)
+    {
+        unsigned gap = pos - window.pos;
+        if (gap >= window.counts.size())
+        {
+            ++window.epoch;
+            window.sum = 0;
+        }
+        else
+        {
+            //The slots of the positions moved over still hold the counts of the positions that leave the window.
+            for (unsigned k = 1; k <= gap; ++k)
+            {
+                int & count = _slot(window, window.pos + k);
+                window.sum -= count;
+                count = 0;
+            }
+        }
+        window.pos = pos;
+    }
+    ++_slot(window, pos);
+    ++window.sum;
+    if (window.sum > window.maxSum)
+    {
+        removeRead(window);
+        return false;
+    }
+    return true;
+}
+
+#endif  // BAMSHRINK_COVERAGE_WINDOW_H_
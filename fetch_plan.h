@@ -0,0 +1,103 @@
+#ifndef BAMSHRINK_FETCH_PLAN_H_
+#define BAMSHRINK_FETCH_PLAN_H_
+
+#include <algorithm>
+#include <vector>
+#include <seqan/bam_io.h>
+#include "bgzf_reader.h"
+
+//The parts of a BAM file that hold the records of a region, taken from the chunks of its BAI bins. Chunks that overlap
+//or meet in one BGZF block are merged into one range, and the ranges are read in file order, so every block is read
+//and inflated at most once and a seek is only needed where the ranges leave a gap.
+
+struct FetchRange {
+    __uint64 begin;
+    __uint64 end;
+} ;
+
+struct FetchPlan {
+    std::vector<FetchRange> ranges;
+    unsigned next = 0;
+    bool positioned = false;
+} ;
+
+inline bool _fetchRangeLess(FetchRange const & left, FetchRange const & right)
+{
+    return left.begin < right.begin;
+}
+
+//Plans reading the records that overlap [pos, posEnd) of the reference refId. Chunks that end before the linear index
+//offset of pos only hold records ending before pos and are left out. The plan is empty if no record can overlap.
+inline void planFetch(FetchPlan & plan, seqan::BamIndex<seqan::Bai> const & index, __int32 refId, __int32 pos, __int32 posEnd)
+{
+    plan.ranges.clear();
+    plan.next = 0;
+    plan.positioned = false;
+    if (refId < 0 || static_cast<unsigned>(refId) >= seqan::length(index._binIndices) || posEnd <= pos)
+        return;
+
+    seqan::String<__uint16> candidateBins;
+    seqan::_baiReg2bins(candidateBins, pos, posEnd);
+    __uint64 linearMinOffset = linearIndexOffset(index, refId, pos);
+    for (unsigned i = 0; i < seqan::length(candidateBins); ++i)
+    {
+        std::map<__uint32, seqan::BaiBamIndexBinData_>::const_iterator mIt = index._binIndices[refId].find(candidateBins[i]);
+        if (mIt == index._binIndices[refId].end())
+            continue;
+        for (unsigned j = 0; j < seqan::length(mIt->second.chunkBegEnds); ++j)
+        {
+            FetchRange range = {std::max((__uint64)mIt->second.chunkBegEnds[j].i1, linearMinOffset), mIt->second.chunkBegEnds[j].i2};
+            if (range.begin < range.end)
+                plan.ranges.push_back(range);
+        }
+    }
+
+    std::sort(plan.ranges.begin(), plan.ranges.end(), _fetchRangeLess);
+    unsigned n = 0;
+    for (unsigned i = 0; i < plan.ranges.size(); ++i)
+    {
+        FetchRange range = plan.ranges[i];
+        if (n > 0 && range.begin >> 16 <= plan.ranges[n - 1].end >> 16)
+            plan.ranges[n - 1].end = std::max(plan.ranges[n - 1].end, range.end);
+        else
+            plan.ranges[n++] = range;
+    }
+    plan.ranges.resize(n);
+}
+
+inline bool empty(FetchPlan const & plan)
+{
+    return plan.ranges.empty();
+}
+
+//Moves the reader to the next record of the plan, seeking only where a range does not start at the current offset.
+//Returns false once all ranges are read. The read-ahead stops at the end of each range.
+inline bool nextPlannedRecord(BamReader & reader, FetchPlan & plan)
+{
+    while (plan.next < plan.ranges.size())
+    {
+        FetchRange const & range = plan.ranges[plan.next];
+        if (!plan.positioned)
+        {
+            countRangeRead(reader.bgzf, range.begin, range.end);
+            setReadLimit(reader.bgzf, range.end);
+            if (tell(reader.bgzf) != range.begin && !seek(reader.bgzf, range.begin))
+                throw seqan::IOError("Could not seek to a chunk of the BAI index.");
+            plan.positioned = true;
+        }
+        if (tell(reader.bgzf) < range.end && !atEnd(reader))
+            return true;
+        ++plan.next;
+        plan.positioned = false;
+    }
+    return false;
+}
+
+//Starts reading the blocks of a plan that is read later, while the reader works on something else.
+inline void prefetch(BamReader & reader, FetchPlan const & plan)
+{
+    for (unsigned i = 0; i < plan.ranges.size(); ++i)
+        prefetch(reader.bgzf, plan.ranges[i].begin, plan.ranges[i].end);
+}
+
+#endif  // BAMSHRINK_FETCH_PLAN_H_
@@ -0,0 +1,193 @@
+#ifndef BAMSHRINK_QUALITY_BINNING_H_
+#define BAMSHRINK_QUALITY_BINNING_H_
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sstream>
+#include <utility>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BAMSHRINK_X86_SIMD 1
+#endif
+
+enum QualityBinningMode
+{
+    QUALITY_BINS,
+    QUALITY_KEEP,
+    QUALITY_DROP
+};
+
+const unsigned MAX_QUALITY_BINS = 16;
+const int MAX_QUALITY = 93;
+
+//Maps a quality to the value of the last bin whose lower bound it reaches, or to lowest if it is below all bounds.
+//Qualities are read like SeqAn decodes them: the phred+33 character as a signed char, minus 33. Bytes above 94 in the
+//BAM record, including the 0xff of missing qualities, therefore count as negative and go to lowest.
+struct QualityBinning {
+    QualityBinningMode mode = QUALITY_BINS;
+    int lowest = 0;
+    std::vector<std::pair<int, int> > bins;
+    unsigned char table[256];
+} ;
+
+inline void _fillQualityTable(QualityBinning & binning)
+{
+    for (unsigned q = 0; q < 256; ++q)
+    {
+        int quality = (signed char)(q + 33) - 33;
+        int value = binning.lowest;
+        for (unsigned i = 0; i < binning.bins.size(); ++i)
+            if (quality >= binning.bins[i].first)
+                value = binning.bins[i].second;
+        binning.table[q] = value;
+    }
+}
+
+//Reads a scheme name (binary, illumina8, illumina4, keep or drop) or a list of bins as LOWER:VALUE,LOWER:VALUE,...
+//with increasing lower bounds. Returns false if the scheme is not valid.
+inline bool parseQualityBinning(QualityBinning & binning, std::string const & scheme)
+{
+    binning = QualityBinning();
+    std::string bins = scheme;
+    if (scheme == "keep" || scheme == "drop")
+    {
+        binning.mode = scheme == "keep" ? QUALITY_KEEP : QUALITY_DROP;
+        return true;
+    }
+    if (scheme == "binary")
+        bins = "0:0,25:40";
+    else if (scheme == "illumina8")
+        bins = "0:0,2:6,10:15,20:22,25:27,30:33,35:37,40:40";
+    else if (scheme == "illumina4")
+        bins = "0:2,3:12,15:23,31:37";
+    std::stringstream ss(bins);
+    std::string bin;
+    while (std::getline(ss, bin, ','))
+    {
+        char * end = NULL;
+        long lower = strtol(bin.c_str(), &end, 10);
+        if (end == bin.c_str() || *end != ':')
+            return false;
+        char const * valueBegin = end + 1;
+        long value = strtol(valueBegin, &end, 10);
+        if (end == valueBegin || *end != '\0')
+            return false;
+        if (lower < 0 || lower > MAX_QUALITY || value < 0 || value > MAX_QUALITY)
+            return false;
+        if (!binning.bins.empty() && lower <= binning.bins.back().first)
+            return false;
+        binning.bins.push_back(std::make_pair((int)lower, (int)value));
+    }
+    if (binning.bins.empty() || binning.bins.size() > MAX_QUALITY_BINS)
+        return false;
+    //The first bin starting at 0 also takes the qualities that decode as negative.
+    if (binning.bins[0].first == 0)
+        binning.lowest = binning.bins[0].second;
+    _fillQualityTable(binning);
+    return true;
+}
+
+//Bins len qualities in place. With ascii the qualities are phred+33 characters, otherwise BAM encoded phred values.
+inline void _binQualitiesScalar(char * qual, size_t len, QualityBinning const & binning, bool ascii)
+{
+    int offset = ascii ? 33 : 0;
+    for (size_t i = 0; i < len; ++i)
+        qual[i] = binning.table[(unsigned char)(qual[i] - offset)] + offset;
+}
+
+#ifdef BAMSHRINK_X86_SIMD
+//The vector kernels compare the quality plus 33 as signed bytes against every lower bound and blend in the bin values,
+//which gives the same result as the table.
+inline size_t _binQualitiesSse2(char * qual, size_t len, QualityBinning const & binning, bool ascii)
+{
+    char offset = ascii ? 33 : 0;
+    __m128i toSigned = _mm_set1_epi8(33 - offset);
+    __m128i lowest = _mm_set1_epi8(binning.lowest + offset);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i q = _mm_add_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const *>(qual + i)), toSigned);
+        __m128i result = lowest;
+        for (unsigned b = 0; b < binning.bins.size(); ++b)
+        {
+            __m128i reached = _mm_cmpgt_epi8(q, _mm_set1_epi8(binning.bins[b].first + 32));
+            __m128i value = _mm_set1_epi8(binning.bins[b].second + offset);
+            result = _mm_or_si128(_mm_and_si128(reached, value), _mm_andnot_si128(reached, result));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(qual + i), result);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+inline size_t _binQualitiesAvx2(char * qual, size_t len, QualityBinning const & binning, bool ascii)
+{
+    char offset = ascii ? 33 : 0;
+    __m256i toSigned = _mm256_set1_epi8(33 - offset);
+    __m256i lowest = _mm256_set1_epi8(binning.lowest + offset);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i q = _mm256_add_epi8(_mm256_loadu_si256(reinterpret_cast<__m256i const *>(qual + i)), toSigned);
+        __m256i result = lowest;
+        for (unsigned b = 0; b < binning.bins.size(); ++b)
+        {
+            __m256i reached = _mm256_cmpgt_epi8(q, _mm256_set1_epi8(binning.bins[b].first + 32));
+            __m256i value = _mm256_set1_epi8(binning.bins[b].second + offset);
+            result = _mm256_blendv_epi8(result, value, reached);
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(qual + i), result);
+    }
+    return i;
+}
+#endif
+
+typedef size_t (*TQualityKernel)(char *, size_t, QualityBinning const &, bool);
+
+inline size_t _binQualitiesNone(char *, size_t, QualityBinning const &, bool)
+{
+    return 0;
+}
+
+//Picks the widest kernel the CPU supports, once. BAMSHRINK_QUALITY_KERNEL=avx2, sse2 or scalar overrides the choice.
+inline TQualityKernel _qualityKernel()
+{
+    static TQualityKernel kernel = []() -> TQualityKernel
+    {
+        char const * forced = getenv("BAMSHRINK_QUALITY_KERNEL");
+        std::string name = forced == NULL ? "" : forced;
+        if (name == "scalar")
+            return _binQualitiesNone;
+#ifdef BAMSHRINK_X86_SIMD
+        if (name != "sse2" && __builtin_cpu_supports("avx2"))
+            return _binQualitiesAvx2;
+        return _binQualitiesSse2;
+#else
+        return _binQualitiesNone;
+#endif
+    }();
+    return kernel;
+}
+
+inline char const * qualityKernelName()
+{
+    TQualityKernel kernel = _qualityKernel();
+#ifdef BAMSHRINK_X86_SIMD
+    if (kernel == _binQualitiesAvx2)
+        return "avx2";
+    if (kernel == _binQualitiesSse2)
+        return "sse2";
+#endif
+    return "scalar";
+}
+
+//Bins the qualities with the vector kernel and finishes the tail with the table.
+inline void binQualities(char * qual, size_t len, QualityBinning const & binning, bool ascii)
+{
+    size_t done = _qualityKernel()(qual, len, binning, ascii);
+    _binQualitiesScalar(qual + done, len - done, binning, ascii);
+}
+
+#endif  // BAMSHRINK_QUALITY_BINNING_H_
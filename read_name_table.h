@@ -0,0 +1,331 @@
+#ifndef BAMSHRINK_READ_NAME_TABLE_H_
+#define BAMSHRINK_READ_NAME_TABLE_H_
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include <functional>
+#include <seqan/sequence.h>
+
+const unsigned READ_NAME_NONE = ~0u;
+const unsigned READ_NAME_TOMBSTONE = ~0u - 1;
+const __int64 READ_NAME_NO_EXPIRY = 0x7fffffffffffffffll;
+
+//Position after which an entry may be dropped. serial tells apart entries that reuse the same handle.
+struct ReadNameExpiry {
+    __int64 pos;
+    unsigned handle;
+    size_t serial;
+
+    bool operator>(ReadNameExpiry const & other) const
+    {
+        return pos > other.pos;
+    }
+} ;
+
+//Hash table from read names to values. Slots are probed linearly and hold the 64-bit hash of the name next to the
+//index of its entry, so most probes never touch the name itself; the hash is only confirmed by comparing the name
+//bytes, which are kept back to back in one arena. Entries stay where they are when the slots are rebuilt, so the index
+//of an entry is a handle that can be kept and used instead of looking the name up again. A handle stays valid until
+//the entry is erased; references to values do not survive inserting other names. Entries can be given an expiry
+//position and are then dropped by evictExpired() once the caller has moved past it. The expiries are a heap in which
+//erased entries and replaced expiries leave stale items; once those are more than half of it they are dropped.
+template <typename TValue>
+struct ReadNameTable {
+    struct Slot {
+        __uint64 hash;
+        unsigned entry;
+    } ;
+
+    struct Entry {
+        __uint64 hash;
+        size_t nameBegin;
+        unsigned nameLength;
+        bool erased;
+        size_t serial;
+        __int64 expiry;
+        TValue value;
+    } ;
+
+    std::vector<Slot> slots;
+    std::vector<Entry> entries;
+    std::vector<unsigned> freeEntries;
+    std::vector<char> arena;
+    size_t deadBytes = 0;
+    size_t size = 0;
+    size_t tombstones = 0;
+    size_t nextSerial = 0;
+    size_t maxSize = 0;
+    std::vector<ReadNameExpiry> expiries;
+    size_t staleExpiries = 0;
+} ;
+
+//64-bit hash of a read name, read eight bytes at a time.
+inline __uint64 hashReadName(char const * name, size_t len)
+{
+    const __uint64 m = 0x9E3779B97F4A7C15ull;
+    __uint64 h = len * m;
+    for (; len >= 8; name += 8, len -= 8)
+    {
+        __uint64 k;
+        memcpy(&k, name, 8);
+        h = (h ^ (k * m)) * m;
+        h ^= h >> 29;
+    }
+    __uint64 k = 0;
+    memcpy(&k, name, len);
+    h = (h ^ k) * m;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+template <typename TValue>
+inline bool _sameName(ReadNameTable<TValue> const & table, typename ReadNameTable<TValue>::Entry const & entry, char const * name, size_t len)
+{
+    return entry.nameLength == len && memcmp(table.arena.data() + entry.nameBegin, name, len) == 0;
+}
+
+//Builds the slots anew with the given power of two capacity, dropping tombstones. Names of erased entries are removed
+//from the arena when they take up more than half of it.
+template <typename TValue>
+inline void _rehash(ReadNameTable<TValue> & table, size_t capacity)
+{
+    if (table.deadBytes * 2 > table.arena.size())
+    {
+        std::vector<char> arena;
+        arena.reserve(table.arena.size() - table.deadBytes);
+        for (unsigned i = 0; i < table.entries.size(); ++i)
+        {
+            typename ReadNameTable<TValue>::Entry & entry = table.entries[i];
+            if (entry.erased)
+                continue;
+            size_t nameBegin = arena.size();
+            arena.insert(arena.end(), table.arena.begin() + entry.nameBegin, table.arena.begin() + entry.nameBegin + entry.nameLength);
+            entry.nameBegin = nameBegin;
+        }
+        table.arena.swap(arena);
+        table.deadBytes = 0;
+    }
+    typename ReadNameTable<TValue>::Slot empty = {0, READ_NAME_NONE};
+    table.slots.assign(capacity, empty);
+    table.tombstones = 0;
+    for (unsigned i = 0; i < table.entries.size(); ++i)
+    {
+        typename ReadNameTable<TValue>::Entry const & entry = table.entries[i];
+        if (entry.erased)
+            continue;
+        size_t s = entry.hash & (capacity - 1);
+        while (table.slots[s].entry != READ_NAME_NONE)
+            s = (s + 1) & (capacity - 1);
+        table.slots[s].hash = entry.hash;
+        table.slots[s].entry = i;
+    }
+}
+
+//Returns the slot holding the name, or the free slot where it would go (READ_NAME_NONE entry).
+template <typename TValue>
+inline size_t _findSlot(ReadNameTable<TValue> const & table, __uint64 hash, char const * name, size_t len)
+{
+    size_t mask = table.slots.size() - 1;
+    size_t freeSlot = (size_t)-1;
+    for (size_t s = hash & mask; ; s = (s + 1) & mask)
+    {
+        typename ReadNameTable<TValue>::Slot const & slot = table.slots[s];
+        if (slot.entry == READ_NAME_NONE)
+            return freeSlot == (size_t)-1 ? s : freeSlot;
+        if (slot.entry == READ_NAME_TOMBSTONE)
+        {
+            if (freeSlot == (size_t)-1)
+                freeSlot = s;
+        }
+        else if (slot.hash == hash && _sameName(table, table.entries[slot.entry], name, len))
+            return s;
+    }
+}
+
+//Returns the handle of the name, or READ_NAME_NONE if it is not in the table.
+template <typename TValue>
+inline unsigned findName(ReadNameTable<TValue> const & table, seqan::CharString const & name)
+{
+    if (table.size == 0)
+        return READ_NAME_NONE;
+    char const * bytes = seqan::begin(name, seqan::Standard());
+    size_t s = _findSlot(table, hashReadName(bytes, seqan::length(name)), bytes, seqan::length(name));
+    unsigned entry = table.slots[s].entry;
+    return entry == READ_NAME_TOMBSTONE ? READ_NAME_NONE : entry;
+}
+
+//Returns the handle of the name, adding it with a default value if it is not in the table yet.
+template <typename TValue>
+inline unsigned insertName(ReadNameTable<TValue> & table, seqan::CharString const & name)
+{
+    if ((table.size + table.tombstones + 1) * 4 > table.slots.size() * 3 ||
+        (table.deadBytes > 65536 && table.deadBytes * 2 > table.arena.size()))
+    {
+        size_t capacity = 16;
+        while (capacity < (table.size + 1) * 2)
+            capacity *= 2;
+        _rehash(table, capacity);
+    }
+    char const * bytes = seqan::begin(name, seqan::Standard());
+    size_t len = seqan::length(name);
+    __uint64 hash = hashReadName(bytes, len);
+    size_t s = _findSlot(table, hash, bytes, len);
+    typename ReadNameTable<TValue>::Slot & slot = table.slots[s];
+    if (slot.entry != READ_NAME_NONE && slot.entry != READ_NAME_TOMBSTONE)
+        return slot.entry;
+    if (slot.entry == READ_NAME_TOMBSTONE)
+        --table.tombstones;
+    unsigned entry;
+    if (table.freeEntries.empty())
+    {
+        entry = table.entries.size();
+        table.entries.push_back(typename ReadNameTable<TValue>::Entry());
+    }
+    else
+    {
+        entry = table.freeEntries.back();
+        table.freeEntries.pop_back();
+    }
+    typename ReadNameTable<TValue>::Entry & e = table.entries[entry];
+    e.hash = hash;
+    e.nameBegin = table.arena.size();
+    e.nameLength = len;
+    e.erased = false;
+    e.serial = table.nextSerial++;
+    e.expiry = READ_NAME_NO_EXPIRY;
+    table.arena.insert(table.arena.end(), bytes, bytes + len);
+    slot.hash = hash;
+    slot.entry = entry;
+    ++table.size;
+    table.maxSize = std::max(table.maxSize, table.size);
+    return entry;
+}
+
+//Empties the value of an erased entry, which is reused by the next name inserted. Values that own buffers overload this
+//to keep them.
+template <typename TValue>
+inline void _resetValue(TValue & value)
+{
+    value = TValue();
+}
+
+template <typename TValue>
+inline TValue & entryValue(ReadNameTable<TValue> & table, unsigned handle)
+{
+    return table.entries[handle].value;
+}
+
+template <typename TValue>
+inline bool _staleExpiry(ReadNameTable<TValue> const & table, ReadNameExpiry const & expiry)
+{
+    typename ReadNameTable<TValue>::Entry const & entry = table.entries[expiry.handle];
+    return entry.erased || entry.serial != expiry.serial || entry.expiry != expiry.pos;
+}
+
+//Counts an item of the expiry heap that has become stale and rebuilds the heap without them if they are the most.
+template <typename TValue>
+inline void _addStaleExpiry(ReadNameTable<TValue> & table)
+{
+    if (++table.staleExpiries < 64 || table.staleExpiries * 2 <= table.expiries.size())
+        return;
+    table.expiries.erase(std::remove_if(table.expiries.begin(), table.expiries.end(),
+                                        [&](ReadNameExpiry const & expiry) { return _staleExpiry(table, expiry); }),
+                         table.expiries.end());
+    std::make_heap(table.expiries.begin(), table.expiries.end(), std::greater<ReadNameExpiry>());
+    table.staleExpiries = 0;
+}
+
+template <typename TValue>
+inline void eraseHandle(ReadNameTable<TValue> & table, unsigned handle)
+{
+    typename ReadNameTable<TValue>::Entry & entry = table.entries[handle];
+    size_t mask = table.slots.size() - 1;
+    size_t s = entry.hash & mask;
+    while (table.slots[s].entry != handle)
+        s = (s + 1) & mask;
+    table.slots[s].entry = READ_NAME_TOMBSTONE;
+    ++table.tombstones;
+    --table.size;
+    table.deadBytes += entry.nameLength;
+    entry.erased = true;
+    _resetValue(entry.value);
+    table.freeEntries.push_back(handle);
+    if (entry.expiry != READ_NAME_NO_EXPIRY)
+        _addStaleExpiry(table);
+}
+
+template <typename TValue>
+inline void eraseName(ReadNameTable<TValue> & table, seqan::CharString const & name)
+{
+    unsigned handle = findName(table, name);
+    if (handle != READ_NAME_NONE)
+        eraseHandle(table, handle);
+}
+
+//Lets the entry be dropped once evictExpired() is called with a position past pos. The latest expiry set wins.
+template <typename TValue>
+inline void setExpiry(ReadNameTable<TValue> & table, unsigned handle, __int64 pos)
+{
+    typename ReadNameTable<TValue>::Entry & entry = table.entries[handle];
+    if (entry.expiry == pos)
+        return;
+    bool replaced = entry.expiry != READ_NAME_NO_EXPIRY;
+    entry.expiry = pos;
+    ReadNameExpiry expiry = {pos, handle, entry.serial};
+    table.expiries.push_back(expiry);
+    std::push_heap(table.expiries.begin(), table.expiries.end(), std::greater<ReadNameExpiry>());
+    if (replaced)
+        _addStaleExpiry(table);
+}
+
+//Erases the entries whose expiry position is before pos. Returns the number of erased entries.
+template <typename TValue>
+inline size_t evictExpired(ReadNameTable<TValue> & table, __int64 pos)
+{
+    size_t evicted = 0;
+    while (!table.expiries.empty() && table.expiries.front().pos < pos)
+    {
+        std::pop_heap(table.expiries.begin(), table.expiries.end(), std::greater<ReadNameExpiry>());
+        ReadNameExpiry expiry = table.expiries.back();
+        table.expiries.pop_back();
+        if (_staleExpiry(table, expiry))
+        {
+            --table.staleExpiries;
+            continue;
+        }
+        //Its item has left the heap, so erasing the entry leaves no stale one.
+        table.entries[expiry.handle].expiry = READ_NAME_NO_EXPIRY;
+        eraseHandle(table, expiry.handle);
+        ++evicted;
+    }
+    return evicted;
+}
+
+//Calls visit(entry, name) for every entry that has not been erased, in the order of their handles.
+template <typename TValue, typename TVisit>
+inline void visitEntries(ReadNameTable<TValue> const & table, TVisit visit)
+{
+    for (unsigned i = 0; i < table.entries.size(); ++i)
+        if (!table.entries[i].erased)
+            visit(table.entries[i], table.arena.data() + table.entries[i].nameBegin);
+}
+
+//Drops all entries. The high-water mark maxSize is kept.
+template <typename TValue>
+inline void clear(ReadNameTable<TValue> & table)
+{
+    size_t maxSize = table.maxSize;
+    table = ReadNameTable<TValue>();
+    table.maxSize = maxSize;
+}
+
+template <typename TValue>
+inline size_t length(ReadNameTable<TValue> const & table)
+{
+    return table.size;
+}
+
+#endif  // BAMSHRINK_READ_NAME_TABLE_H_
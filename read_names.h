@@ -0,0 +1,97 @@
+#ifndef BAMSHRINK_READ_NAMES_H_
+#define BAMSHRINK_READ_NAMES_H_
+
+#include <cstring>
+#include <seqan/sequence.h>
+#include "read_name_table.h"
+
+//How reads are renamed. Global names number the reads 0, 1, 2, ... in output order, so they can only be given by
+//whoever writes the output. Local names are ITEM.N, where ITEM is the interval or contig a read was filtered in and N
+//counts the reads of that item, so they can be given while filtering and do not depend on any other item.
+enum ReadNaming
+{
+    READ_NAMES_GLOBAL,
+    READ_NAMES_LOCAL
+};
+
+//Numbers for read names. Both reads of a pair get the same name: the number given to the first one is kept, by the
+//original name, until its mate is renamed.
+struct ReadNamer {
+    ReadNaming naming = READ_NAMES_GLOBAL;
+    seqan::CharString prefix;
+    unsigned item = 0;
+    unsigned next = 0;
+    ReadNameTable<seqan::Pair<unsigned> > numbers;
+
+    ReadNamer() {}
+    ReadNamer(ReadNaming naming_, seqan::CharString const & prefix_) : naming(naming_), prefix(prefix_) {}
+} ;
+
+//Starts the local numbering of the next interval or contig. Global numbering just goes on.
+inline void startItem(ReadNamer & namer, unsigned item)
+{
+    if (namer.naming != READ_NAMES_LOCAL)
+        return;
+    namer.item = item;
+    namer.next = 0;
+}
+
+//Two decimal digits for every value below 100.
+const char READ_NAME_DIGITS[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+inline unsigned countDigits(unsigned value)
+{
+    unsigned n = 1;
+    for (; value >= 100; value /= 100)
+        n += 2;
+    return n + (value >= 10);
+}
+
+//Writes the decimal digits of value backwards from the end of its countDigits() characters at out.
+inline void writeDigits(char * out, unsigned value)
+{
+    out += countDigits(value);
+    for (; value >= 100; value /= 100)
+    {
+        out -= 2;
+        memcpy(out, READ_NAME_DIGITS + 2 * (value % 100), 2);
+    }
+    if (value >= 10)
+        memcpy(out - 2, READ_NAME_DIGITS + 2 * value, 2);
+    else
+        out[-1] = '0' + value;
+}
+
+//Replaces the name in place with the prefix and number of the read. A read whose mate was renamed before gets its
+//number; a paired read that comes first leaves its number for the mate.
+inline void renameRead(seqan::CharString & qName, bool paired, ReadNamer & namer)
+{
+    seqan::Pair<unsigned> number(namer.item, namer.next);
+    unsigned handle = findName(namer.numbers, qName);
+    if (handle != READ_NAME_NONE)
+        number = entryValue(namer.numbers, handle);
+    else
+    {
+        if (paired)
+            entryValue(namer.numbers, insertName(namer.numbers, qName)) = number;
+        ++namer.next;
+    }
+    unsigned prefixLength = seqan::length(namer.prefix);
+    unsigned itemLength = namer.naming == READ_NAMES_LOCAL ? countDigits(number.i1) + 1 : 0;
+    seqan::resize(qName, prefixLength + itemLength + countDigits(number.i2));
+    char * out = seqan::begin(qName, seqan::Standard());
+    memcpy(out, seqan::begin(namer.prefix, seqan::Standard()), prefixLength);
+    out += prefixLength;
+    if (namer.naming == READ_NAMES_LOCAL)
+    {
+        writeDigits(out, number.i1);
+        out[itemLength - 1] = '.';
+        out += itemLength;
+    }
+    writeDigits(out, number.i2);
+}
+
+#endif  // BAMSHRINK_READ_NAMES_H_
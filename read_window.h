@@ -0,0 +1,193 @@
+#ifndef BAMSHRINK_READ_WINDOW_H_
+#define BAMSHRINK_READ_WINDOW_H_
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include "bam_raw_record.h"
+
+const unsigned READ_WINDOW_NONE = ~0u;
+
+//Reads waiting to be written, by begin position. The positions between the first and the last read map onto a ring of
+//buckets, each holding its reads as a list in the order they were added. The reads themselves live in a pool of
+//entries that are reused together with their buffers, so once the window has seen its largest number of reads adding
+//one allocates nothing. Dropping a read only marks its entry; entries go back to the pool when their position is
+//flushed. The ring doubles if the reads ever span more positions than it has buckets.
+struct ReadWindow {
+    struct Entry {
+        BamRawRecord record;
+        unsigned next;
+        bool dropped;
+    } ;
+
+    struct Bucket {
+        unsigned head;
+        unsigned tail;
+    } ;
+
+    std::deque<Entry> entries;
+    std::vector<unsigned> freeEntries;
+    std::vector<Bucket> buckets;
+    unsigned first = 0;
+    unsigned last = 0;
+    size_t size = 0;
+    size_t maxSize = 0;
+
+    //span is the number of positions the reads are expected to cover, such as the maximum fragment length.
+    ReadWindow(unsigned span = 0)
+    {
+        size_t capacity = 64;
+        while (capacity < 2 * (size_t)span)
+            capacity *= 2;
+        Bucket empty = {READ_WINDOW_NONE, READ_WINDOW_NONE};
+        buckets.assign(capacity, empty);
+    }
+} ;
+
+inline ReadWindow::Bucket & _bucket(ReadWindow & window, unsigned pos)
+{
+    return window.buckets[pos & (window.buckets.size() - 1)];
+}
+
+inline void _growReadWindow(ReadWindow & window, unsigned first, unsigned last)
+{
+    size_t capacity = window.buckets.size();
+    while (last - first >= capacity)
+        capacity *= 2;
+    ReadWindow::Bucket empty = {READ_WINDOW_NONE, READ_WINDOW_NONE};
+    std::vector<ReadWindow::Bucket> buckets(capacity, empty);
+    for (unsigned pos = window.first; window.size > 0 && pos - window.first <= window.last - window.first; ++pos)
+        buckets[pos & (capacity - 1)] = _bucket(window, pos);
+    window.buckets.swap(buckets);
+}
+
+//Number of reads in the window, including dropped reads whose position has not been flushed yet.
+inline size_t length(ReadWindow const & window)
+{
+    return window.size;
+}
+
+inline bool empty(ReadWindow const & window)
+{
+    return window.size == 0;
+}
+
+//First position with reads. The window must not be empty.
+inline unsigned firstPos(ReadWindow const & window)
+{
+    return window.first;
+}
+
+inline unsigned lastPos(ReadWindow const & window)
+{
+    return window.last;
+}
+
+//Moves the read into the window at its begin position, after the reads already there. The record keeps its fixed-size
+//fields and gets the buffers of a read that has been flushed, see moveRecord(). Returns the entry of the read.
+inline ReadWindow::Entry & moveRead(ReadWindow & window, BamRawRecord & record)
+{
+    unsigned pos = record.beginPos;
+    unsigned first = window.size == 0 ? pos : std::min(window.first, pos);
+    unsigned last = window.size == 0 ? pos : std::max(window.last, pos);
+    if (last - first >= window.buckets.size())
+        _growReadWindow(window, first, last);
+    unsigned e;
+    if (window.freeEntries.empty())
+    {
+        e = window.entries.size();
+        window.entries.push_back(ReadWindow::Entry());
+    }
+    else
+    {
+        e = window.freeEntries.back();
+        window.freeEntries.pop_back();
+    }
+    ReadWindow::Entry & entry = window.entries[e];
+    moveRecord(entry.record, record);
+    entry.next = READ_WINDOW_NONE;
+    entry.dropped = false;
+    ReadWindow::Bucket & bucket = _bucket(window, pos);
+    if (bucket.head == READ_WINDOW_NONE)
+        bucket.head = e;
+    else
+        window.entries[bucket.tail].next = e;
+    bucket.tail = e;
+    window.first = first;
+    window.last = last;
+    ++window.size;
+    window.maxSize = std::max(window.maxSize, window.size);
+    return entry;
+}
+
+//Number of reads at pos that have not been dropped.
+inline unsigned readsAt(ReadWindow & window, unsigned pos)
+{
+    unsigned n = 0;
+    for (unsigned e = _bucket(window, pos).head; e != READ_WINDOW_NONE; e = window.entries[e].next)
+        n += !window.entries[e].dropped;
+    return n;
+}
+
+//Calls visit(record) for every read that has not been dropped at the positions up to readyPos, position by position
+//and in the order they were added, and removes them all from the window.
+template <typename TVisit>
+inline void flushReads(ReadWindow & window, unsigned readyPos, TVisit visit)
+{
+    while (window.size > 0 && window.first <= readyPos)
+    {
+        ReadWindow::Bucket & bucket = _bucket(window, window.first);
+        for (unsigned e = bucket.head; e != READ_WINDOW_NONE; )
+        {
+            ReadWindow::Entry & entry = window.entries[e];
+            if (!entry.dropped)
+                visit(entry.record);
+            window.freeEntries.push_back(e);
+            --window.size;
+            e = entry.next;
+        }
+        bucket.head = bucket.tail = READ_WINDOW_NONE;
+        if (window.size == 0)
+            break;
+        do
+            ++window.first;
+        while (_bucket(window, window.first).head == READ_WINDOW_NONE);
+    }
+}
+
+//Calls visit(entry) for every read in the window, dropped or not, in the order flushReads() would, and keeps them.
+template <typename TVisit>
+inline void visitReads(ReadWindow & window, TVisit visit)
+{
+    for (unsigned pos = window.first; window.size > 0 && pos - window.first <= window.last - window.first; ++pos)
+        for (unsigned e = _bucket(window, pos).head; e != READ_WINDOW_NONE; e = window.entries[e].next)
+            visit(window.entries[e]);
+}
+
+//Drops the reads at the positions up to lastPos for which keep(record) is false.
+template <typename TKeep>
+inline void dropReads(ReadWindow & window, unsigned lastPos, TKeep keep)
+{
+    if (window.size == 0 || lastPos < window.first)
+        return;
+    lastPos = std::min(lastPos, window.last);
+    for (unsigned pos = window.first; pos - window.first <= lastPos - window.first; ++pos)
+        for (unsigned e = _bucket(window, pos).head; e != READ_WINDOW_NONE; e = window.entries[e].next)
+            if (!window.entries[e].dropped && !keep(window.entries[e].record))
+                window.entries[e].dropped = true;
+}
+
+//Removes all reads. The pooled entries are kept for reuse, as is the high-water mark maxSize.
+inline void clear(ReadWindow & window)
+{
+    ReadWindow::Bucket empty = {READ_WINDOW_NONE, READ_WINDOW_NONE};
+    if (window.size > 0)
+        for (unsigned pos = window.first; pos - window.first <= window.last - window.first; ++pos)
+            _bucket(window, pos) = empty;
+    window.freeEntries.clear();
+    for (unsigned e = 0; e < window.entries.size(); ++e)
+        window.freeEntries.push_back(e);
+    window.size = 0;
+}
+
+#endif  // BAMSHRINK_READ_WINDOW_H_
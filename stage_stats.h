@@ -0,0 +1,104 @@
+#ifndef BAMSHRINK_STAGE_STATS_H_
+#define BAMSHRINK_STAGE_STATS_H_
+
+#include <chrono>
+#include <ctime>
+#include <seqan/basic.h>
+
+//Wall time, CPU time and item counts of the stages a read goes through. Timing is off unless a StageTimer is given
+//somewhere to count into, so a disabled timer costs a test of a null pointer.
+
+enum Stage
+{
+    STAGE_DECOMPRESS,
+    STAGE_PARSE,
+    STAGE_HARD_CLIP,
+    STAGE_COVERAGE,
+    STAGE_QUALITY_FILTER,
+    STAGE_ADAPTERS,
+    STAGE_FLUSH,
+    STAGE_TAGS,
+    STAGE_WRITE,
+    STAGE_COMPRESS,
+    STAGE_COUNT
+};
+
+const char * const STAGE_NAMES[STAGE_COUNT] =
+{
+    "decompress", "parse", "remove_hard_clipped", "coverage_filter", "quality_filter", "adapter_removal",
+    "window_flush", "tag_filter", "write", "compress"
+};
+
+struct StageTotals {
+    __uint64 wallNanos = 0;
+    __uint64 cpuNanos = 0;
+    __uint64 items = 0;
+} ;
+
+struct StageStats {
+    StageTotals stages[STAGE_COUNT];
+
+    StageStats& operator+=(StageStats const & other)
+    {
+        for (unsigned s = 0; s < STAGE_COUNT; ++s)
+        {
+            stages[s].wallNanos += other.stages[s].wallNanos;
+            stages[s].cpuNanos += other.stages[s].cpuNanos;
+            stages[s].items += other.stages[s].items;
+        }
+        return *this;
+    }
+
+    StageStats& operator-=(StageStats const & other)
+    {
+        for (unsigned s = 0; s < STAGE_COUNT; ++s)
+        {
+            stages[s].wallNanos -= other.stages[s].wallNanos;
+            stages[s].cpuNanos -= other.stages[s].cpuNanos;
+            stages[s].items -= other.stages[s].items;
+        }
+        return *this;
+    }
+} ;
+
+inline __uint64 wallClockNanos()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//CPU time of the calling thread.
+inline __uint64 threadCpuNanos()
+{
+    timespec time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return (__uint64)time.tv_sec * 1000000000u + time.tv_nsec;
+}
+
+//Adds the time from its construction to its destruction, and one item, to totals unless totals is null. Timers of
+//stages that run inside other stages nest, so the outer stage includes the inner one.
+struct StageTimer {
+    StageTotals * totals;
+    __uint64 wallBegin;
+    __uint64 cpuBegin;
+
+    StageTimer(StageTotals * totals_) : totals(totals_)
+    {
+        if (totals == NULL)
+            return;
+        wallBegin = wallClockNanos();
+        cpuBegin = threadCpuNanos();
+    }
+
+    ~StageTimer()
+    {
+        if (totals == NULL)
+            return;
+        totals->cpuNanos += threadCpuNanos() - cpuBegin;
+        totals->wallNanos += wallClockNanos() - wallBegin;
+        ++totals->items;
+    }
+
+    StageTimer(StageTimer const &) = delete;
+} ;
+
+#endif  // BAMSHRINK_STAGE_STATS_H_